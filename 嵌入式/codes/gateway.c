@@ -0,0 +1,490 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// 串口到聊天服务器的网关：向板子（task2）订阅模式5连续遥测，以设备用户身份登录 task3s，
+// 把报警状态变化和周期汇总以 MSG 发给订阅者。订阅者就是设备用户的好友（用户 ADDFRIEND 设备即订阅）。
+// 报警抖动时窗口内的多次变化合并成一条消息，同一时刻待发的多条内容拼成一条 MSG 批量发出
+#define GW_DEVICE "/dev/ttyUSB0"
+#define GW_SERVER "127.0.0.1"
+#define GW_PORT 2333
+#define GW_USER "board"
+#define GW_PASS "board"
+#define GW_DECIM 10                // 订阅抽取比：100Hz/10 = 10 读数/秒
+#define GW_COALESCE_MS 5000        // 两条报警消息的最小间隔，期间的变化合并
+#define GW_SUMMARY_S 60            // 周期汇总间隔
+#define GW_FRIENDS_REFRESH_S 30    // 重新获取订阅者列表的间隔
+#define GW_STREAM_TIMEOUT_MS 3000  // 这么久没有遥测帧就重新订阅
+#define GW_REPLY_TIMEOUT_MS 2000
+#define GW_RECONNECT_MAX_S 30
+#define GW_MAX_SUBS 32
+#define GW_MSG_MAX 800             // 一条 MSG 正文的上限（服务器缓冲区 1024 字节）
+#define GW_MSG_RESERVE 32          // 留给丢弃提示的空间
+#define GW_PATH_MAX 64
+#define BUFFER_SIZE 1024
+
+const char *g_status_names[] = {"ok", "HIGH", "LOW", "VIB"};
+const int g_stream_bauds[] = {0, 9600, 115200, 460800};
+
+typedef struct {
+    // 报警变化合并
+    int status;              // 当前报警状态，-1 表示还没收到读数
+    int changes;             // 尚未发出的状态变化次数
+    char path[GW_PATH_MAX];  // 变化轨迹，如 "ok>HIGH>ok>HIGH"
+    int r_min, r_max, r_last;
+    long long last_alert_ms; // 上一条报警消息的时间
+    // 周期汇总
+    long long summary_ms;
+    unsigned int n, in_alarm, total_changes, lost;
+    long long r_sum;
+    int s_min, s_max;
+    int expected_seq;        // -1 表示未同步
+    long long last_frame_ms;
+} gw_state_t;
+
+// 待发内容和订阅者
+char g_outbox[GW_MSG_MAX];
+int g_outbox_len = 0;
+unsigned int g_outbox_dropped = 0;
+char g_subs[GW_MAX_SUBS][256];
+int g_n_subs = 0;
+// 服务器的帧以 '\n' 结尾，一次 recv 可能收到多帧或半帧
+char g_srv_rx[BUFFER_SIZE * 4];
+int g_srv_rx_len = 0;
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 打开串口并设为原始模式；PTY 也可以，便于不接板子测试
+int serial_open(const char *path, int baud) {
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    struct termios t;
+    if (tcgetattr(fd, &t) == 0) {
+        cfmakeraw(&t);
+        speed_t sp = baud == 460800 ? B460800 : (baud == 115200 ? B115200 : B9600);
+        cfsetispeed(&t, sp);
+        cfsetospeed(&t, sp);
+        t.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(fd, TCSANOW, &t);
+    }
+    return fd;
+}
+
+void serial_set_baud(int fd, int baud) {
+    struct termios t;
+    if (tcgetattr(fd, &t) != 0) return;
+    speed_t sp = baud == 460800 ? B460800 : (baud == 115200 ? B115200 : B9600);
+    cfsetispeed(&t, sp);
+    cfsetospeed(&t, sp);
+    tcsetattr(fd, TCSADRAIN, &t);
+}
+
+unsigned char bcc(const unsigned char *p, int len) {
+    unsigned char x = 0;
+    for (int i = 0; i < len; i++) {
+        x ^= p[i];
+    }
+    return x;
+}
+
+// 模式5订阅命令 {7B 05 波特率代码 抽取比 标志 7D}，不加密
+void stream_subscribe(int fd, int code, int decim) {
+    unsigned char cmd[6] = {0x7B, 0x05, code, decim, 0, 0x7D};
+    if (write(fd, cmd, sizeof(cmd)) != sizeof(cmd)) perror("serial write");
+}
+
+// 发送一条命令（以 '\n' 结尾）
+int server_send(int sock, const char *fmt, ...) {
+    char buf[BUFFER_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf) - 1) len = sizeof(buf) - 2;
+    buf[len++] = '\n';
+    return send(sock, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// 从接收缓冲区取出一帧（去掉 '\n'），没有完整的帧返回 -1
+int server_pop_frame(char *frame, int size) {
+    char *nl = memchr(g_srv_rx, '\n', g_srv_rx_len);
+    if (!nl) return -1;
+    int len = nl - g_srv_rx;
+    int n = len < size - 1 ? len : size - 1;
+    memcpy(frame, g_srv_rx, n);
+    frame[n] = '\0';
+    g_srv_rx_len -= len + 1;
+    memmove(g_srv_rx, nl + 1, g_srv_rx_len);
+    return n;
+}
+
+// 读一次套接字追加到接收缓冲区，断开返回 -1
+int server_fill(int sock) {
+    if (g_srv_rx_len == (int)sizeof(g_srv_rx)) g_srv_rx_len = 0;  // 超长的帧丢弃
+    int n = recv(sock, g_srv_rx + g_srv_rx_len, sizeof(g_srv_rx) - g_srv_rx_len, 0);
+    if (n <= 0) return -1;
+    g_srv_rx_len += n;
+    return n;
+}
+
+// 好友列表应答 "FRIENDS$a$b..." 就是订阅者列表
+void parse_friends(char *reply) {
+    char *save = NULL;
+    g_n_subs = 0;
+    strtok_r(reply, "$", &save);
+    for (char *name = strtok_r(NULL, "$", &save); name && g_n_subs < GW_MAX_SUBS; name = strtok_r(NULL, "$", &save)) {
+        snprintf(g_subs[g_n_subs++], sizeof(g_subs[0]), "%s", name);
+    }
+}
+
+// 处理服务器主动发来的数据：好友列表应答、失败提示、别人发给设备的消息
+void handle_server_data(char *buf) {
+    if (strncmp(buf, "FRIENDS", 7) == 0) {
+        parse_friends(buf);
+    } else if (strncmp(buf, "FAIL$", 5) == 0) {
+        printf("Server: %s\n", buf + 5);
+    } else if (strncmp(buf, "MSG$", 4) == 0) {
+        printf("Message to device: %s\n", buf + 4);
+    }
+}
+
+// 等待一条应答，期间收到的其他数据照常处理；返回应答长度，超时或断开返回 -1
+int server_wait_reply(int sock, const char *prefix, char *reply, int size) {
+    long long deadline = now_ms() + GW_REPLY_TIMEOUT_MS;
+    while (1) {
+        int len;
+        while ((len = server_pop_frame(reply, size)) >= 0) {
+            if (strncmp(reply, prefix, strlen(prefix)) == 0 || strncmp(reply, "FAIL$", 5) == 0) return len;
+            handle_server_data(reply);
+        }
+        if (now_ms() >= deadline) return -1;
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, (int)(deadline - now_ms())) <= 0) continue;
+        if (server_fill(sock) < 0) return -1;
+    }
+}
+
+// 连接服务器并以设备用户登录，首次使用时先注册；失败返回 -1
+int server_connect(const char *host, int port, const char *user, const char *pass) {
+    struct sockaddr_in addr;
+    char reply[BUFFER_SIZE];
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    g_srv_rx_len = 0;
+    // 用户已存在时注册失败，不影响登录
+    if (server_send(sock, "REG$%s$%s", user, pass) != 0 || server_wait_reply(sock, "OK$", reply, sizeof(reply)) < 0 ||
+        server_send(sock, "LOGIN$%s$%s", user, pass) != 0 || server_wait_reply(sock, "OK$", reply, sizeof(reply)) < 0 ||
+        strncmp(reply, "OK$", 3) != 0) {
+        printf("Login as %s failed\n", user);
+        close(sock);
+        return -1;
+    }
+    if (server_send(sock, "FRIENDS") == 0 && server_wait_reply(sock, "FRIENDS", reply, sizeof(reply)) > 0 &&
+        strncmp(reply, "FRIENDS", 7) == 0) {
+        parse_friends(reply);
+    }
+    printf("Logged in as %s, %d subscriber(s)\n", user, g_n_subs);
+    return sock;
+}
+
+// 追加一行待发内容；放不下时丢弃这一行并计数，发送时附上丢弃的行数
+void outbox_add(const char *fmt, ...) {
+    char line[GW_MSG_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    int sep = g_outbox_len > 0 ? 3 : 0;
+    if (g_outbox_len + sep + len >= GW_MSG_MAX - GW_MSG_RESERVE) {
+        g_outbox_dropped++;
+        return;
+    }
+    if (sep) memcpy(g_outbox + g_outbox_len, " | ", sep);
+    memcpy(g_outbox + g_outbox_len + sep, line, len + 1);
+    g_outbox_len += sep + len;
+}
+
+// 把待发内容作为一条 MSG 发给每个订阅者
+int outbox_flush(int sock) {
+    if (g_outbox_len == 0 || sock < 0) return 0;
+    if (g_outbox_dropped) {
+        snprintf(g_outbox + g_outbox_len, GW_MSG_MAX - g_outbox_len, " | (%u lines dropped)", g_outbox_dropped);
+        g_outbox_dropped = 0;
+    }
+    for (int i = 0; i < g_n_subs; i++) {
+        if (server_send(sock, "MSG$%s$%s", g_subs[i], g_outbox) != 0) return -1;
+    }
+    if (g_n_subs > 0) printf("Sent to %d subscriber(s): %s\n", g_n_subs, g_outbox);
+    g_outbox_len = 0;
+    g_outbox[0] = '\0';
+    return 0;
+}
+
+void clock_str(char *buf, int size) {
+    time_t t = time(NULL);
+    strftime(buf, size, "%H:%M:%S", localtime(&t));
+}
+
+void summary_reset(gw_state_t *st, long long now) {
+    st->summary_ms = now;
+    st->n = st->in_alarm = st->total_changes = st->lost = 0;
+    st->r_sum = 0;
+    st->s_min = 0x3FFF;
+    st->s_max = 0;
+}
+
+// 报警消息：距上一条已满 GW_COALESCE_MS 时把积累的变化合并成一行
+void alert_check(gw_state_t *st, long long now) {
+    char ts[16];
+    if (st->changes == 0 || now - st->last_alert_ms < GW_COALESCE_MS) return;
+    clock_str(ts, sizeof(ts));
+    if (st->changes == 1 && st->status == 0) {
+        outbox_add("%s alarm cleared r=%d", ts, st->r_last);
+    } else if (st->changes == 1) {
+        outbox_add("%s alarm %s r=%d", ts, g_status_names[st->status], st->r_last);
+    } else {
+        outbox_add("%s alarm changed %d times (%s), now %s r=%d, range %d-%d", ts, st->changes, st->path,
+                   g_status_names[st->status], st->r_last, st->r_min, st->r_max);
+    }
+    st->last_alert_ms = now;
+    st->changes = 0;
+}
+
+void summary_check(gw_state_t *st, long long now) {
+    char ts[16];
+    long long span = now - st->summary_ms;
+    if (span < GW_SUMMARY_S * 1000LL) return;
+    clock_str(ts, sizeof(ts));
+    if (st->n == 0) {
+        outbox_add("%s summary %llds: no telemetry", ts, span / 1000);
+    } else {
+        outbox_add("%s summary %llds: %u readings, r min/avg/max %d/%lld/%d, alarm %u%%, %u changes, %u frames lost",
+                   ts, span / 1000, st->n, st->s_min, st->r_sum / st->n, st->s_max, st->in_alarm * 100 / st->n,
+                   st->total_changes, st->lost);
+    }
+    summary_reset(st, now);
+}
+
+// 处理一个读数：累计汇总，报警状态变化时记入合并窗口
+void on_reading(gw_state_t *st, int r, int status) {
+    if (status > 3) status = 0;
+    st->n++;
+    st->r_sum += r;
+    if (r < st->s_min) st->s_min = r;
+    if (r > st->s_max) st->s_max = r;
+    if (status != 0) st->in_alarm++;
+
+    if (st->status < 0) {
+        st->status = status;
+        if (status != 0) {
+            st->changes = 1;
+            st->r_min = st->r_max = st->r_last = r;
+            snprintf(st->path, sizeof(st->path), "%s", g_status_names[status]);
+        }
+        return;
+    }
+    if (st->changes) {
+        if (r < st->r_min) st->r_min = r;
+        if (r > st->r_max) st->r_max = r;
+        st->r_last = r;
+    }
+    if (status == st->status) return;
+    if (st->changes == 0) {
+        snprintf(st->path, sizeof(st->path), "%s", g_status_names[st->status]);
+        st->r_min = st->r_max = r;
+    }
+    int len = strlen(st->path);
+    if (len + 8 < GW_PATH_MAX) {
+        snprintf(st->path + len, GW_PATH_MAX - len, ">%s", g_status_names[status]);
+    } else if (st->path[len - 1] != '.') {
+        snprintf(st->path + len, GW_PATH_MAX - len, ">...");
+    }
+    st->r_last = r;
+    st->status = status;
+    st->changes++;
+    st->total_changes++;
+}
+
+// 从串口缓冲区切出遥测帧（格式见 host_computer.py 的 parse_stream_frames），返回消耗的字节数。
+// 加密的 'E' 帧网关没有密钥，只用来统计丢帧；频谱帧 'P'/'Q' 有自己的序号，跳过
+int parse_stream(gw_state_t *st, const unsigned char *buf, int len, int *acked, long long now) {
+    int pos = 0;
+    while (1) {
+        while (pos < len && buf[pos] != 0x7B) pos++;
+        if (len - pos < 6) return pos;
+        const unsigned char *f = buf + pos;
+        int total;
+        if (f[1] == 0x05) {
+            total = 6;
+        } else if (f[1] == 'K') {
+            total = 6 + 12;
+        } else if (f[1] == 'S' || f[1] == 'E' || f[1] == 'P' || f[1] == 'Q') {
+            total = 5 + 2 * f[4] + 2;
+        } else {
+            pos++;
+            continue;
+        }
+        if (len - pos < total) return pos;
+        if (f[total - 1] != 0x7D || bcc(f, total - 2) != f[total - 2]) {
+            pos++;  // 校验失败，从下一个字节重新同步
+            continue;
+        }
+        if (f[1] == 0x05 || f[1] == 'K') {
+            *acked = f[3];
+        } else if (f[1] == 'P' || f[1] == 'Q') {
+            st->last_frame_ms = now;
+        } else {
+            int seq = f[2] << 8 | f[3];
+            if (st->expected_seq >= 0 && seq != st->expected_seq) st->lost += (seq - st->expected_seq) & 0xFFFF;
+            st->expected_seq = (seq + 1) & 0xFFFF;
+            st->last_frame_ms = now;
+            for (int i = 0; f[1] == 'S' && i < f[4]; i++) {
+                int v = f[5 + 2 * i] << 8 | f[6 + 2 * i];
+                on_reading(st, v & 0x3FFF, v >> 14);
+            }
+        }
+        pos += total;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *device = GW_DEVICE, *host = GW_SERVER, *user = GW_USER, *pass = GW_PASS;
+    int port = GW_PORT, code = 1, decim = GW_DECIM;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:p:u:w:b:n:")) != -1) {
+        if (opt == 'd') {
+            device = optarg;
+        } else if (opt == 's') {
+            host = optarg;
+        } else if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'u') {
+            user = optarg;
+        } else if (opt == 'w') {
+            pass = optarg;
+        } else if (opt == 'b') {
+            code = atoi(optarg);
+        } else if (opt == 'n') {
+            decim = atoi(optarg);
+        } else {
+            printf("Usage: %s [-d serial_device] [-s server_ip] [-p port] [-u user] [-w password]\n"
+                   "          [-b 1|2|3 (9600/115200/460800)] [-n decimation]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    if (code < 1 || code > 3 || decim < 1 || decim > 255) {
+        printf("bad baud code or decimation\n");
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);  // 作为服务运行时日志及时写出
+    int fd = serial_open(device, 9600);
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+
+    gw_state_t st;
+    unsigned char rx[4096];
+    int rx_len = 0;
+    int sock = -1;
+    int backoff = 1;
+    long long next_connect = 0, next_subscribe = 0, next_friends = 0;
+    long long now = now_ms();
+
+    memset(&st, 0, sizeof(st));
+    st.status = -1;
+    st.expected_seq = -1;
+    st.last_alert_ms = now - GW_COALESCE_MS;
+    summary_reset(&st, now);
+
+    while (1) {
+        now = now_ms();
+        if (sock < 0 && now >= next_connect) {
+            sock = server_connect(host, port, user, pass);
+            if (sock < 0) {
+                printf("Server %s:%d unavailable, retry in %d s\n", host, port, backoff);
+                next_connect = now + backoff * 1000LL;
+                if (backoff < GW_RECONNECT_MAX_S) backoff *= 2;
+            } else {
+                backoff = 1;
+                next_friends = now + GW_FRIENDS_REFRESH_S * 1000LL;
+            }
+        }
+        // 订阅应答按 9600 发出，之后板子切到订阅的波特率；遥测中断时回到 9600 重新订阅
+        if (now - st.last_frame_ms > GW_STREAM_TIMEOUT_MS && now >= next_subscribe) {
+            serial_set_baud(fd, 9600);
+            stream_subscribe(fd, code, decim);
+            st.expected_seq = -1;
+            next_subscribe = now + GW_STREAM_TIMEOUT_MS;
+        }
+        if (sock >= 0 && now >= next_friends) {
+            server_send(sock, "FRIENDS");
+            next_friends = now + GW_FRIENDS_REFRESH_S * 1000LL;
+        }
+
+        struct pollfd pfd[2] = {{fd, POLLIN, 0}, {sock, POLLIN, 0}};
+        poll(pfd, sock >= 0 ? 2 : 1, 200);
+        now = now_ms();
+
+        if (pfd[0].revents & POLLIN) {
+            int n = read(fd, rx + rx_len, sizeof(rx) - rx_len);
+            if (n > 0) {
+                int acked = -1;
+                rx_len += n;
+                int used = parse_stream(&st, rx, rx_len, &acked, now);
+                memmove(rx, rx + used, rx_len - used);
+                rx_len -= used;
+                if (rx_len == (int)sizeof(rx)) rx_len = 0;  // 全是无法解析的数据
+                if (acked >= 0) {
+                    printf("Subscribed: %d bps, decimation %d\n", g_stream_bauds[code], acked);
+                    serial_set_baud(fd, g_stream_bauds[code]);
+                    st.last_frame_ms = now;
+                }
+            }
+        }
+        if (sock >= 0 && pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buf[BUFFER_SIZE];
+            if (server_fill(sock) < 0) {
+                printf("Server disconnected\n");
+                close(sock);
+                sock = -1;
+            } else {
+                while (server_pop_frame(buf, sizeof(buf)) >= 0) handle_server_data(buf);
+            }
+        }
+
+        alert_check(&st, now);
+        summary_check(&st, now);
+        if (sock >= 0 && outbox_flush(sock) != 0) {
+            printf("Server send failed\n");
+            close(sock);
+            sock = -1;
+        }
+    }
+    return 0;
+}
@@ -9,37 +9,108 @@
 #include <stdint.h>     // 定义标准整数类型（如 int32_t）
 #include <termios.h>    // 终端 I/O 设置
 #include <math.h>       // 数学库函数，比如 log()
+#include <stdbool.h>    // bool 类型
+#include <time.h>       // clock_gettime() 单调时钟
+#include <pthread.h>    // PWM 定时线程
+#include <sys/ioctl.h>  // ioctl() 控制 LED 和蜂鸣器
 
-// 从 ADC 设备读取数值，并转换为阻值
-int read_adc_value(int fd_adc, char *buffer)
+#define SAMPLE_US 100000 // 采样间隔 100ms，LED 闪烁不再占用采样时间
+
+// 默认标定：码值 c 对应阻值 c*10000/4095（10kΩ 电位器），用宏在编译期展开成4096项的表
+#define ADC_CODES 4096
+#define CAL_OHM(c) ((c) * 10000 / 4095)
+#define CAL_T4(c) CAL_OHM(c), CAL_OHM((c) + 1), CAL_OHM((c) + 2), CAL_OHM((c) + 3)
+#define CAL_T16(c) CAL_T4(c), CAL_T4((c) + 4), CAL_T4((c) + 8), CAL_T4((c) + 12)
+#define CAL_T64(c) CAL_T16(c), CAL_T16((c) + 16), CAL_T16((c) + 32), CAL_T16((c) + 48)
+#define CAL_T256(c) CAL_T64(c), CAL_T64((c) + 64), CAL_T64((c) + 128), CAL_T64((c) + 192)
+#define CAL_T1024(c) CAL_T256(c), CAL_T256((c) + 256), CAL_T256((c) + 512), CAL_T256((c) + 768)
+#define CAL_T4096(c) CAL_T1024(c), CAL_T1024((c) + 1024), CAL_T1024((c) + 2048), CAL_T1024((c) + 3072)
+
+// 查找表：阻值在编译期生成，闪烁周期和报警判断在启动时按码值算好，采样时只查表
+const uint16_t g_default_ohms[ADC_CODES] = {CAL_T4096(0)};
+float g_period_lin[ADC_CODES];  // 任务3/4：周期 = 1000 / r
+float g_period_log[ADC_CODES];  // 任务5：周期 = 0.25 / (0.125 + log(r/1000))
+uint8_t g_alarm[ADC_CODES];     // 1 表示 r < 1000 或 r > 9000
+
+// 软件PWM引擎：一个定时线程驱动所有输出通道，按最近的翻转时刻睡眠，只在电平变化时调用ioctl
+#define PWM_CHANNELS 3  // 0、1 为两个LED，2 为蜂鸣器
+#define PWM_BUZZER 2
+
+enum { PWM_OFF, PWM_ON, PWM_BLINK, PWM_CHIRP, PWM_BURST };
+
+typedef struct {
+    int pattern;
+    long period_us;   // 闪烁周期；CHIRP 为起始周期
+    long period2_us;  // CHIRP 终止周期
+    long span_us;     // CHIRP 一次扫频的时长；BURST 两组脉冲之间的间隔
+    int duty;         // 占空比（千分比）
+    int count;        // BURST 每组脉冲数
+    bool on;          // 当前电平
+    int hw;           // 已写入硬件的电平，-1 表示未知
+    long long start_us;
+    long long next_us;  // 下一次翻转的时刻
+    int pulse;          // BURST 本组已输出的脉冲数
+} pwm_channel_t;
+
+typedef struct {
+    pwm_channel_t ch[PWM_CHANNELS];
+    int fd_led, fd_bz;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pwm_t;
+
+int pwm_start(pwm_t *pw, int fd_led, int fd_bz);
+void pwm_set(pwm_t *pw, int ch, int pattern, float freq, float duty, float freq2, long span_ms, int count);
+void *pwm_thread(void *arg);
+
+// 从 ADC 设备读取原始码值（0~4095），失败返回 0
+int read_adc_code(int fd_adc, char *buffer)
 {
     int len = read(fd_adc, buffer, 10); // 从 /dev/adc 读取最多 10 字节存入 buffer
-    if (len == 0) // 如果读取失败或没数据
+    int code = 0;
+    if (len <= 0) // 如果读取失败或没数据
     {
         printf("ADC read error \n");
-        return;   // 没有返回具体值（有点不规范，最好 return -1）
+        return 0;
+    }
+    for (int i = 0; i < len && buffer[i] >= '0' && buffer[i] <= '9'; i++) // 逐位解析十进制文本
+    {
+        code = code * 10 + (buffer[i] - '0');
     }
-    return atoi(buffer) * 10000 / 4095; // 将 ADC 数字量转为阻值（按 10kΩ 电阻换算）
+    return code < ADC_CODES ? code : ADC_CODES - 1;
 }
 
-// 控制 LED 闪烁
-void led_blink(int fd_led, float duty, float period)//duty应该是灭灯占的比例
+// 从 ADC 设备读取数值，并转换为阻值（查编译期生成的表，按 10kΩ 电阻换算）
+int read_adc_value(int fd_adc, char *buffer)
+{
+    return g_default_ohms[read_adc_code(fd_adc, buffer)];
+}
+
+// 按码值预先计算闪烁周期和报警判断，之后采样路径上不再调用 log()
+void build_tables(void)
 {
-    // 点亮 LED
-    ioctl(fd_led, 0, 0); // LED 设备控制（参数含义根据驱动定义）
-    ioctl(fd_led, 0, 1);
-    // 保持亮的时间 = 周期 * 占空比
-    usleep((int)(1000000 * period * duty));
-
-    // 打印调试信息
-    printf("Period=%f,duty=%f\n", period , duty);
-    printf("T value: %d\n", (int)(1000000 *period * duty));
-
-    // 熄灭 LED
-    ioctl(fd_led, 1, 0);//第三个参数是灯号，1是灭，0是亮
-    ioctl(fd_led, 1, 1);
-    // 保持灭的时间 = 周期 * (1-占空比)
-    usleep((int)(1000000 * period * (1 - duty)));
+    for (int c = 0; c < ADC_CODES; c++)
+    {
+        int r = g_default_ohms[c];
+        g_period_lin[c] = r > 0 ? 1 * 1000.0 / r : 0;
+        g_period_log[c] = 0.25 / (0.125 + log(r / 1000));
+        g_alarm[c] = r < 1000 || r > 9000;
+    }
+}
+
+// 控制 LED 闪烁：只配置两个 LED 通道后立即返回，翻转由 PWM 线程完成
+void led_blink(pwm_t *pw, float duty, float period)
+{
+    pwm_set(pw, 0, PWM_BLINK, 1 / period, duty, 0, 0, 0);
+    pwm_set(pw, 1, PWM_BLINK, 1 / period, duty, 0, 0, 0);
+}
+
+// 报警：LED 常亮，蜂鸣器 1 秒周期鸣响
+void alarm_on(pwm_t *pw)
+{
+    pwm_set(pw, 0, PWM_ON, 0, 0, 0, 0, 0);
+    pwm_set(pw, 1, PWM_ON, 0, 0, 0, 0, 0);
+    pwm_set(pw, PWM_BUZZER, PWM_BLINK, 1, 0.5, 0, 0, 0);
 }
 
 int main()
@@ -53,6 +124,8 @@ int main()
     char *buzzer = "/dev/buzzer_ctl";  // 蜂鸣器设备文件路径
     char buffer[16];  // 存放 ADC 读取结果的缓冲区
     int r = 0;        // 阻值变量
+    int code = 0;     // ADC 码值
+    pwm_t pwm;        // LED/蜂鸣器 PWM 引擎
 
     // 打开 ADC 设备
     if ((fd_adc = open(adc, O_RDWR | O_NOCTTY | O_NDELAY)) < 0)//可读可写；如果打开的文件是终端设备，不要设为当前进程的控制终端；非阻塞式
@@ -75,8 +148,16 @@ int main()
         return;
     }
 
-    // 初始化 buffer
+    // 启动 PWM 引擎（所有输出先熄灭）
+    if (pwm_start(&pwm, fd_led, fd_bz) != 0)
+    {
+        printf("start pwm error\n");
+        return;
+    }
+
+    // 初始化 buffer 和查找表
     memset(buffer, 0, sizeof(buffer));
+    build_tables();
 
     // 主循环：菜单选择
     while (1)
@@ -102,9 +183,10 @@ int main()
 
         case 2:
             // 任务 2: LED 按 0.5 占空比，1 秒周期闪烁
+            led_blink(&pwm, 0.5, 1);
             while (1)
             {
-                led_blink(fd_led, 0.5, 1);
+                pause();
             }
             break;
 
@@ -112,56 +194,54 @@ int main()
             // 任务 3: LED 闪烁周期随阻值变化
             while(1)
             {
-                r = read_adc_value(fd_adc, buffer);
+                code = read_adc_code(fd_adc, buffer);
+                r = g_default_ohms[code];
                 printf("R value: %d\n", r);
                 // 周期 = 1000.0 / r 秒，阻值越大，周期越短
-                led_blink(fd_led, 0.5, 1 * 1000.0/r); 
+                led_blink(&pwm, 0.5, g_period_lin[code]);
+                usleep(SAMPLE_US);
             }
 
         case 4:
             // 任务 4: 阻值过小(<1000) 或过大(>9000) 时蜂鸣器报警
             while(1)
             {
-                r = read_adc_value(fd_adc, buffer);
+                code = read_adc_code(fd_adc, buffer);
+                r = g_default_ohms[code];
                 printf("R value: %d\n", r);
-                if (r < 1000 || r > 9000)
+                if (g_alarm[code])
                 {
                     // 亮灯并蜂鸣器响
-                    ioctl(fd_led, 1, 0);
-                    ioctl(fd_led, 1, 1);
-                    ioctl(fd_bz, 1);   // 打开蜂鸣器
-                    usleep(500000);
-                    ioctl(fd_bz, 0);   // 关闭蜂鸣器
-                    usleep(500000);
+                    alarm_on(&pwm);
                 }
                 else
                 {
                     // 正常模式：按阻值控制 LED 闪烁
-                    led_blink(fd_led, 0.5, 1 * 1000.0/r);
+                    pwm_set(&pwm, PWM_BUZZER, PWM_OFF, 0, 0, 0, 0, 0);
+                    led_blink(&pwm, 0.5, g_period_lin[code]);
                 }
+                usleep(SAMPLE_US);
             }
 
         case 5:
             // 任务 5: 类似 case 4，但闪烁频率用对数函数控制
             while(1){
-                r = read_adc_value(fd_adc, buffer);
+                code = read_adc_code(fd_adc, buffer);
+                r = g_default_ohms[code];
                 printf("R value: %d\n", r);
-                if (r < 1000 || r > 9000)
+                if (g_alarm[code])
                 {
                     // 阻值异常 -> 报警
-                    ioctl(fd_led, 1, 0);
-                    ioctl(fd_led, 1, 1);
-                    ioctl(fd_bz, 1);
-                    usleep(500000);
-                    ioctl(fd_bz, 0);
-                    usleep(500000);
+                    alarm_on(&pwm);
                 }
                 else
                 {
                     // 周期 = 0.25 / (0.125 + log(r/1000))
                     // 频率 = (0.125 + ln(r/1000)) * 4，范围大约 0.5Hz - 8.5Hz
-                    led_blink(fd_led, 0.5, 0.25 / (0.125 + log(r / 1000))); 
+                    pwm_set(&pwm, PWM_BUZZER, PWM_OFF, 0, 0, 0, 0, 0);
+                    led_blink(&pwm, 0.5, g_period_log[code]);
                 }
+                usleep(SAMPLE_US);
             }
             break;
 
@@ -176,3 +256,151 @@ int main()
     }
     return 0;
 }
+
+static long long pwm_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void pwm_output(pwm_t *pw, int ch, bool on)
+{
+    if (ch == PWM_BUZZER)
+    {
+        ioctl(pw->fd_bz, on ? 1 : 0);
+    }
+    else
+    {
+        ioctl(pw->fd_led, on ? 1 : 0, ch);
+    }
+}
+
+// CHIRP 的周期在 span 内从 period 线性变化到 period2，然后重新开始
+static long pwm_period_us(pwm_channel_t *c, long long t)
+{
+    if (c->pattern != PWM_CHIRP) return c->period_us;
+    long long pos = (t - c->start_us) % c->span_us;
+    return c->period_us + (long)((c->period2_us - c->period_us) * pos / c->span_us);
+}
+
+// 翻转一次电平并计算下一次翻转时刻
+static void pwm_advance(pwm_channel_t *c)
+{
+    long period = pwm_period_us(c, c->next_us);
+    long on_us = period * c->duty / 1000;
+    if (c->on)
+    {
+        c->on = false;
+        c->next_us += period - on_us;
+        if (c->pattern == PWM_BURST && ++c->pulse >= c->count)
+        {
+            c->pulse = 0;
+            c->next_us += c->span_us;
+        }
+    }
+    else
+    {
+        c->on = true;
+        c->next_us += on_us;
+    }
+}
+
+int pwm_start(pwm_t *pw, int fd_led, int fd_bz)
+{
+    pthread_condattr_t attr;
+    pthread_t tid;
+
+    memset(pw, 0, sizeof(*pw));
+    pw->fd_led = fd_led;
+    pw->fd_bz = fd_bz;
+    for (int i = 0; i < PWM_CHANNELS; i++)
+    {
+        pw->ch[i].hw = -1;  // 启动时把所有输出写成熄灭
+    }
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pw->cond, &attr);
+    if (pthread_create(&tid, NULL, pwm_thread, pw) != 0)
+    {
+        perror("pwm pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// 配置通道输出。freq 为闪烁频率(Hz)，duty 为亮的比例；CHIRP 在 span_ms 内扫到 freq2，
+// BURST 每 count 个脉冲后停 span_ms。同一模式下只更新参数、保持相位，可以每个采样周期调用
+void pwm_set(pwm_t *pw, int ch, int pattern, float freq, float duty, float freq2, long span_ms, int count)
+{
+    pwm_channel_t *c = &pw->ch[ch];
+
+    if (pattern >= PWM_BLINK && (freq <= 0 || duty <= 0)) pattern = PWM_OFF;
+    if (pattern >= PWM_BLINK && duty >= 1) pattern = PWM_ON;
+    if (pattern == PWM_CHIRP && (freq2 <= 0 || span_ms <= 0)) pattern = PWM_BLINK;
+    if (pattern == PWM_BURST && count <= 0) pattern = PWM_BLINK;
+
+    pthread_mutex_lock(&pw->lock);
+    bool restart = c->pattern != pattern;
+    c->pattern = pattern;
+    if (pattern >= PWM_BLINK)
+    {
+        c->period_us = freq > 1000 ? 1000 : (long)(1000000 / freq);
+        c->period2_us = pattern == PWM_CHIRP ? (freq2 > 1000 ? 1000 : (long)(1000000 / freq2)) : c->period_us;
+        c->span_us = span_ms * 1000;
+        c->duty = (int)(duty * 1000);
+        c->count = count;
+    }
+    if (restart)
+    {
+        c->on = pattern == PWM_ON;
+        c->start_us = c->next_us = pwm_now_us();
+        c->pulse = 0;
+        pthread_cond_signal(&pw->cond);
+    }
+    pthread_mutex_unlock(&pw->lock);
+}
+
+void *pwm_thread(void *arg)
+{
+    pwm_t *pw = (pwm_t *)arg;
+
+    pthread_mutex_lock(&pw->lock);
+    while (1)
+    {
+        long long now = pwm_now_us();
+        long long next = -1;
+        for (int i = 0; i < PWM_CHANNELS; i++)
+        {
+            pwm_channel_t *c = &pw->ch[i];
+            if (c->pattern >= PWM_BLINK)
+            {
+                if (now - c->next_us > 1000000) c->next_us = now;  // 长时间未调度时重新对齐，不补发翻转
+                while (c->next_us <= now)
+                {
+                    pwm_advance(c);
+                }
+                if (next < 0 || c->next_us < next) next = c->next_us;
+            }
+            if (c->hw != (int)c->on)
+            {
+                pwm_output(pw, i, c->on);
+                c->hw = c->on;
+            }
+        }
+        if (next < 0)
+        {
+            pthread_cond_wait(&pw->cond, &pw->lock);
+        }
+        else
+        {
+            struct timespec ts;
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            pthread_cond_timedwait(&pw->cond, &pw->lock, &ts);
+        }
+    }
+    return NULL;
+}
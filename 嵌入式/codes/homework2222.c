@@ -11,32 +11,141 @@
 #include <termios.h>
 #include <math.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include <time.h>
-int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop);
+#include <stdbool.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+
+#define SAMPLE_US 100000 // 采样间隔 100ms，LED 闪烁不再占用采样时间
+
+// 默认标定：码值 c 对应阻值 c*10000/4095（10kΩ 电位器），用宏在编译期展开成4096项的表
+#define ADC_CODES 4096
+#define CAL_OHM(c) ((c) * 10000 / 4095)
+#define CAL_T4(c) CAL_OHM(c), CAL_OHM((c) + 1), CAL_OHM((c) + 2), CAL_OHM((c) + 3)
+#define CAL_T16(c) CAL_T4(c), CAL_T4((c) + 4), CAL_T4((c) + 8), CAL_T4((c) + 12)
+#define CAL_T64(c) CAL_T16(c), CAL_T16((c) + 16), CAL_T16((c) + 32), CAL_T16((c) + 48)
+#define CAL_T256(c) CAL_T64(c), CAL_T64((c) + 64), CAL_T64((c) + 128), CAL_T64((c) + 192)
+#define CAL_T1024(c) CAL_T256(c), CAL_T256((c) + 256), CAL_T256((c) + 512), CAL_T256((c) + 768)
+#define CAL_T4096(c) CAL_T1024(c), CAL_T1024((c) + 1024), CAL_T1024((c) + 2048), CAL_T1024((c) + 3072)
+
+// 二进制采样日志格式（小端），与 task2.c 相同，可用 log_decoder.py 还原为CSV：
+//   文件头16字节: "RLOG" | u8 版本 | u8 记录长度 | u16 采样周期ms | u32 起始秒 | u16 起始毫秒 | u16 保留
+//   记录4字节:   u16 距上一条记录的毫秒数（单调时钟） | u16 阻值(低14位) + 标志(高2位)
+#define LOG_BLOCK_SIZE 512   // 文件按块对齐写入
+#define LOG_HEADER_SIZE 16
+#define LOG_RECORD_SIZE 4
+#define LOG_VERSION 1
+#define LOG_PERIOD_MS 100
+#define LOG_FLAG_OK 0
+#define LOG_FLAG_HIGH 1
+#define LOG_FLAG_LOW 2
+#define LOG_FLAG_CTRL 3
+#define LOG_CTRL_SKIP 1
+
+// 日志回传：新写入文件的字节用 sendfile 直接从文件送到串口，内核不支持时退回大缓冲区 pread + write。
+// 串口是非阻塞的，短写或 EAGAIN 时等 POLLOUT 再继续。发送在采样循环里进行，每次刷新最多占用
+// UART_BUDGET_MS（远小于采样间隔），到时还没发完（如流控停着）就先返回，没发出的字节仍在文件里，
+// 下次刷新时从记下的偏移接着发，不会丢失
+#define UART_CHUNK 4096
+#define UART_BUDGET_MS 20
+#ifndef UART_RTSCTS
+#define UART_RTSCTS false     // RTS/CTS 硬件流控，接好 CTS 线后用 -DUART_RTSCTS=true 编译打开
+#endif
+
+typedef struct {
+    unsigned char data[LOG_BLOCK_SIZE]; // 当前文件块
+    int len;                            // 块内已有字节数
+    long long sent;                     // 已发往串口的文件偏移，之后的字节待发送
+    long long index;                    // 块号，文件偏移 = index * LOG_BLOCK_SIZE
+    long long last_ms;                  // 上一条记录的时间，用于差分编码
+} log_block_t;
+
+// 软件PWM引擎：一个定时线程驱动所有输出通道，按最近的翻转时刻睡眠，只在电平变化时调用ioctl
+#define PWM_CHANNELS 3  // 0、1 为两个LED，2 为蜂鸣器
+#define PWM_BUZZER 2
+
+enum { PWM_OFF, PWM_ON, PWM_BLINK, PWM_CHIRP, PWM_BURST };
+
+typedef struct {
+    int pattern;
+    long period_us;   // 闪烁周期；CHIRP 为起始周期
+    long period2_us;  // CHIRP 终止周期
+    long span_us;     // CHIRP 一次扫频的时长；BURST 两组脉冲之间的间隔
+    int duty;         // 占空比（千分比）
+    int count;        // BURST 每组脉冲数
+    bool on;          // 当前电平
+    int hw;           // 已写入硬件的电平，-1 表示未知
+    long long start_us;
+    long long next_us;  // 下一次翻转的时刻
+    int pulse;          // BURST 本组已输出的脉冲数
+} pwm_channel_t;
+
+typedef struct {
+    pwm_channel_t ch[PWM_CHANNELS];
+    int fd_led, fd_bz;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pwm_t;
+
+// 查找表：阻值在编译期生成，闪烁周期和报警分类在启动时按码值算好，采样时只查表
+const uint16_t g_default_ohms[ADC_CODES] = {CAL_T4096(0)};
+float g_period[ADC_CODES];  // 周期 = 4 / (0.125 + 1.7^(r/1000))
+uint8_t g_alarm[ADC_CODES];  // LOG_FLAG_OK / LOG_FLAG_HIGH / LOG_FLAG_LOW
+
+int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop, bool rtscts);
 long long get_timestamp(void);               // 获取时间戳函数
+long long get_mono_ms(void);                 // 单调时钟毫秒数
 void get_format_time_string(char *str_time); // 获取格式化时间
-int read_adc_value(int fd_adc, char *buffer)
+void log_encode_header(unsigned char *p, long long wall_ms);
+void log_append_record(log_block_t *blk, int fd_file, int fd_uart, int value, int flag);
+void log_flush(log_block_t *blk, int fd_file, int fd_uart);
+ssize_t uart_write_all(int fd_uart, const void *buf, size_t len, long long deadline);
+ssize_t uart_send_file(int fd_uart, int fd_file, off_t off, size_t len);
+int pwm_start(pwm_t *pw, int fd_led, int fd_bz);
+void pwm_set(pwm_t *pw, int ch, int pattern, float freq, float duty, float freq2, long span_ms, int count);
+void *pwm_thread(void *arg);
+int read_adc_code(int fd_adc, char *buffer) // 读取ADC原始码值（0~4095）
 {
     int len = read(fd_adc, buffer, 12);
-    if (len == 0)
+    int code = 0;
+    if (len <= 0)
     {
         printf("ADC read error \n");
-        return;
+        return 0;
+    }
+    for (int i = 0; i < len && buffer[i] >= '0' && buffer[i] <= '9'; i++)
+    {
+        code = code * 10 + (buffer[i] - '0');
     }
-    return atoi(buffer) * 10000 / 4095;
+    return code < ADC_CODES ? code : ADC_CODES - 1;
 }
 
-void led_blink(int fd_led, float duty, float period)
+void build_tables(void) // 按码值预先计算闪烁周期和报警分类，采样路径上不再调用 pow()
 {
-    ioctl(fd_led, 0, 0);
-    ioctl(fd_led, 0, 1);
-    usleep((int)(1000000 * period * duty));
-    // printf("Period=%f,duty=%f\n", period , duty);
-    printf("T value: %f.2\n", period);
+    for (int c = 0; c < ADC_CODES; c++)
+    {
+        int r = g_default_ohms[c];
+        g_period[c] = 4 / (0.125 + pow(1.7, r / 1000.0));
+        g_alarm[c] = r > 9000 ? LOG_FLAG_HIGH : (r < 1000 ? LOG_FLAG_LOW : LOG_FLAG_OK);
+    }
+}
 
-    ioctl(fd_led, 1, 0);
-    ioctl(fd_led, 1, 1);
-    usleep((int)(1000000 * period * (1 - duty)));
+// LED 闪烁：只配置两个 LED 通道后立即返回，翻转由 PWM 线程完成
+void led_blink(pwm_t *pw, float duty, float period)
+{
+    pwm_set(pw, 0, PWM_BLINK, 1 / period, duty, 0, 0, 0);
+    pwm_set(pw, 1, PWM_BLINK, 1 / period, duty, 0, 0, 0);
+    pwm_set(pw, PWM_BUZZER, PWM_OFF, 0, 0, 0, 0, 0);
+}
+
+// 报警：LED 常亮，蜂鸣器 1 秒周期鸣响
+void alarm_on(pwm_t *pw)
+{
+    pwm_set(pw, 0, PWM_ON, 0, 0, 0, 0, 0);
+    pwm_set(pw, 1, PWM_ON, 0, 0, 0, 0, 0);
+    pwm_set(pw, PWM_BUZZER, PWM_BLINK, 1, 0.5, 0, 0, 0);
 }
 
 int main() {
@@ -54,12 +163,16 @@ int main() {
     char buffer[16];                     // ADC数据缓冲
     char format_time_string[100];        // 格式化时间字符串缓冲
     int r = 0;                           // 记录ADC转换结果（电阻值）
+    int code = 0;                        // ADC原始码值
     long long last_time = 0;             // 记录上一次写文件的时间戳
+    log_block_t log_blk;                 // 二进制日志的当前文件块
+    pwm_t pwm;                           // LED/蜂鸣器 PWM 引擎
 
     // 初始化内存，避免脏数据
     memset(buffer, 0, sizeof(buffer));   
     memset(format_time_string, 0, sizeof(format_time_string)); // 这里写1000会越界，应改为 sizeof(format_time_string)
     memset(uart_out, 0, sizeof(uart_out));            // 这里写500也会越界，应改为 sizeof(uart_out)
+    build_tables();                                   // 生成查找表
 
     // 打开ADC设备
     if ((fd_adc = open(adc, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
@@ -81,7 +194,12 @@ int main() {
         printf("open uart1 error\n");
         return;
     } else {
-        set_opt(fd_uart, 9600, 8, 'N', 1); // 设置串口：9600bps，8位数据，无校验，1位停止位
+        set_opt(fd_uart, 9600, 8, 'N', 1, UART_RTSCTS); // 设置串口：9600bps，8位数据，无校验，1位停止位
+    }
+    // 启动PWM引擎（所有输出先熄灭）
+    if (pwm_start(&pwm, fd_led, fd_bz) != 0) {
+        printf("start pwm error\n");
+        return;
     }
 
     // 主循环，用户通过输入数字选择任务
@@ -104,31 +222,23 @@ int main() {
 
         case 2: // 读取ADC并根据值控制蜂鸣器和LED
             while (1) {
-                r = read_adc_value(fd_adc, buffer); // 获取ADC值
-                if (r < 1000) { // 太低报警
+                code = read_adc_code(fd_adc, buffer); // 获取ADC值
+                r = g_default_ohms[code];
+                if (g_alarm[code] == LOG_FLAG_LOW) { // 太低报警
                     sprintf(uart_out, "Resistnce:%d Ohm ,Alert:Too low!\r\n", r);
                     write(fd_uart, uart_out, strlen(uart_out)); // 发送到串口
-                    ioctl(fd_led, 1, 0); // 点亮LED
-                    ioctl(fd_led, 1, 1);
-                    ioctl(fd_bz, 1);    // 打开蜂鸣器
-                    usleep(500000);     // 500ms
-                    ioctl(fd_bz, 0);    // 关闭蜂鸣器
-                    usleep(500000);
-                } else if (r > 9000) { // 太高报警
+                    alarm_on(&pwm);     // 点亮LED，蜂鸣器间歇鸣响
+                } else if (g_alarm[code] == LOG_FLAG_HIGH) { // 太高报警
                     sprintf(uart_out, "Resistnce:%d Ohm ,Alert:Too high!\r\n", r);
                     write(fd_uart, uart_out, strlen(uart_out));
-                    ioctl(fd_led, 1, 0);
-                    ioctl(fd_led, 1, 1);
-                    ioctl(fd_bz, 1);
-                    usleep(500000);
-                    ioctl(fd_bz, 0);
-                    usleep(500000);
+                    alarm_on(&pwm);
                 } else { // 正常范围
                     sprintf(uart_out, "Resistnce:%d Ohm ,Alert:None!\r\n", r);
                     write(fd_uart, uart_out, strlen(uart_out));
                     // LED闪烁，频率依赖电阻值
-                    led_blink(fd_led, 0.5, 4 / (0.125 + pow(1.7, r / 1000.0))); 
+                    led_blink(&pwm, 0.5, g_period[code]);
                 }
+                usleep(SAMPLE_US);
             }
             break;
 
@@ -156,45 +266,36 @@ int main() {
             write(fd_uart, uart_out, strlen(uart_out)); // 发送到串口
             break;
 
-        case 4: // 实时采集+存文件+加时间戳
-            while (1) {
-                (long long)get_timestamp(); // 获取当前时间戳（没用上）
+        case 4: // 实时采集+存二进制日志+串口回传
+            // 可读写打开：回传时串口数据直接从这个文件读出
+            if ((fd_file2 = open("/home/code/2_4.bin", O_RDWR | O_CREAT | O_TRUNC, 0777)) < 0) {
+                printf("open /home/code/2_4.bin failed!\r\n");
+                return;
+            }
+            memset(&log_blk, 0, sizeof(log_blk));
+            log_encode_header(log_blk.data, get_timestamp()); // 文件头
+            log_blk.len = LOG_HEADER_SIZE;
+            log_blk.last_ms = get_mono_ms();
 
-                r = read_adc_value(fd_adc, buffer); // 读取ADC
+            while (1) {
+                code = read_adc_code(fd_adc, buffer); // 读取ADC
+                r = g_default_ohms[code];
                 printf("R value: %d\n", r);
 
-                if (r < 1000 || r > 9000) { // 报警
-                    sprintf(uart_out, "Resistnce:%d ,Alert\r\n", r);
-                    ioctl(fd_led, 1, 0);
-                    ioctl(fd_led, 1, 1);
-                    ioctl(fd_bz, 1);
-                    usleep(500000);
-                    ioctl(fd_bz, 0);
-                    usleep(500000);
+                // 只追加4字节记录，不做时间格式化
+                log_append_record(&log_blk, fd_file2, fd_uart, r, g_alarm[code]);
+
+                if (g_alarm[code] != LOG_FLAG_OK) { // 报警
+                    alarm_on(&pwm);
                 } else { // 正常
-                    get_format_time_string(format_time_string); // 获取时间
-                    sprintf(uart_out, "Resistnce:%d ,OK,%s\r\n", r, format_time_string);
                     // LED随电阻值闪烁
-                    led_blink(fd_led, 0.5, 4 / (0.125 + pow(1.7, r / 1000.0)));
+                    led_blink(&pwm, 0.5, g_period[code]);
                 }
+                usleep(SAMPLE_US);
 
-                // 每1秒写一次文件并回传
+                // 每1秒写一次文件并回传新增记录
                 if (get_timestamp() - last_time >= 1000) {
-                    if ((fd_file2 = open("/home/code/2_4.txt", O_RDWR | O_CREAT | O_APPEND, 0777)) < 0) {
-                        printf("open /home/code/2_4.txt failed!\r\n");
-                        return;
-                    }
-                    write(fd_file2, uart_out, strlen(uart_out));
-                    close(fd_file2);
-
-                    if ((fd_file2 = open("/home/code/2_4.txt", O_RDWR | O_CREAT | O_APPEND, 0777)) < 0) {
-                        printf("open /home/code/2_4.txt failed!\r\n");
-                        return;
-                    }
-                    read(fd_file2, uart_out, 1000);
-                    close(fd_file2);
-
-                    write(fd_uart, uart_out, strlen(uart_out)); // 通过串口回传
+                    log_flush(&log_blk, fd_file2, fd_uart);
                     last_time = get_timestamp(); // 更新时间戳
                 }
             }
@@ -236,4 +337,287 @@ void get_format_time_string(char *str_time) // 获取格式化时间
 
     printf("now datetime : %s\n", datetime);
     strcpy(str_time, datetime);
-}
\ No newline at end of file
+}
+
+long long get_mono_ms(void) // 单调时钟毫秒数，不受系统时间调整影响
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void log_encode_header(unsigned char *p, long long wall_ms) // 写16字节文件头
+{
+    unsigned int sec = (unsigned int)(wall_ms / 1000);
+    unsigned int ms = (unsigned int)(wall_ms % 1000);
+
+    memcpy(p, "RLOG", 4);
+    p[4] = LOG_VERSION;
+    p[5] = LOG_RECORD_SIZE;
+    p[6] = LOG_PERIOD_MS & 0xFF;
+    p[7] = LOG_PERIOD_MS >> 8;
+    p[8] = sec & 0xFF;
+    p[9] = (sec >> 8) & 0xFF;
+    p[10] = (sec >> 16) & 0xFF;
+    p[11] = sec >> 24;
+    p[12] = ms & 0xFF;
+    p[13] = ms >> 8;
+    p[14] = 0;
+    p[15] = 0;
+}
+
+void log_flush(log_block_t *blk, int fd_file, int fd_uart) // 当前块按块偏移写入文件，并从文件发送尚未发出的字节
+{
+    long long end = blk->index * LOG_BLOCK_SIZE + blk->len;
+
+    pwrite(fd_file, blk->data, blk->len, blk->index * LOG_BLOCK_SIZE);
+    if (end > blk->sent) {
+        ssize_t n = uart_send_file(fd_uart, fd_file, blk->sent, end - blk->sent);
+        if (n > 0) blk->sent += n;
+    }
+    if (blk->len == LOG_BLOCK_SIZE) { // 块已写满，开始下一块（没发完的部分已在文件里）
+        blk->index++;
+        blk->len = 0;
+    }
+}
+
+int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop, bool rtscts) // 设置串口参数，rtscts 打开硬件流控
+{
+    struct termios newtio;
+
+    if (tcgetattr(fd_uart, &newtio) != 0) { // 确认串口可以配置
+        perror("SetupSerial 1");
+        return -1;
+    }
+    bzero(&newtio, sizeof(newtio));
+    newtio.c_cflag |= CLOCAL | CREAD;
+    newtio.c_cflag &= ~CSIZE;
+    newtio.c_cflag |= nBits == 7 ? CS7 : CS8; // 数据位
+    if (nEvent == 'O') { // 奇偶校验
+        newtio.c_cflag |= PARENB | PARODD;
+        newtio.c_iflag |= INPCK | ISTRIP;
+    } else if (nEvent == 'E') {
+        newtio.c_cflag |= PARENB;
+        newtio.c_iflag |= INPCK | ISTRIP;
+    }
+    speed_t speed = nSpeed == 115200 ? B115200 : nSpeed == 4800 ? B4800 : nSpeed == 2400 ? B2400 : B9600; // 波特率
+    cfsetispeed(&newtio, speed);
+    cfsetospeed(&newtio, speed);
+    if (nStop == 2) newtio.c_cflag |= CSTOPB; // 停止位
+    // 硬件流控：对端撤销 CTS 时由串口驱动暂停发送，没有接 CTS 线时不能打开，否则发送会一直停住
+    if (rtscts) newtio.c_cflag |= CRTSCTS;
+    newtio.c_cc[VTIME] = 0;
+    newtio.c_cc[VMIN] = 0;
+    tcflush(fd_uart, TCIFLUSH);
+    if (tcsetattr(fd_uart, TCSANOW, &newtio) != 0) {
+        perror("com set error");
+        return -1;
+    }
+    return 0;
+}
+
+static int uart_wait_writable(int fd_uart, long long deadline) // 等串口发送缓冲区有空位，到 deadline 还没有返回0
+{
+    struct pollfd pfd = {fd_uart, POLLOUT, 0};
+    long long left = deadline - get_mono_ms();
+    return left > 0 && poll(&pfd, 1, (int)left) > 0;
+}
+
+ssize_t uart_write_all(int fd_uart, const void *buf, size_t len, long long deadline) // 写完 len 字节或到 deadline，返回实际写入的字节数
+{
+    const char *p = buf;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(fd_uart, p + done, len - done);
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            break;
+        } else if (!uart_wait_writable(fd_uart, deadline)) {
+            break;
+        }
+    }
+    return done;
+}
+
+ssize_t uart_send_file(int fd_uart, int fd_file, off_t off, size_t len) // 发送文件 [off, off+len)，返回已发送的字节数
+{
+    static bool no_sendfile = false; // sendfile 不支持串口时只试一次
+    static char buf[UART_CHUNK];
+    long long deadline = get_mono_ms() + UART_BUDGET_MS;
+    size_t done = 0;
+
+    while (done < len && !no_sendfile) {
+        off_t pos = off + done;
+        ssize_t n = sendfile(fd_uart, fd_file, &pos, len - done);
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            no_sendfile = true;
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR) || !uart_wait_writable(fd_uart, deadline)) {
+            return done;
+        }
+    }
+    while (done < len) {
+        size_t want = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        ssize_t n = pread(fd_file, buf, want, off + done);
+        if (n <= 0) break;
+        ssize_t w = uart_write_all(fd_uart, buf, n, deadline);
+        done += w;
+        if (w < n) break;
+    }
+    return done;
+}
+
+void log_append_record(log_block_t *blk, int fd_file, int fd_uart, int value, int flag) // 追加一条差分时间戳记录
+{
+    long long now = get_mono_ms();
+    long long dt = now - blk->last_ms;
+    unsigned int word;
+    unsigned char *p;
+
+    while (1) {
+        if (blk->len == LOG_BLOCK_SIZE) log_flush(blk, fd_file, fd_uart);
+        p = blk->data + blk->len;
+        if (dt > 0xFFFF) { // 间隔超出16位，插入只推进时间的SKIP记录
+            p[0] = 0xFF;
+            p[1] = 0xFF;
+            word = LOG_CTRL_SKIP | (LOG_FLAG_CTRL << 14);
+            dt -= 0xFFFF;
+        } else {
+            p[0] = dt & 0xFF;
+            p[1] = (dt >> 8) & 0xFF;
+            word = (value & 0x3FFF) | (flag << 14);
+            dt = -1;
+        }
+        p[2] = word & 0xFF;
+        p[3] = word >> 8;
+        blk->len += LOG_RECORD_SIZE;
+        if (dt < 0) break;
+    }
+    blk->last_ms = now;
+}
+
+static long long pwm_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void pwm_output(pwm_t *pw, int ch, bool on) {
+    if (ch == PWM_BUZZER) {
+        ioctl(pw->fd_bz, on ? 1 : 0);
+    } else {
+        ioctl(pw->fd_led, on ? 1 : 0, ch);
+    }
+}
+
+// CHIRP 的周期在 span 内从 period 线性变化到 period2，然后重新开始
+static long pwm_period_us(pwm_channel_t *c, long long t) {
+    if (c->pattern != PWM_CHIRP) return c->period_us;
+    long long pos = (t - c->start_us) % c->span_us;
+    return c->period_us + (long)((c->period2_us - c->period_us) * pos / c->span_us);
+}
+
+// 翻转一次电平并计算下一次翻转时刻
+static void pwm_advance(pwm_channel_t *c) {
+    long period = pwm_period_us(c, c->next_us);
+    long on_us = period * c->duty / 1000;
+    if (c->on) {
+        c->on = false;
+        c->next_us += period - on_us;
+        if (c->pattern == PWM_BURST && ++c->pulse >= c->count) {
+            c->pulse = 0;
+            c->next_us += c->span_us;
+        }
+    } else {
+        c->on = true;
+        c->next_us += on_us;
+    }
+}
+
+int pwm_start(pwm_t *pw, int fd_led, int fd_bz) {
+    pthread_condattr_t attr;
+    pthread_t tid;
+
+    memset(pw, 0, sizeof(*pw));
+    pw->fd_led = fd_led;
+    pw->fd_bz = fd_bz;
+    for (int i = 0; i < PWM_CHANNELS; i++) {
+        pw->ch[i].hw = -1;  // 启动时把所有输出写成熄灭
+    }
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pw->cond, &attr);
+    if (pthread_create(&tid, NULL, pwm_thread, pw) != 0) {
+        perror("pwm pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// 配置通道输出。freq 为闪烁频率(Hz)，duty 为亮的比例；CHIRP 在 span_ms 内扫到 freq2，
+// BURST 每 count 个脉冲后停 span_ms。同一模式下只更新参数、保持相位，可以每个采样周期调用
+void pwm_set(pwm_t *pw, int ch, int pattern, float freq, float duty, float freq2, long span_ms, int count) {
+    pwm_channel_t *c = &pw->ch[ch];
+
+    if (pattern >= PWM_BLINK && (freq <= 0 || duty <= 0)) pattern = PWM_OFF;
+    if (pattern >= PWM_BLINK && duty >= 1) pattern = PWM_ON;
+    if (pattern == PWM_CHIRP && (freq2 <= 0 || span_ms <= 0)) pattern = PWM_BLINK;
+    if (pattern == PWM_BURST && count <= 0) pattern = PWM_BLINK;
+
+    pthread_mutex_lock(&pw->lock);
+    bool restart = c->pattern != pattern;
+    c->pattern = pattern;
+    if (pattern >= PWM_BLINK) {
+        c->period_us = freq > 1000 ? 1000 : (long)(1000000 / freq);
+        c->period2_us = pattern == PWM_CHIRP ? (freq2 > 1000 ? 1000 : (long)(1000000 / freq2)) : c->period_us;
+        c->span_us = span_ms * 1000;
+        c->duty = (int)(duty * 1000);
+        c->count = count;
+    }
+    if (restart) {
+        c->on = pattern == PWM_ON;
+        c->start_us = c->next_us = pwm_now_us();
+        c->pulse = 0;
+        pthread_cond_signal(&pw->cond);
+    }
+    pthread_mutex_unlock(&pw->lock);
+}
+
+void *pwm_thread(void *arg) {
+    pwm_t *pw = (pwm_t *)arg;
+
+    pthread_mutex_lock(&pw->lock);
+    while (1) {
+        long long now = pwm_now_us();
+        long long next = -1;
+        for (int i = 0; i < PWM_CHANNELS; i++) {
+            pwm_channel_t *c = &pw->ch[i];
+            if (c->pattern >= PWM_BLINK) {
+                if (now - c->next_us > 1000000) c->next_us = now;  // 长时间未调度时重新对齐，不补发翻转
+                while (c->next_us <= now) {
+                    pwm_advance(c);
+                }
+                if (next < 0 || c->next_us < next) next = c->next_us;
+            }
+            if (c->hw != (int)c->on) {
+                pwm_output(pw, i, c->on);
+                c->hw = c->on;
+            }
+        }
+        if (next < 0) {
+            pthread_cond_wait(&pw->cond, &pw->lock);
+        } else {
+            struct timespec ts;
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            pthread_cond_timedwait(&pw->cond, &pw->lock, &ts);
+        }
+    }
+    return NULL;
+}
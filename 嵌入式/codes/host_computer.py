@@ -6,11 +6,31 @@ import time
 import os
 import struct
 
+from log_decoder import StreamDecoder, CSV_HEADER
+from serial_link import LinkReceiver
+from stream_cipher import ChaCha20, load_key, NONCE_SIZE, ENCRYPT
+
+STREAM_BAUDS = {1: 9600, 2: 115200, 3: 460800}  # 连续遥测的波特率代码
+STATUS_NAMES = {0: 'ok', 1: 'hig', 2: 'low', 3: 'vib'}
+SPEC_BAND_HZ = [2, 20, 45, 65, 500]  # 与 task2.c 的 g_spec_band_hz 一致
+SPEC_RULE_OFF = 0xFF
+SPEC_LEVEL_MAX = 1023                # 频带RMS阈值上限（0.1码值）
+SPEC_BLOCK_BASE = 0x80000000         # 加密频谱帧的密钥块号起点
+TIMING_PHASES = ['period', 'busy', 'adc', 'uart', 'cmd', 'ctl', 'ioctl']  # 与 task2.c 的 TM_* 顺序一致
+TIMING_BUCKETS = 16
+TIMING_RESET = 1
+
+
 class HostComputer:
     def __init__(self, port='/dev/ttyUSB0', baudrate=9600):
         self.port = port
         self.baudrate = baudrate
         self.serial_conn = None
+        self.link = None
+        self.replies = []  # 链路上已收到、尚未取走的模式2/3回复帧
+        self.timing = []   # 模式6计时快照的 'T' 帧负载
+        self.key = None
+        self.dump_cipher = None  # 模式4加密会话的解密器，收到 'K' 帧时建立
 
     def connect_serial(self):
         """连接串口"""
@@ -23,6 +43,7 @@ class HostComputer:
                 stopbits=serial.STOPBITS_ONE,#一位停止位
                 timeout=1#超时时间
             )
+            self.link = LinkReceiver(self.serial_conn.write)
             print(f"串口连接成功: {self.port} @ {self.baudrate}bps")
             return True
         except serial.SerialException as e:
@@ -90,9 +111,20 @@ class HostComputer:
             'bcc_valid': calculated_bcc == received_bcc
         }
 
-    def xor_encrypt_decrypt(self, data, key=0xAA):
-        """XOR加密/解密"""
-        return bytes(b ^ key for b in data)
+    def get_key(self):
+        """读取与板子相同的密钥文件 stream.key"""
+        if self.key is None:
+            try:
+                self.key = load_key()
+            except (OSError, ValueError) as e:
+                print(f"读取密钥失败: {e}（请从板子拷贝 stream.key）")
+        return self.key
+
+    def ask_encrypt(self):
+        """询问是否加密传输，返回命令中的标志字节"""
+        if input("是否加密传输 (y/N): ").strip().lower() != 'y':
+            return 0
+        return ENCRYPT if self.get_key() else 0
 
     def send_command(self, command):
         """发送命令到板子"""
@@ -121,19 +153,34 @@ class HostComputer:
             print(f"发送命令失败: {e}")
             return False
 
-    def receive_data_frame(self):
-        """接收数据帧"""
+    def poll_link(self):
+        """读取串口上已到达的数据交给链路层，回复帧存入 self.replies，返回按序收到的日志数据"""
+        data = self.serial_conn.read(self.serial_conn.in_waiting or 1)
+        log_data = b''
+        for ftype, payload in self.link.feed(data):
+            if ftype == 'F':
+                self.replies.append(payload)
+            elif ftype == 'T':
+                self.timing.append(payload)
+            elif ftype == 'K':
+                self.dump_cipher = ChaCha20(self.get_key(), payload)
+            elif ftype == 'L':
+                log_data += self.dump_cipher.xor(payload) if self.dump_cipher else payload
+        return log_data
+
+    def receive_data_frame(self, timeout=1.0):
+        """接收数据帧（经链路层可靠传输的8字节回复帧）"""
         if not self.serial_conn or not self.serial_conn.is_open:
             print("串口未连接")
             return None
 
         try:
-            # 读取完整的数据帧 (8字节)
-            frame = self.serial_conn.read(8)
-            if len(frame) == 8:
-                return frame
-            else:
-                return None
+            deadline = time.time() + timeout
+            while not self.replies and time.time() < deadline:
+                self.poll_link()
+            if self.replies:
+                return self.replies.pop(0)
+            return None
         except Exception as e:
             print(f"接收数据失败: {e}")
             return None
@@ -161,6 +208,20 @@ class HostComputer:
                 print("参数调节命令已发送")
             else:
                 print("参数调节失败")
+                return
+
+            # 模式7: 频谱报警规则，频带RMS超过阈值时报 vib（需要板子工作在过采样模式）
+            bands = ', '.join(f"{i}={SPEC_BAND_HZ[i]}-{SPEC_BAND_HZ[i + 1]}Hz" for i in range(len(SPEC_BAND_HZ) - 1))
+            band = input(f"频谱报警频带 ({bands}，回车关闭): ").strip()
+            if band:
+                band = int(band)
+                thresh = round(float(input("频带RMS阈值(ADC码值): ")) * 10)
+                if not 0 <= band < len(SPEC_BAND_HZ) - 1 or not 0 <= thresh <= SPEC_LEVEL_MAX:
+                    print("参数超出范围")
+                    return
+            else:
+                band, thresh = SPEC_RULE_OFF, SPEC_LEVEL_MAX
+            self.send_command(struct.pack('>BBH', 0x07, band, thresh))
 
         except ValueError:
             print("输入无效，请输入有效的数字")
@@ -210,17 +271,13 @@ class HostComputer:
             if frame:
                 print(f"\n收到加密数据帧: {frame.hex().upper()}")
 
-                # 对整个帧进行解密
-                decrypted_frame = self.xor_encrypt_decrypt(frame)
-                print(f"直接解密后数据帧: {decrypted_frame.hex().upper()}")
-
-                # 修正帧头和帧尾（解密过程中帧头帧尾也被加密了，需要改回来）
-                if len(decrypted_frame) >= 8:  # 确保是完整的数据帧
-                    corrected_frame = b'\x7B' + decrypted_frame[1:-1] + b'\x7D'
-                    print(f"修正帧头帧尾后: {corrected_frame.hex().upper()}")
+                # 负载为 nonce(12) + ChaCha20 加密的8字节回复帧
+                if len(frame) == NONCE_SIZE + 8 and self.get_key():
+                    decrypted_frame = ChaCha20(self.key, frame[:NONCE_SIZE]).xor(frame[NONCE_SIZE:])
+                    print(f"解密后数据帧: {decrypted_frame.hex().upper()}")
 
-                    # 解析修正后的数据
-                    parsed = self.parse_data_frame(corrected_frame)
+                    # 解析解密后的数据
+                    parsed = self.parse_data_frame(decrypted_frame)
                     if parsed:
                         print(f"阻值: {parsed['resistance']}")
                         print(f"报警状态: {parsed['alarm_status']}")
@@ -244,49 +301,219 @@ class HostComputer:
         print("\n=== Case 4: 文件传输 ===")
 
         # 发送进入Case 4的命令
-        # 原始命令: CMD = 4 (1字节)
-        # 完整帧格式: 帧头(1) + 原始命令(1) + BCC(1) + 帧尾(1) = 4字节
-        self.send_command(b'\x04')  # CMD = 4
+        # 原始命令: CMD = 4 + 标志（位0为加密）
+        flags = self.ask_encrypt()
+        self.dump_cipher = None
+        self.send_command(struct.pack('>BB', 0x04, flags))
 
-        # 创建本地文件
+        # 创建本地文件：原始二进制日志 + 解码后的CSV
         timestamp = time.strftime("%Y%m%d_%H%M%S")
-        filename = f"resistance_data_{timestamp}.txt"
+        filename = f"resistance_data_{timestamp}.bin"
+        csv_filename = f"resistance_data_{timestamp}.csv"
 
         print(f"等待板子发送文件数据...")
 
         received_data = b""
+        decoder = StreamDecoder()
+        csv_lines = [CSV_HEADER]
         start_time = time.time()
 
-        # 接收数据直到超时或收到结束标志
-        while time.time() - start_time < 20:  # 20秒超时
-            if self.serial_conn.in_waiting:
-                data = self.serial_conn.read(self.serial_conn.in_waiting)
-                received_data += data
-
-                # 检查是否收到结束标志 (假设板子发送0xFF 0xFF作为结束标志)
-                if received_data.endswith(b'\xFF\xFF'):
-                    received_data = received_data[:-2]  # 移除结束标志
-                    break
+        # 板子边采集边发送，日志数据经链路层按序到达（丢帧由板子重发），收到END记录即结束
+        gaps = self.link.gaps
+        try:
+            while time.time() - start_time < 20 and not decoder.finished:  # 20秒超时
+                data = self.poll_link()
+                if data:
+                    received_data += data
+                    for row in decoder.feed(data):
+                        line = decoder.format_csv_row(row)
+                        csv_lines.append(line)
+                        print(line)
+        except ValueError as e:
+            print(f"日志格式错误: {e}")
+        if self.link.gaps > gaps:
+            print(f"链路丢帧 {self.link.gaps - gaps} 次，已由板子重发")
 
         if received_data:
             # 保存到本地文件
             with open(filename, 'wb') as f:
                 f.write(received_data)
+            with open(csv_filename, 'w') as f:
+                f.write('\n'.join(csv_lines) + '\n')
 
-            print(f"文件已保存: {filename}")
-            print(f"接收到的数据大小: {len(received_data)} 字节")
-
-            # 显示文件内容
-            print("\n文件内容:")
-            try:
-                content = received_data.decode('utf-8', errors='ignore')
-                print(content)
-            except:
-                print("无法解码为文本内容")
-
+            print(f"文件已保存: {filename}, {csv_filename}")
+            print(f"接收到的数据大小: {len(received_data)} 字节, 共 {len(csv_lines) - 1} 条记录")
+            if not decoder.finished:
+                print("警告: 未收到结束记录，数据可能不完整")
         else:
             print("未收到文件数据")
 
+    def parse_stream_frames(self, buf):
+        """从接收缓冲区中切出遥测帧和应答帧，返回 (帧列表, 剩余数据)
+
+        遥测帧: 7B 'S'/'E' 序号(2) N N×读数(2) BCC 7D（'E' 的读数部分已加密）；
+        频谱帧: 格式相同，类型为 'P'/'Q'，值为主频(0.1Hz)、主频分量RMS和各频带RMS（0.1码值）；
+        应答帧: 7B 05 波特率代码 抽取比 BCC 7D，加密订阅为 7B 'K' 波特率代码 抽取比 nonce(12) BCC 7D
+        """
+        frames = []
+        while True:
+            start = buf.find(b'\x7B')
+            if start < 0:
+                return frames, b''
+            buf = buf[start:]
+            if len(buf) < 6:
+                return frames, buf
+            if buf[1] == 0x05:
+                total = 6
+            elif buf[1] == ord('K'):
+                total = 6 + NONCE_SIZE
+            elif buf[1] in (ord('S'), ord('E'), ord('P'), ord('Q')):
+                total = 5 + 2 * buf[4] + 2
+            else:
+                buf = buf[1:]
+                continue
+            if len(buf) < total:
+                return frames, buf
+            frame = buf[:total]
+            if frame[-1] != 0x7D or self.calculate_bcc(frame[:-2]) != frame[-2]:
+                buf = buf[1:]  # 校验失败，从下一个字节重新同步
+                continue
+            if frame[1] == 0x05:
+                frames.append(('ack', frame[2], frame[3], None))
+            elif frame[1] == ord('K'):
+                frames.append(('ack', frame[2], frame[3], frame[4:4 + NONCE_SIZE]))
+            elif frame[1] == ord('E'):
+                frames.append(('edata', (frame[2] << 8) | frame[3], frame[5:-2]))
+            elif frame[1] in (ord('P'), ord('Q')):
+                frames.append(('spec', (frame[2] << 8) | frame[3], frame[5:-2], frame[1] == ord('Q')))
+            else:
+                seq = (frame[2] << 8) | frame[3]
+                frames.append(('data', seq, self.decode_stream_values(frame[5:-2])))
+            buf = buf[total:]
+
+    def decode_stream_values(self, payload):
+        """遥测读数: 每个2字节，高2位为报警状态，返回 [(阻值, 状态)]"""
+        values = [(payload[2 * i] << 8) | payload[2 * i + 1] for i in range(len(payload) // 2)]
+        return [(v & 0x3FFF, v >> 14) for v in values]
+
+    def print_spectrum(self, payload):
+        """频谱帧: 主频、主频分量RMS、各频带RMS，均为大端 u16"""
+        v = struct.unpack(f'>{len(payload) // 2}H', payload)
+        bands = '  '.join(f"{SPEC_BAND_HZ[i]}-{SPEC_BAND_HZ[i + 1]}Hz {v[2 + i] / 10:6.1f}"
+                          for i in range(min(len(v) - 2, len(SPEC_BAND_HZ) - 1)))
+        print(f"频谱: 主频 {v[0] / 10:5.1f} Hz  幅度 {v[1] / 10:6.1f}  {bands}")
+
+    def wait_stream_ack(self, timeout=2.0):
+        """等待遥测订阅应答，返回 (实际抽取比, nonce)，超时返回 (None, None)"""
+        buf = b''
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            buf += self.serial_conn.read(self.serial_conn.in_waiting or 1)
+            frames, buf = self.parse_stream_frames(buf)
+            for frame in frames:
+                if frame[0] == 'ack':
+                    return frame[2], frame[3]
+        return None, None
+
+    def case5_stream(self):
+        """Case 5: 连续遥测"""
+        print("\n=== Case 5: 连续遥测 ===")
+        try:
+            code = int(input("请选择波特率 (1=9600, 2=115200, 3=460800): "))
+            decim = int(input("请输入抽取比 (1=100Hz, 2=50Hz, ...): "))
+        except ValueError:
+            print("输入无效，请输入有效的数字")
+            return
+        if code not in STREAM_BAUDS or decim < 1:
+            print("参数超出范围")
+            return
+
+        flags = self.ask_encrypt()
+
+        # 原始命令: CMD = 5 + 波特率代码 + 抽取比 + 标志；板子先以当前波特率应答再切换
+        self.send_command(struct.pack('>BBBB', 0x05, code, decim, flags))
+        actual, nonce = self.wait_stream_ack()
+        if actual is None:
+            print("未收到订阅应答")
+            return
+        # 加密帧按扩展帧序号定位密钥块，丢帧不影响后续帧的解密
+        cipher = ChaCha20(self.key, nonce) if nonce else None
+        block = spec_block = -1
+        self.serial_conn.baudrate = STREAM_BAUDS[code]
+        print(f"订阅成功: {STREAM_BAUDS[code]}bps, 抽取比 {actual} ({100 / actual:.1f} 读数/秒)，按Ctrl-C停止")
+
+        buf = b''
+        expected_seq = None
+        lost = 0
+        samples = bytes_in = 0
+        window_start = time.time()
+        try:
+            while True:
+                data = self.serial_conn.read(self.serial_conn.in_waiting or 1)
+                bytes_in += len(data)
+                frames, buf = self.parse_stream_frames(buf + data)
+                for i, frame in enumerate(frames):
+                    if frame[0] == 'edata' and cipher:
+                        block += (frame[1] - block) & 0xFFFF
+                        cipher.seek(block)
+                        frames[i] = ('data', frame[1], self.decode_stream_values(cipher.xor(frame[2])))
+                    elif frame[0] == 'spec':
+                        payload = frame[2]
+                        if frame[3]:
+                            if not cipher:
+                                continue
+                            spec_block += (frame[1] - spec_block) & 0xFFFF
+                            cipher.seek(SPEC_BLOCK_BASE + spec_block)
+                            payload = cipher.xor(payload)
+                        self.print_spectrum(payload)
+                for kind, seq, values in (f for f in frames if f[0] == 'data'):
+                    if expected_seq is not None and seq != expected_seq:
+                        lost += (seq - expected_seq) & 0xFFFF
+                    expected_seq = (seq + 1) & 0xFFFF
+                    samples += len(values)
+                    last_r, last_status = values[-1]
+
+                elapsed = time.time() - window_start
+                if elapsed >= 1.0 and samples:
+                    usage = bytes_in * 10 / elapsed / self.serial_conn.baudrate * 100
+                    print(f"seq {expected_seq - 1:5d}  阻值 {last_r:5d} {STATUS_NAMES.get(last_status, '?')}  "
+                          f"{samples / elapsed:6.1f} 读数/秒  {bytes_in / elapsed:7.0f} B/s  "
+                          f"线路占用 {usage:4.1f}%  丢帧 {lost}")
+                    samples = bytes_in = 0
+                    window_start = time.time()
+        except KeyboardInterrupt:
+            pass
+
+        # 取消订阅并回到9600：应答按当前波特率发出
+        self.send_command(struct.pack('>BBBB', 0x05, 1, 0, 0))
+        self.wait_stream_ack()
+        self.serial_conn.baudrate = 9600
+        print("\n已停止连续遥测")
+
+    def case6_timing(self):
+        """Case 6: 读取控制循环各阶段的耗时直方图"""
+        print("\n=== Case 6: 循环计时 ===")
+        reset = input("读取后清零 (y/N): ").strip().lower() == 'y'
+        self.timing = []
+        self.send_command(struct.pack('BB', 0x06, TIMING_RESET if reset else 0))
+        deadline = time.time() + 3.0
+        while len(self.timing) < len(TIMING_PHASES) and time.time() < deadline:
+            self.poll_link()
+        if len(self.timing) < len(TIMING_PHASES):
+            print(f"只收到 {len(self.timing)} 个阶段的快照")
+        missed = 0
+        # 桶k为 [2^(k-1), 2^k) 微秒
+        edges = ['<1'] + [f"<{1 << k}" for k in range(1, TIMING_BUCKETS - 1)] + [f">={1 << (TIMING_BUCKETS - 2)}"]
+        print(f"{'阶段':<8}{'次数':>9}{'平均us':>9}{'最大us':>9}{'超预算':>7}  分布(us:次数)")
+        for payload in self.timing:
+            phase, _, missed, count, max_us, over, sum_lo, sum_hi = struct.unpack_from('<BBIIIIII', payload)
+            buckets = struct.unpack_from(f'<{TIMING_BUCKETS}I', payload, 26)
+            avg = ((sum_hi << 32) | sum_lo) / count if count else 0
+            name = TIMING_PHASES[phase] if phase < len(TIMING_PHASES) else str(phase)
+            dist = ' '.join(f"{edges[i]}:{n}" for i, n in enumerate(buckets) if n)
+            print(f"{name:<8}{count:>9}{avg:>9.0f}{max_us:>9}{over:>7}  {dist}")
+        print(f"跳过的节拍: {missed}")
+
     def main_menu(self):
         """主菜单"""
         while True:
@@ -297,10 +524,12 @@ class HostComputer:
             print("2. 数据接收与解析 (Case 2)")
             print("3. 加密数据接收与解密 (Case 3)")
             print("4. 文件传输 (Case 4)")
-            print("5. 退出程序")
+            print("5. 连续遥测 (Case 5)")
+            print("6. 循环计时 (Case 6)")
+            print("7. 退出程序")
             print("="*50)
 
-            choice = input("请选择模式 (1-5): ").strip()
+            choice = input("请选择模式 (1-7): ").strip()
 
             if choice == '1':
                 self.case1_parameter_adjustment()
@@ -311,6 +540,10 @@ class HostComputer:
             elif choice == '4':
                 self.case4_file_transfer()
             elif choice == '5':
+                self.case5_stream()
+            elif choice == '6':
+                self.case6_timing()
+            elif choice == '7':
                 print("程序退出")
                 break
             else:
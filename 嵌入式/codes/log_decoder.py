@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""二进制采样日志（RLOG）解码工具，把板子生成的 2_4.bin 还原为 CSV
+也能解码飞行记录器的转储（flight_NN.bin / flight_prev.bin，按文件头 FREC 自动识别）
+
+用法: python3 log_decoder.py 2_4.bin|flight_00.bin [out.csv]
+"""
+
+import struct
+import sys
+import time
+
+HEADER_SIZE = 16
+RECORD_SIZE = 4
+FLAG_OK, FLAG_HIGH, FLAG_LOW, FLAG_CTRL = 0, 1, 2, 3
+CTRL_SKIP, CTRL_END = 1, 2
+FLAG_NAMES = {FLAG_OK: 'OK', FLAG_HIGH: 'HIGH', FLAG_LOW: 'LOW'}
+
+
+def parse_header(data):
+    """解析16字节文件头，返回 (起始时间(秒, 浮点), 采样周期ms)"""
+    if len(data) < HEADER_SIZE or data[:4] != b'RLOG':
+        raise ValueError("不是RLOG格式的日志")
+    version, rec_size, period_ms, sec, ms, _ = struct.unpack('<BBHIHH', data[4:HEADER_SIZE])
+    if version != 1 or rec_size != RECORD_SIZE:
+        raise ValueError(f"不支持的日志版本 {version}/{rec_size}")
+    return sec + ms / 1000.0, period_ms
+
+
+class StreamDecoder:
+    """增量解码器：串口数据分段到达时逐段喂入"""
+
+    def __init__(self):
+        self.buf = b''
+        self.t0 = None
+        self.elapsed_ms = 0
+        self.finished = False
+
+    def feed(self, data):
+        """返回本次新解出的采样列表 [(起始后毫秒数, 阻值, 状态)]"""
+        self.buf += data
+        rows = []
+        if self.t0 is None:
+            if len(self.buf) < HEADER_SIZE:
+                return rows
+            self.t0, _ = parse_header(self.buf)
+            self.buf = self.buf[HEADER_SIZE:]
+        pos = 0
+        while not self.finished and pos + RECORD_SIZE <= len(self.buf):
+            dt, word = struct.unpack_from('<HH', self.buf, pos)
+            pos += RECORD_SIZE
+            self.elapsed_ms += dt
+            value, flag = word & 0x3FFF, word >> 14
+            if flag == FLAG_CTRL:
+                if value == CTRL_END:
+                    self.finished = True
+                continue
+            rows.append((self.elapsed_ms, value, FLAG_NAMES[flag]))
+        self.buf = self.buf[pos:]
+        return rows
+
+    def format_csv_row(self, row):
+        elapsed_ms, value, status = row
+        t = self.t0 + elapsed_ms / 1000.0
+        stamp = time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(t)) + f".{int(t * 1000) % 1000:03d}"
+        return f"{stamp},{elapsed_ms},{value},{status}"
+
+
+CSV_HEADER = "time,elapsed_ms,resistance,status"
+
+
+def decode_to_csv(data):
+    """把完整的日志内容转换为CSV文本"""
+    dec = StreamDecoder()
+    lines = [CSV_HEADER] + [dec.format_csv_row(row) for row in dec.feed(data)]
+    return '\n'.join(lines) + '\n'
+
+
+FR_HEADER_SIZE = 64
+FR_SAMPLE, FR_CMD, FR_ALARM = 0, 1, 2
+FR_PHASES = {0: 'OK', 1: 'HIGH', 2: 'LOW', 3: 'VIB'}
+FR_CSV_HEADER = "time,elapsed_ms,type,resistance,code,status"
+
+
+def decode_flight_to_csv(data):
+    """把飞行记录器的环形文件按时间顺序转换为CSV，触发冻结的记录标为 ALARM*"""
+    magic, version, rec_size, _, capacity, head, frozen, trigger, sec, ms = \
+        struct.unpack_from('<4sBBHIIIIIH', data)
+    if magic != b'FREC' or version != 1 or rec_size != 8:
+        raise ValueError(f"不支持的飞行记录版本 {version}/{rec_size}")
+    t0 = sec + ms / 1000.0
+    first = max(0, head - capacity)
+    lines = [FR_CSV_HEADER]
+    for n in range(first, head):
+        t_ms, value, word = struct.unpack_from('<IHH', data, FR_HEADER_SIZE + (n % capacity) * rec_size)
+        kind, aux = word >> 14, word & 0x3FFF
+        t = t0 + t_ms / 1000.0
+        stamp = time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(t)) + f".{int(t * 1000) % 1000:03d}"
+        if kind == FR_CMD:
+            lines.append(f"{stamp},{t_ms},CMD{aux},{value & 0xFF},{value >> 8},")
+        else:
+            name = 'ALARM*' if frozen and n == trigger else ('ALARM' if kind == FR_ALARM else 'SAMPLE')
+            lines.append(f"{stamp},{t_ms},{name},{value},{aux & 0xFFF},{FR_PHASES.get(aux >> 12, '?')}")
+    return '\n'.join(lines) + '\n'
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return 1
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    csv = decode_flight_to_csv(data) if data[:4] == b'FREC' else decode_to_csv(data)
+    if len(sys.argv) > 2:
+        with open(sys.argv[2], 'w') as f:
+            f.write(csv)
+    else:
+        sys.stdout.write(csv)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
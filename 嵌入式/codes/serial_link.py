@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""串口链路层（与 task2.c 对应）：0x7E 帧定界、字节填充、CRC-16 校验、序号和选择重传
+
+帧格式: 7E | 类型 | 序号 | 负载 | CRC高 | CRC低 | 7E，帧内的 7E/7D 转义为 7D, 原字节^0x20
+板子→上位机: 'L' 日志数据  'F' 模式2/3回复帧  'R' 同步通告（负载1字节，1表示强制同步）
+上位机→板子: 'A' 累计确认（序号为期望的下一帧）  'N' 否认（只重发该序号的帧）  'R' 请求同步
+"""
+
+import time
+
+FLAG, ESC = 0x7E, 0x7D
+WINDOW = 16              # 板子的发送窗口
+SYNC_RETRY_S = 0.3       # 未同步时请求同步的最小间隔
+NAK_RETRY_S = 0.3        # 同一缺失帧两次否认之间的最小间隔
+
+
+def crc16_ccitt(data, crc=0xFFFF):
+    """CRC-16/CCITT（多项式0x1021，初值0xFFFF）"""
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+        crc &= 0xFFFF
+    return crc
+
+
+def encode_frame(ftype, seq, payload=b''):
+    """组一个完整的链路帧（含首尾标志和转义）"""
+    if isinstance(ftype, str):
+        ftype = ord(ftype)
+    body = bytes([ftype, seq & 0xFF]) + bytes(payload)
+    crc = crc16_ccitt(body)
+    body += bytes([crc >> 8, crc & 0xFF])
+    out = bytearray([FLAG])
+    for b in body:
+        if b in (FLAG, ESC):
+            out += bytes([ESC, b ^ 0x20])
+        else:
+            out.append(b)
+    out.append(FLAG)
+    return bytes(out)
+
+
+class LinkDeframer:
+    """按 0x7E 切帧、去转义并校验CRC，串口数据分段到达时逐段喂入"""
+
+    def __init__(self):
+        self.buf = bytearray()
+        self.in_frame = False
+        self.esc = False
+        self.crc_errors = 0
+
+    def feed(self, data):
+        """返回本次收到的完整帧列表 [(类型字符, 序号, 负载)]"""
+        frames = []
+        for b in data:
+            if b == FLAG:
+                body, self.buf, self.esc = bytes(self.buf), bytearray(), False
+                if not body:
+                    self.in_frame = True
+                    continue
+                if len(body) >= 4 and crc16_ccitt(body[:-2]) == (body[-2] << 8 | body[-1]):
+                    frames.append((chr(body[0]), body[1], body[2:-2]))
+                else:
+                    self.crc_errors += 1
+                # 两帧之间可以共用一个标志，结束标志同时视为下一帧的开始
+                self.in_frame = True
+            elif not self.in_frame:
+                continue
+            elif b == ESC:
+                self.esc = True
+            else:
+                self.buf.append(b ^ 0x20 if self.esc else b)
+                self.esc = False
+        return frames
+
+
+class LinkReceiver:
+    """接收端：缓存窗口内乱序到达的帧并按序交付，对缺失的帧逐个否认，收到新数据后按块累计确认"""
+
+    def __init__(self, write):
+        self.write = write          # 向板子发送字节的函数
+        self.deframer = LinkDeframer()
+        self.expected = None        # 期望的下一帧序号，None 表示尚未同步
+        self.pending = {}           # 乱序到达的帧 {序号: (类型, 负载)}
+        self.nak_time = {}          # 缺失帧最近一次否认的时间
+        self.last_sync_req = 0.0
+        self.delivered = 0
+        self.duplicates = 0
+        self.gaps = 0
+
+    def _send(self, ftype, seq):
+        self.write(encode_frame(ftype, seq))
+
+    def feed(self, data):
+        """喂入串口数据，返回按序交付的 [(类型字符, 负载)]"""
+        out = []
+        need_ack = False
+        for ftype, seq, payload in self.deframer.feed(data):
+            if ftype == 'R':
+                force = bool(payload and payload[0])
+                # 窗口内的旧序号说明只是确认丢了，保持当前进度，避免重复交付
+                behind = self.expected is not None and (self.expected - seq) & 0xFF <= WINDOW
+                if force or not behind:
+                    if self.expected is not None and seq != self.expected:
+                        print(f"链路重新同步: {self.expected} -> {seq}" + ("（板子丢弃了未确认的数据）" if force else ""))
+                    self.expected = seq
+                    self.pending.clear()
+                    self.nak_time.clear()
+                need_ack = True
+            elif self.expected is None:
+                now = time.time()
+                if now - self.last_sync_req >= SYNC_RETRY_S:
+                    self._send('R', 0)
+                    self.last_sync_req = now
+            elif (seq - self.expected) & 0xFF < WINDOW:
+                if seq in self.pending:
+                    self.duplicates += 1
+                self.pending[seq] = (ftype, payload)
+                while self.expected in self.pending:
+                    out.append(self.pending.pop(self.expected))
+                    self.nak_time.pop(self.expected, None)
+                    self.expected = (self.expected + 1) & 0xFF
+                    self.delivered += 1
+                    need_ack = True
+            else:
+                # 确认丢失导致的重发，重新确认
+                self.duplicates += 1
+                need_ack = True
+        if need_ack:
+            self._send('A', self.expected)
+        if self.pending:
+            # 已收到更靠后的帧，中间缺的逐个否认
+            now = time.time()
+            last = max((s - self.expected) & 0xFF for s in self.pending)
+            for i in range(last):
+                seq = (self.expected + i) & 0xFF
+                if seq not in self.pending and now - self.nak_time.get(seq, 0) >= NAK_RETRY_S:
+                    self._send('N', seq)
+                    self.nak_time[seq] = now
+                    self.gaps += 1
+        return out
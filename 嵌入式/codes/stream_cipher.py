@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""ChaCha20 解密（与 task2.c 对应，RFC 8439），密钥文件为64个十六进制字符
+
+用法: python3 stream_cipher.py [stream.key]   运行 RFC 8439 测试向量并测量解密速度
+"""
+
+import struct
+import sys
+import time
+
+KEY_FILE = 'stream.key'
+NONCE_SIZE = 12
+ENCRYPT = 1  # 模式4/5命令中的加密标志
+MASK = 0xFFFFFFFF
+
+
+def load_key(path=KEY_FILE):
+    """读取板子生成的密钥文件"""
+    with open(path) as f:
+        key = bytes.fromhex(f.read().strip()[:64])
+    if len(key) != 32:
+        raise ValueError(f"{path}: 密钥应为64个十六进制字符")
+    return key
+
+
+def _block(state):
+    x = list(state)
+
+    def qr(a, b, c, d):
+        x[a] = (x[a] + x[b]) & MASK
+        x[d] ^= x[a]
+        x[d] = ((x[d] << 16) | (x[d] >> 16)) & MASK
+        x[c] = (x[c] + x[d]) & MASK
+        x[b] ^= x[c]
+        x[b] = ((x[b] << 12) | (x[b] >> 20)) & MASK
+        x[a] = (x[a] + x[b]) & MASK
+        x[d] ^= x[a]
+        x[d] = ((x[d] << 8) | (x[d] >> 24)) & MASK
+        x[c] = (x[c] + x[d]) & MASK
+        x[b] ^= x[c]
+        x[b] = ((x[b] << 7) | (x[b] >> 25)) & MASK
+
+    for _ in range(10):
+        qr(0, 4, 8, 12)
+        qr(1, 5, 9, 13)
+        qr(2, 6, 10, 14)
+        qr(3, 7, 11, 15)
+        qr(0, 5, 10, 15)
+        qr(1, 6, 11, 12)
+        qr(2, 7, 8, 13)
+        qr(3, 4, 9, 14)
+    return struct.pack('<16I', *((x[i] + state[i]) & MASK for i in range(16)))
+
+
+class ChaCha20:
+    """密钥流按字节连续使用，seek() 可跳到任意块（遥测帧按帧序号定位）"""
+
+    def __init__(self, key, nonce, counter=0):
+        self.state = list(struct.unpack('<4I', b'expand 32-byte k') + struct.unpack('<8I', key) +
+                          (counter,) + struct.unpack('<3I', nonce))
+        self.ks = b''
+
+    def seek(self, block):
+        self.state[12] = block & MASK
+        self.ks = b''
+
+    def xor(self, data):
+        out = bytearray(data)
+        pos = 0
+        while pos < len(out):
+            if not self.ks:
+                self.ks = _block(self.state)
+                self.state[12] = (self.state[12] + 1) & MASK
+            n = min(len(self.ks), len(out) - pos)
+            for i in range(n):
+                out[pos + i] ^= self.ks[i]
+            self.ks = self.ks[n:]
+            pos += n
+        return bytes(out)
+
+
+def selftest():
+    """RFC 8439 2.4.2 的加密测试向量"""
+    key = bytes(range(32))
+    nonce = bytes.fromhex('000000000000004a00000000')
+    plain = (b"Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+             b"for the future, sunscreen would be it.")
+    cipher = ChaCha20(key, nonce, 1).xor(plain)
+    return cipher[:16].hex() == '6e2e359a2568f98041ba0728dd0d6981'
+
+
+if __name__ == '__main__':
+    print("RFC 8439 测试向量:", "通过" if selftest() else "失败")
+    if len(sys.argv) > 1:
+        cc = ChaCha20(load_key(sys.argv[1]), bytes(NONCE_SIZE))
+        t0 = time.time()
+        cc.xor(bytes(64 * 1024))
+        rate = 64 * 1024 / (time.time() - t0)
+        print(f"解密速度 {rate / 1024:.0f} KB/s（460800bps 满负荷需要 45 KB/s）")
@@ -1,307 +1,1825 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
-int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop);
-int read_adc_value(int fd_adc, char *buffer);
+#define LOG_FILE "2_4.bin"
+#define LOG_RING_SIZE 256    // 采样环形缓冲区容量（必须是2的幂）
+#define LOG_BATCH_SIZE 4096  // 单个批量缓冲区大小
+#define LOG_BLOCK_SIZE 512   // 文件按块对齐写入
+#define LOG_FLUSH_MS 200     // 批量刷新间隔（毫秒）
+
+// 二进制采样日志格式（小端）：
+//   文件头16字节: "RLOG" | u8 版本 | u8 记录长度 | u16 采样周期ms | u32 起始秒 | u16 起始毫秒 | u16 保留
+//   记录4字节:   u16 距上一条记录的毫秒数（单调时钟） | u16 阻值(低14位) + 标志(高2位)
+// 标志为 LOG_FLAG_CTRL 时阻值字段是控制码：SKIP 只推进时间，END 表示日志结束
+#define LOG_HEADER_SIZE 16
+#define LOG_RECORD_SIZE 4
+#define LOG_VERSION 1
+#define LOG_PERIOD_MS 100
+#define LOG_FLAG_OK 0
+#define LOG_FLAG_HIGH 1
+#define LOG_FLAG_LOW 2
+#define LOG_FLAG_CTRL 3
+#define LOG_CTRL_SKIP 1
+#define LOG_CTRL_END 2
+
+// 连续遥测（模式5）：上位机发送 {0x7B, 0x05, 波特率代码, 抽取比, 0x7D} 订阅，
+// 板子先以原波特率回复 {0x7B, 0x05, 波特率代码, 实际抽取比, BCC, 0x7D}，再切换波特率，
+// 之后持续发送数据帧 {0x7B, 'S', 序号高, 序号低, N, N×(阻值高|状态<<6, 阻值低), BCC, 0x7D}
+// 抽取比为0时停止订阅；波特率代码 0=不变 1=9600 2=115200 3=460800
+#define STREAM_BATCH 32                          // 每帧读数个数
+#define STREAM_FRAME_MAX (5 + 2 * STREAM_BATCH + 2)
+#define STREAM_CONTROL_HZ 100                    // 控制循环频率，抽取前的读数速率
+#define LOG_ITEM_MAX 80                          // 日志线程单次追加的最大字节数
+#define CMD_MODES 8
+
+// 链路层：模式2/3回复和模式4日志数据按帧发送，带字节填充、CRC-16、序号和滑动窗口选择重传
+//   帧格式: 0x7E | 类型 | 序号 | 负载 | CRC高 | CRC低 | 0x7E
+//   两个 0x7E 之间出现的 0x7E/0x7D 转义为 {0x7D, 原字节^0x20}；CRC-16/CCITT（多项式0x1021，初值0xFFFF）覆盖类型到负载
+//   板子→上位机: 'L' 日志数据  'F' 模式2/3回复帧  'R' 同步通告（序号为最早未确认帧，负载1字节，1表示强制同步）
+//   上位机→板子: 'A' 累计确认（序号为期望的下一帧）  'N' 否认（只重发该序号的帧）  'R' 请求同步
+// 遥测帧（模式5）是实时数据，丢了重发没有意义，仍按原格式直接发送
+#define LINK_FLAG 0x7E
+#define LINK_ESC 0x7D
+#define LINK_WINDOW 16                                      // 未确认帧上限，8位序号下必须小于128
+#define LINK_PAYLOAD_MAX 240
+#define LINK_FRAME_MAX (2 + 2 * (2 + LINK_PAYLOAD_MAX + 2))  // 全部字节都转义时的最坏长度
+#define LINK_RTO_MS 300                                     // 重发最早未确认帧的超时，另加窗口内数据的发送时间
+#define LINK_MAX_RETRIES 10                                 // 窗口连续无进展的超时次数上限，超过后丢弃窗口并强制同步
+#define LINK_RX_MAX 16                                      // 上位机发来的链路帧都很短
+
+// 加密：ChaCha20（RFC 8439），按32位字运算。256位密钥从 KEY_FILE 读取（64个十六进制字符），
+// 文件不存在时随机生成并保存，上位机需要同一个文件。每个会话使用新的96位随机 nonce：
+//   模式3: 回复帧负载为 nonce(12) + 加密后的8字节回复帧
+//   模式4: 命令 {0x7B, 0x04, 标志, 0x7D}，标志位0表示加密。日志数据前先发链路帧 'K'（负载为 nonce），
+//          之后 'L' 帧的字节按会话内偏移连续加密；板子上的日志文件仍为明文
+//   模式5: 命令 {0x7B, 0x05, 波特率代码, 抽取比, 标志, 0x7D}，加密时应答为
+//          {0x7B, 'K', 波特率代码, 实际抽取比, nonce(12), BCC, 0x7D}，数据帧类型改为 'E'，
+//          读数部分用块计数器 = 扩展帧序号（序号回绕后继续累加）的密钥流加密，每帧最多64字节正好一块，丢帧不影响解密
+#define KEY_FILE "stream.key"
+#define CHACHA_NONCE_SIZE 12
+#define CRYPT_BENCH_BYTES (4 * 1024 * 1024)
+#define CRYPT_ENCRYPT 1  // 模式4/5命令中的加密标志
+
+typedef struct {
+    uint32_t state[16];  // 常量 | 密钥 | 块计数器 | nonce
+    uint32_t ks[16];     // 当前密钥块
+    int ks_pos;          // 当前密钥块已用字节数，64 表示需要生成下一块
+} chacha_t;
+
+enum { LOG_SAMPLE, LOG_START, LOG_END, LOG_STREAM, LOG_STREAM_CFG, LOG_REPLY, LOG_TIMING, LOG_SPECTRUM };
+
+typedef struct {
+    int kind;
+    int r;           // 阻值；LOG_STREAM_CFG 时为波特率代码（第8位起为标志）
+    int aux;         // LOG_STREAM/LOG_REPLY 时为报警状态（LOG_REPLY 的第8位表示加密）；LOG_STREAM_CFG 时为抽取比；
+                     // LOG_START/LOG_TIMING 时为标志
+    long long t_ms;  // 单调时钟毫秒
+} log_sample_t;
+
+typedef struct {
+    unsigned char type;
+    unsigned char len;
+    unsigned char data[LINK_PAYLOAD_MAX];
+} link_frame_t;
+
+// 上位机链路帧的接收状态
+typedef struct {
+    unsigned char buf[LINK_RX_MAX];
+    int len;
+    bool in_frame, esc;
+} link_rx_t;
+
+// 后台日志：控制循环只把采样推入无锁环形缓冲区（单生产者/单消费者），
+// 时间格式化、写文件和串口发送全部由日志线程完成
+typedef struct {
+    log_sample_t ring[LOG_RING_SIZE];
+    unsigned int head;     // 生产者（控制循环）写入位置
+    unsigned int tail;     // 消费者（日志线程）读取位置
+    unsigned int dropped;  // 环形缓冲区满时丢弃的采样数
+    int notify_fd[2];      // 唤醒日志线程的管道
+    int fd_uart;
+    unsigned char batch[2][LOG_BATCH_SIZE];  // 双缓冲：一个填充记录，另一个发往串口
+    int fill, fill_len;
+    int fd_file;
+    unsigned char block[LOG_BLOCK_SIZE];  // 当前文件块
+    int block_len;
+    long long block_index;
+    long long last_ms;  // 上一条记录的时间，用于差分编码
+    unsigned short stream_vals[STREAM_BATCH];  // 待打包的遥测读数
+    int stream_n;
+    unsigned short stream_seq;
+    unsigned int stream_block;  // 加密遥测的扩展帧序号
+    unsigned int spec_block;    // 频谱帧序号，低16位写入帧中
+    bool stream_encrypt, dump_encrypt;
+    chacha_t stream_cc, dump_cc;
+    int pending_baud;   // 应答发完后要切换到的波特率
+    int baud;           // 当前波特率，用于估算重发超时
+    // 链路层发送窗口，序号按模256运算
+    link_frame_t win[LINK_WINDOW];  // 已组帧未确认的帧，按序号取模存放
+    unsigned char base;             // 最早未确认的序号
+    unsigned char next_seq;         // 下一个新帧的序号
+    unsigned char send_seq;         // 下一个从未发送过的序号
+    unsigned int resend;            // 待重发的帧，按序号取模置位
+    unsigned char pend[LINK_PAYLOAD_MAX + LOG_ITEM_MAX];  // 尚未组帧的日志字节
+    int pend_len;
+    long long pend_ms;              // 第一个未组帧字节的时间，超过 LOG_FLUSH_MS 就组帧发出
+    long long progress_ms;          // 窗口最近一次推进（或超时重发）的时间
+    int retries;
+    int sync;                       // 待发送的同步通告：0 无，1 通告，2 强制同步
+    bool fill_link;                 // 填充缓冲区中已有链路帧，尽快发出
+    unsigned int retransmits;
+    // 控制循环收到的上位机确认：高位为计数，低8位为序号，日志线程比较计数发现新输入
+    int peer_ack, peer_nak, peer_sync;
+    int seen_ack, seen_nak, seen_sync;
+} logger_t;
+
+// 默认标定：码值 c 对应阻值 c*10000/4095（10kΩ 电位器），用宏在编译期展开成4096项的表
+#define ADC_CODES 4096
+#define CAL_OHM(c) ((c) * 10000 / 4095)
+#define CAL_T4(c) CAL_OHM(c), CAL_OHM((c) + 1), CAL_OHM((c) + 2), CAL_OHM((c) + 3)
+#define CAL_T16(c) CAL_T4(c), CAL_T4((c) + 4), CAL_T4((c) + 8), CAL_T4((c) + 12)
+#define CAL_T64(c) CAL_T16(c), CAL_T16((c) + 16), CAL_T16((c) + 32), CAL_T16((c) + 48)
+#define CAL_T256(c) CAL_T64(c), CAL_T64((c) + 64), CAL_T64((c) + 128), CAL_T64((c) + 192)
+#define CAL_T1024(c) CAL_T256(c), CAL_T256((c) + 256), CAL_T256((c) + 512), CAL_T256((c) + 768)
+#define CAL_T4096(c) CAL_T1024(c), CAL_T1024((c) + 1024), CAL_T1024((c) + 2048), CAL_T1024((c) + 3072)
+#define CAL_FILE "calib.txt"  // 板级标定曲线：每行 "码值 阻值"，按码值递增，点间线性插值
+#define CAL_MAX_POINTS 64
+
+// 报警分类：EDGE 表示阻值恰好落在阈值上，既不触发报警也不解除报警
+enum { ALARM_NONE, ALARM_HIGH, ALARM_LOW, ALARM_EDGE };
+
+// 标定表：采样路径上只需按码值查表，换算在配置加载时完成
+typedef struct {
+    uint16_t ohms[ADC_CODES];
+} calib_t;
+
+// 运行参数：阈值、闪烁频率和据此生成的报警分类表打包成一个只读块。模式1命令先在新块里
+// 构建并校验，再用一次原子指针存储发布（RCU 风格），读者每个周期只做一次原子加载，
+// 不会看到新旧参数各一半。读者只在一个周期内使用指针，旧块过了 PARAM_GRACE_MS 再释放
+#define PARAM_FILE "params.txt"  // 持久化：一行 "版本 低阈值 高阈值 闪烁频率 [频谱报警频带 阈值]"
+#define PARAM_GRACE_MS 1000
+#define PARAM_RETIRED 8          // 宽限期内最多积压的旧块，超过时拒绝更新
+#define PARAM_FREQ_MAX 100       // 闪烁频率上限（Hz）
+
+typedef struct {
+    uint32_t version;
+    int thresh_low, thresh_high;
+    float flash_freq;
+    int spec_band;    // 频谱报警使用的频带，SPEC_RULE_OFF 表示关闭
+    int spec_thresh;  // 频带RMS阈值（0.1码值）
+    uint8_t alarm[ADC_CODES];
+} params_t;
+
+typedef struct {
+    params_t *cur;                        // 当前参数块，原子读写
+    params_t *retired[PARAM_RETIRED];     // 等待宽限期结束的旧块，只有写者访问
+    long long retired_ms[PARAM_RETIRED];
+    int n_retired;
+    const char *path;                     // NULL 表示不持久化（回放）
+    unsigned int rejected;
+} param_store_t;
+
+// 过采样采集：采集线程以 ACQ_RATE_HZ 读取ADC，经定点滤波链抽取到控制频率后发布给控制循环
+#define ACQ_RATE_HZ 1000
+#define ACQ_FRAC_BITS 4      // 滤波链内部使用 Q4 定点（ADC码值左移4位）
+#define ACQ_MAX_STAGES 6
+#define ACQ_MAX_TAPS 16      // 滑动平均/中值滤波的最大窗口
+#define ACQ_CIC_MAX_ORDER 4
+#define ACQ_DEFAULT_CHAIN "median:3,cic:2:10,iir:2"
+
+enum { FILT_MA, FILT_MEDIAN, FILT_IIR, FILT_CIC };
+
+// 频谱分析：采集线程把原始码值写入 SPEC_N 点的样本环，每 SPEC_HOP 个样本（50%重叠）算一帧：
+// 去均值、Q15 Hann 窗、定点实数FFT（N/2 点复数基2 FFT 再拆分出实序列的频谱），
+// 得到主频和各频带的RMS，用 seqlock 发布给控制循环。频带RMS可以作为报警条件（模式7），
+// 订阅遥测时每秒发一个 'P' 帧
+#define SPEC_N 256
+#define SPEC_HOP 128
+#define SPEC_BANDS 4
+#define SPEC_VALUES (2 + SPEC_BANDS)   // 结果依次为主频(0.1Hz)、主频分量RMS、各频带RMS（RMS单位0.1码值）
+#define SPEC_FDOM 0
+#define SPEC_PEAK 1
+#define SPEC_BAND 2
+#define SPEC_WIN_SHIFT 5               // 加窗后样本为 码值*2^10，N 点求和不超过 2^29
+#define SPEC_RULE_OFF 0xFF
+#define SPEC_LEVEL_MAX 1023            // 报警和轨迹使用的频带RMS上限
+#define SPEC_REPORT_TICKS 100          // 遥测中频谱帧的间隔（控制周期数）
+#define SPEC_BLOCK_BASE 0x80000000u    // 加密频谱帧的密钥块号，与读数帧分开
+#define SPEC_BENCH_FRAMES 20000
+
+typedef struct {
+    int rate_hz;
+    int16_t window[SPEC_N];                            // Q15 Hann 窗
+    int16_t cos_q15[SPEC_N / 2], sin_q15[SPEC_N / 2];  // 旋转因子 W_N^k = cos - j*sin
+    int band_bin[SPEC_BANDS + 1];                      // 频带边界（频点号，左闭右开）
+    int32_t ring[SPEC_N];                              // 最近 SPEC_N 个原始码值
+    int pos, fill, hop;
+    int32_t x[SPEC_N], re[SPEC_N / 2], im[SPEC_N / 2];  // 工作区，只有采集线程访问
+    unsigned int seq;                                  // seqlock：奇数表示正在更新
+    uint16_t res[SPEC_VALUES];
+    unsigned int frames;
+} spec_t;
+
+typedef struct {
+    int type;
+    int n;                           // MA/中值窗口长度；IIR 系数 alpha = 1/2^n；CIC 阶数
+    int r;                           // CIC 抽取比
+    int32_t hist[ACQ_MAX_TAPS];      // MA/中值历史，或一阶CIC的待求和输入
+    int pos, fill;
+    int32_t sum;                     // MA 滑动和
+    int32_t recip;                   // MA 的 Q16 倒数 65536/n
+    int32_t acc;                     // IIR 状态（额外8位小数）
+    uint32_t integ[ACQ_CIC_MAX_ORDER], comb[ACQ_CIC_MAX_ORDER];  // CIC 积分器/梳状器，按模2^32运算
+    int64_t gain;                    // CIC 增益 r^n
+} filter_stage_t;
+
+typedef struct {
+    filter_stage_t stage[ACQ_MAX_STAGES];
+    int nstages;
+} filter_chain_t;
+
+typedef struct {
+    int fd_adc;
+    int rate_hz;
+    filter_chain_t chain;
+    spec_t spec;            // 原始码值的频谱
+    int code;               // 最新的滤波后ADC码值，控制循环原子读取
+    unsigned int outputs;   // 滤波链输出计数
+    unsigned int overruns;  // 未能按时完成的采样周期数
+} acq_t;
+
+// 软件PWM引擎：一个定时线程驱动所有输出通道，按最近的翻转时刻睡眠，只在电平变化时调用ioctl
+#define PWM_CHANNELS 3  // 0、1 为两个LED，2 为蜂鸣器
+#define PWM_BUZZER 2
+
+enum { PWM_OFF, PWM_ON, PWM_BLINK, PWM_CHIRP, PWM_BURST };
+
+typedef struct {
+    int pattern;
+    long period_us;   // 闪烁周期；CHIRP 为起始周期
+    long period2_us;  // CHIRP 终止周期
+    long span_us;     // CHIRP 一次扫频的时长；BURST 两组脉冲之间的间隔
+    int duty;         // 占空比（千分比）
+    int count;        // BURST 每组脉冲数
+    bool on;          // 当前电平
+    int hw;           // 已写入硬件的电平，-1 表示未知
+    long long start_us;
+    long long next_us;  // 下一次翻转的时刻
+    int pulse;          // BURST 本组已输出的脉冲数
+} pwm_channel_t;
+
+typedef struct {
+    pwm_channel_t ch[PWM_CHANNELS];
+    int fd_led, fd_bz;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pwm_t;
+
+// ADC 轨迹（-r 录制，-p 回放）：文件头8字节 "ATRC" | u8 版本 | 3字节保留，
+// 之后每条记录 u16 距上一条的毫秒数 | u16 值(低12位) + 类型(高4位)：
+//   TRACE_ADC: 值为控制逻辑使用的ADC码值，每个控制周期一条；TRACE_CMD: 值为命令帧长度 n，记录后紧跟 n 字节命令帧；
+//   TRACE_SPEC: 值为 频带号<<10 | 频带RMS（截到 SPEC_LEVEL_MAX），只在变化时记录
+// 回放时每条 TRACE_ADC 运行一次控制逻辑，时间取记录的时间，和实时运行的周期（包括迟到和跳过的）一一对应。
+// LED/蜂鸣器/串口输出记成事件行：
+//   "<毫秒> led0|led1|buzzer off|on|blink|chirp|burst <频率>"、"<毫秒> uart <类型> <r> <aux>"
+#define TRACE_HEADER_SIZE 8
+#define TRACE_RECORD_SIZE 4
+#define TRACE_VERSION 1
+#define CTL_PERIOD_MS 10
+
+enum { TRACE_ADC, TRACE_CMD, TRACE_SPEC };
+
+typedef struct {
+    FILE *fp;
+    long long last_ms;
+    bool started;
+    unsigned int count;
+} trace_t;
+
+// 控制逻辑的状态，实时运行和回放共用
+typedef struct {
+    param_store_t *params;
+    int special_phase;
+    int r;
+    unsigned int tick;
+    bool logging;
+    long long start_time;
+    int duration;
+    int uart_baud;
+    int stream_decim;  // 连续遥测的抽取比，0表示未订阅
+    int stream_tick;
+    int spec_level[SPEC_BANDS];  // 各频带RMS，由调用者每周期更新（回放时来自轨迹）
+    bool verbose;      // 打印收到的命令
+} ctl_t;
+
+// 控制逻辑的输出：实时运行时驱动 PWM 引擎和日志线程，回放时记录成事件序列
+typedef struct {
+    void (*pwm)(void *ctx, int ch, int pattern, float freq);
+    void (*push)(void *ctx, int kind, int r, int aux);
+    void *ctx;
+} ctl_out_t;
+
+typedef struct {
+    long long now;  // 轨迹时间（毫秒）
+    FILE *expect;
+    unsigned int events;
+    bool mismatch;
+    int pattern[PWM_CHANNELS];
+    float freq[PWM_CHANNELS];
+} replay_t;
+
+// 飞行记录器：最近 FR_RECORDS 条采样和事件始终写在 mmap 映射的环形文件里，稳态下只有内存写入。
+// 报警状态从0变为1/2时把当前环冻结，控制循环立即切换到预先分配好的备用文件继续记录，
+// 后台线程再把冻结的文件改名为 flight_NN.bin（不复制数据）并准备新的备用文件。
+// 启动时上次运行留下的环（可能是崩溃前的最后几十秒）改名为 FR_PREV_FILE 保留。
+//   文件头64字节（小端）: "FREC" | u8 版本 | u8 记录长度 | u16 保留 | u32 容量 | u32 已写记录数 |
+//                         u32 冻结标志 | u32 触发记录序号 | u32 起始秒 | u16 起始毫秒 | 保留
+//   记录8字节: u32 距起始的毫秒数 | u16 阻值 | u16 码值(低12位) + 报警状态(2位) + 类型(高2位)
+//   FR_CMD 记录的阻值字段为命令帧第3、4字节，码值字段为模式；FR_ALARM 记录在冻结前最后写入
+#define FR_FILE "flight.ring"
+#define FR_SPARE_FILE "flight.spare"
+#define FR_PREV_FILE "flight_prev.bin"
+#define FR_DUMP_FMT "flight_%02d.bin"
+#define FR_MAX_DUMPS 16     // 超过后覆盖最旧的一个
+#define FR_RECORDS 4096     // 100Hz 下约40秒
+#define FR_VERSION 1
+
+enum { FR_SAMPLE, FR_CMD, FR_ALARM };
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t record_size;
+    uint16_t reserved;
+    uint32_t capacity;
+    uint32_t head;     // 已写入的记录总数，下一条写在 head % capacity
+    uint32_t frozen;
+    uint32_t trigger;  // 触发冻结的记录序号
+    uint32_t wall_sec;
+    uint16_t wall_ms;
+    uint8_t pad[34];   // 补足64字节
+} fr_header_t;
+
+typedef struct {
+    uint32_t t_ms;
+    uint16_t value;
+    uint16_t code;
+} fr_record_t;
+
+typedef struct {
+    int fd;
+    fr_header_t *hdr;  // NULL 表示未映射
+    fr_record_t *rec;
+    long long t0;      // 起始单调时钟毫秒
+} fr_map_t;
+
+typedef struct {
+    fr_map_t active;   // 控制循环正在写的环
+    fr_map_t spare;    // 后台线程准备好的备用环
+    fr_map_t frozen;   // 等待后台线程落盘的环
+    int spare_ready;   // 原子标志：备用环可用
+    bool pending;      // frozen 有待处理的环
+    unsigned int missed;  // 备用环未就绪而没能冻结的次数
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} flight_t;
+
+// 控制循环计时：各阶段用 CLOCK_MONOTONIC 计时，耗时按微秒取 log2 分桶（桶0不到1us，桶k为
+// [2^(k-1), 2^k) us，最后一桶含更长的），另记次数、最大值、总和和超出预算的次数。每次记录只是
+// 几次原子加法，可以一直开着。模式6命令 {7B 06 标志 7D} 由日志线程把快照每个阶段发一个 'T' 链路帧：
+//   u8 阶段 | u8 阶段数 | u32 跳过的节拍 | u32 次数 | u32 最大us | u32 超预算次数 | u64 总us | u32 桶[16]（小端）
+#define TIMING_BUCKETS 16
+#define TIMING_RESET 1       // 模式6标志：发送快照后清零
+#define TIMING_FRAME_SIZE (2 + 4 * 4 + 8 + 4 * TIMING_BUCKETS)
+
+// PERIOD: 相邻两次唤醒的间隔  BUSY: 一个周期的总处理时间  IOCTL: PWM线程驱动LED/蜂鸣器的一次 ioctl
+enum { TM_PERIOD, TM_BUSY, TM_ADC, TM_UART, TM_CMD, TM_CTL, TM_IOCTL, TM_PHASES };
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t over;
+    uint64_t sum_us;
+    uint32_t bucket[TIMING_BUCKETS];
+} timing_hist_t;
+
+typedef struct {
+    timing_hist_t h[TM_PHASES];
+    uint32_t missed;  // 落后超过一个周期而跳过的节拍
+} timing_t;
+
+int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop, bool rtscts);
+int read_adc_raw(int fd_adc, char *buffer);
+int calib_load(calib_t *cal, const char *path);
+void calib_build_alarm(const calib_t *cal, uint8_t *alarm, int thresh_low, int thresh_high);
+int param_init(param_store_t *ps, const char *path);
+int param_validate(const params_t *req);
+int param_publish(param_store_t *ps, const params_t *req, long long now);
+const params_t *param_get(param_store_t *ps);
+int param_save(const params_t *p, const char *path);
+int filter_chain_parse(filter_chain_t *fc, const char *spec);
+int filter_chain_run(filter_chain_t *fc, int32_t x, int32_t *y);
+int acq_start(acq_t *aq, int fd_adc, const char *spec);
+void *acq_thread(void *arg);
+void spec_init(spec_t *sp, int rate_hz);
+void spec_feed(spec_t *sp, int code);
+void spec_run(spec_t *sp);
+int spec_read(spec_t *sp, uint16_t *v);
+void spec_bench(void);
+int pwm_start(pwm_t *pw, int fd_led, int fd_bz);
+void pwm_set(pwm_t *pw, int ch, int pattern, float freq, float duty, float freq2, long span_ms, int count);
+void *pwm_thread(void *arg);
 long long get_timestamp(void);               // 获取时间戳函数
-void get_format_time_string(char *str_time); // 获取格式化时间
+long long get_mono_ms(void);
+long long get_mono_us(void);
+int logger_start(logger_t *lg, int fd_uart);
+int logger_push(logger_t *lg, int kind, int r, int aux);
+void *logger_thread(void *arg);
+void log_encode_header(unsigned char *p, long long wall_ms);
+void log_encode_record(unsigned char *p, unsigned int dt, int value, int flag);
+int stream_negotiate_decim(int decim, int baud);
+bool cmd_frame_done(const unsigned char *buf, int len);
+uint16_t crc16_ccitt(uint16_t crc, const unsigned char *p, int len);
+int link_encode(unsigned char *out, int type, int seq, const unsigned char *payload, int len);
+int link_rx_byte(link_rx_t *rx, unsigned char b);
+void logger_link_rx(logger_t *lg, int type, int seq);
+void chacha_init(chacha_t *cc, const uint8_t key[32], const uint8_t nonce[CHACHA_NONCE_SIZE]);
+void chacha_seek(chacha_t *cc, uint32_t block);
+void chacha_xor(chacha_t *cc, uint8_t *p, int len);
+int crypt_load_key(uint8_t key[32], const char *path);
+void crypt_nonce(uint8_t nonce[CHACHA_NONCE_SIZE]);
+void crypt_bench(void);
+void ctl_init(ctl_t *c, param_store_t *ps);
+void ctl_command(ctl_t *c, const ctl_out_t *out, const unsigned char *buf, int len, long long now);
+void ctl_step(ctl_t *c, const ctl_out_t *out, int code, long long now);
+void ctl_pwm_real(void *ctx, int ch, int pattern, float freq);
+void ctl_push_real(void *ctx, int kind, int r, int aux);
+void ctl_pwm_replay(void *ctx, int ch, int pattern, float freq);
+void ctl_push_replay(void *ctx, int kind, int r, int aux);
+int trace_open_write(trace_t *tr, const char *path);
+void trace_write(trace_t *tr, long long t_ms, int type, const unsigned char *data, int value);
+int trace_replay(const char *path, const char *expect_path);
+int flight_start(flight_t *fr);
+void flight_record(flight_t *fr, int type, int value, int aux);
+void flight_freeze(flight_t *fr);
+void *flight_thread(void *arg);
+void timing_add(timing_t *tm, int phase, long long us);
+int timing_encode(timing_t *tm, int phase, unsigned char *p, bool reset);
+
+const int g_stream_bauds[] = {0, 9600, 115200, 460800};
+const unsigned char g_cmd_len[CMD_MODES] = {0, 9, 3, 3, 4, 6, 4, 6};  // 各模式命令帧的总长度，含 0x7B 和 0x7D
+const int g_spec_band_hz[SPEC_BANDS + 1] = {2, 20, 45, 65, 500};  // 低频漂移、机械振动、工频、高频噪声
+
+pthread_mutex_t g_uart_lock = PTHREAD_MUTEX_INITIALIZER;  // 控制循环与日志线程共享串口发送
+bool g_uart_rtscts;                                       // -H：串口使用 RTS/CTS 硬件流控
+const uint16_t g_default_ohms[ADC_CODES] = {CAL_T4096(0)};
+uint8_t g_stream_key[32];
+calib_t g_calib;
+param_store_t g_params;
+logger_t g_logger;
+acq_t g_acq;
+pwm_t g_pwm;
+flight_t g_flight;
+timing_t g_timing;
+// 各阶段的预算（us）：周期超过1.5倍算迟到，处理时间超过一个周期算超时
+const uint32_t g_timing_budget_us[TM_PHASES] = {CTL_PERIOD_MS * 1500, CTL_PERIOD_MS * 1000, 1000, 1000, 2000, 1000, 500};
+
+int main(int argc, char *argv[]) {
+    int fd_adc, fd_led, fd_bz, fd_uart;
+    char *adc = "/dev/adc";
+    char *leds = "/dev/leds";
+    char *buzzer = "/dev/buzzer_ctl";
+    char *uart1 = "/dev/ttySAC3";
+    const char *filter_spec = ACQ_DEFAULT_CHAIN;  // "none" 时退回每10个周期直接读一次ADC
+    const char *calib_file = CAL_FILE;
+    const char *key_file = KEY_FILE;
+    const char *record_file = NULL;
+    const char *replay_file = NULL;
+    const char *expect_file = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:c:k:br:p:e:H")) != -1) {
+        if (opt == 'f') {
+            filter_spec = optarg;
+        } else if (opt == 'c') {
+            calib_file = optarg;
+        } else if (opt == 'k') {
+            key_file = optarg;
+        } else if (opt == 'b') {
+            crypt_bench();
+            spec_bench();
+            return 0;
+        } else if (opt == 'r') {
+            record_file = optarg;
+        } else if (opt == 'p') {
+            replay_file = optarg;
+        } else if (opt == 'e') {
+            expect_file = optarg;
+        } else if (opt == 'H') {
+            g_uart_rtscts = true;
+        } else {
+            printf("Usage: %s [-f none|ma:N,median:N,iir:K,cic:ORDER:R,...] [-c calib_file] [-k key_file] [-b] [-H]\n"
+                   "          [-r trace_file] [-p trace_file [-e expected_events]]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    int cal_points = calib_load(&g_calib, calib_file);
+    if (cal_points > 0) {
+        printf("Loaded %d calibration points from %s\n", cal_points, calib_file);
+    }
+    if (replay_file) {
+        // 回放不需要任何设备，按轨迹时间尽快运行控制逻辑
+        return trace_replay(replay_file, expect_file);
+    }
+    if (param_init(&g_params, PARAM_FILE) != 0) {
+        printf("init params error\n");
+        return 1;
+    }
+    if (crypt_load_key(g_stream_key, key_file) != 0) {
+        printf("load key %s error\n", key_file);
+        return 1;
+    }
+
+    if ((fd_adc = open(adc, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
+        printf("open ADC error\n");
+        return 1;
+    }
+    if ((fd_led = open(leds, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
+        printf("open LED error\n");
+        return 1;
+    }
+    if ((fd_bz = open(buzzer, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
+        printf("open buzzer error\n");
+        return 1;
+    }
+    if ((fd_uart = open(uart1, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
+        printf("open uart1 error\n");
+        return 1;
+    } else {
+        set_opt(fd_uart, 9600, 8, 'N', 1, g_uart_rtscts);
+    }
+    if (logger_start(&g_logger, fd_uart) != 0) {
+        printf("start logger error\n");
+        return 1;
+    }
+    bool oversample = strcmp(filter_spec, "none") != 0;
+    if (oversample && acq_start(&g_acq, fd_adc, filter_spec) != 0) {
+        printf("start acquisition error\n");
+        return 1;
+    }
+    trace_t rec;
+    if (record_file && trace_open_write(&rec, record_file) != 0) {
+        printf("open trace %s error\n", record_file);
+        return 1;
+    }
+    // 飞行记录器打不开时只是少了事后分析的数据，控制照常运行
+    bool flight = flight_start(&g_flight) == 0;
+
+    ctl_t ctl;
+    ctl_out_t out = {ctl_pwm_real, ctl_push_real, NULL};
+    int loop_times = 0;
+    int code = 0;  // 当前ADC码值
+    uint16_t spec[SPEC_VALUES];
+
+    ctl_init(&ctl, &g_params);
+    ctl.verbose = true;
+    if (record_file) {
+        // 轨迹开头记一条等效的模式1命令，回放时从同样的（可能是持久化恢复的）参数开始
+        const params_t *p = param_get(&g_params);
+        int f = (int)p->flash_freq;
+        unsigned char init[9] = {0x7B, 1, p->thresh_low >> 8, p->thresh_low, p->thresh_high >> 8, p->thresh_high,
+                                 f >> 8, f, 0x7D};
+        trace_write(&rec, get_mono_ms(), TRACE_CMD, init, sizeof(init));
+        unsigned char rule[6] = {0x7B, 7, p->spec_band, p->spec_thresh >> 8, p->spec_thresh, 0x7D};
+        trace_write(&rec, get_mono_ms(), TRACE_CMD, rule, sizeof(rule));
+    }
+
+    // LED 和蜂鸣器由 PWM 线程驱动，启动时全部熄灭
+    if (pwm_start(&g_pwm, fd_led, fd_bz) != 0) {
+        printf("start pwm error\n");
+        return 1;
+    }
+
+    char adc_tmp[16];
+    char uart_rx_tmp[100];
+    unsigned char uart_rx_buf[100];  // 无符号：参数字节 >= 0x80 时不能符号扩展
+    int uart_rx_cnt = 0;
+    link_rx_t link_rx;
+
+    memset(&link_rx, 0, sizeof(link_rx));
+
+    // 按绝对时间每 CTL_PERIOD_MS 唤醒一次，处理时间和调度延迟不会累积成频率误差
+    struct timespec next;
+    long long t_wake = 0;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+        next.tv_nsec += CTL_PERIOD_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        long long t0 = get_mono_us();
+        if (t_wake) timing_add(&g_timing, TM_PERIOD, t0 - t_wake);
+        t_wake = t0;
+        // 落后超过一个周期时不补跑，直接对齐到当前时间
+        long long late = t0 - ((long long)next.tv_sec * 1000000 + next.tv_nsec / 1000);
+        if (late >= CTL_PERIOD_MS * 1000) {
+            long skip = late / (CTL_PERIOD_MS * 1000);
+            __atomic_fetch_add(&g_timing.missed, skip, __ATOMIC_RELAXED);
+            next.tv_sec += skip * CTL_PERIOD_MS / 1000;
+            next.tv_nsec += skip * CTL_PERIOD_MS % 1000 * 1000000L;
+            if (next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                next.tv_sec++;
+            }
+        }
+
+        loop_times++;
+        long long now = t0 / 1000;
+
+        // 过采样模式下每个控制周期都取最新的滤波结果，否则每10个周期直接读一次ADC
+        if (oversample) {
+            code = __atomic_load_n(&g_acq.code, __ATOMIC_RELAXED);
+            if (spec_read(&g_acq.spec, spec)) {
+                for (int b = 0; b < SPEC_BANDS; b++) {
+                    int level = spec[SPEC_BAND + b] > SPEC_LEVEL_MAX ? SPEC_LEVEL_MAX : spec[SPEC_BAND + b];
+                    if (level == ctl.spec_level[b]) continue;
+                    if (record_file) trace_write(&rec, now, TRACE_SPEC, NULL, b << 10 | level);
+                    ctl.spec_level[b] = level;
+                }
+            }
+        } else if (loop_times % 10 == 0) {
+            int raw = read_adc_raw(fd_adc, adc_tmp);
+            if (raw >= 0) {
+                code = raw;
+            } else {
+                printf("ADC read error \n");
+            }
+        }
+        long long t1 = get_mono_us();
+        timing_add(&g_timing, TM_ADC, t1 - t0);
+
+        // 每个周期都读串口，链路确认要及时送到日志线程，否则发送窗口会停顿。
+        // 空闲时以 0x7E 开头的是链路帧，其余字节按原来的命令帧收集
+        int bytes_read = read(fd_uart, uart_rx_tmp, 100);
+        for (int i = 0; i < bytes_read; i++) {
+            unsigned char b = uart_rx_tmp[i];
+            if (link_rx.in_frame || (uart_rx_cnt == 0 && b == LINK_FLAG)) {
+                if (link_rx_byte(&link_rx, b) >= 2) {
+                    logger_link_rx(&g_logger, link_rx.buf[0], link_rx.buf[1]);
+                }
+            } else if (uart_rx_cnt < (int)sizeof(uart_rx_buf)) {
+                uart_rx_buf[uart_rx_cnt++] = b;
+            }
+        }
+        long long t2 = get_mono_us();
+        timing_add(&g_timing, TM_UART, t2 - t1);
+        if (cmd_frame_done(uart_rx_buf, uart_rx_cnt)) {
+            if (record_file) trace_write(&rec, now, TRACE_CMD, uart_rx_buf, uart_rx_cnt);
+            ctl_command(&ctl, &out, uart_rx_buf, uart_rx_cnt, now);
+            if (flight && uart_rx_cnt >= 3) {
+                int arg = uart_rx_buf[2] | (uart_rx_cnt > 3 ? uart_rx_buf[3] : 0) << 8;
+                flight_record(&g_flight, FR_CMD, arg, uart_rx_buf[1]);
+            }
+            uart_rx_cnt = 0;
+            long long t = get_mono_us();
+            timing_add(&g_timing, TM_CMD, t - t2);
+            t2 = t;
+        }
+
+        if (record_file) trace_write(&rec, now, TRACE_ADC, NULL, code);
+        int phase = ctl.special_phase;
+        ctl_step(&ctl, &out, code, now);
+        if (flight) {
+            flight_record(&g_flight, FR_SAMPLE, ctl.r, code | ctl.special_phase << 12);
+            if (phase == 0 && ctl.special_phase != 0) {
+                flight_record(&g_flight, FR_ALARM, ctl.r, code | ctl.special_phase << 12);
+                flight_freeze(&g_flight);
+            }
+        }
+        long long t3 = get_mono_us();
+        timing_add(&g_timing, TM_CTL, t3 - t2);
+        timing_add(&g_timing, TM_BUSY, t3 - t0);
+    }
+}
+
+// 控制逻辑初始状态
+void ctl_init(ctl_t *c, param_store_t *ps) {
+    memset(c, 0, sizeof(*c));
+    c->params = ps;
+    c->duration = 15000;  // 15秒，以毫秒为单位
+    c->uart_baud = 9600;
+}
+
+// 处理一条上位机命令帧 {0x7B, 模式, 参数..., 0x7D}
+void ctl_command(ctl_t *c, const ctl_out_t *out, const unsigned char *buf, int len, long long now) {
+    if (c->verbose) {
+        // Print as hex
+        printf("\n\nReceived message: ");
+        for (int i = 0; i < len; i++) {
+            printf("%02X ", buf[i]);
+        }
+        printf("\n");
+    }
+    if (len < 2) return;
+
+    int mode = buf[1];
+
+    if (mode == 1 && len >= 9) {
+        params_t req = *param_get(c->params);
+        req.thresh_low = buf[2] << 8 | buf[3];
+        req.thresh_high = buf[4] << 8 | buf[5];
+        req.flash_freq = buf[6] << 8 | buf[7];
+        if (param_publish(c->params, &req, now) != 0) {
+            if (c->verbose) printf("Rejected parameters\n");
+        } else if (c->special_phase != 0) {
+            out->pwm(out->ctx, 0, PWM_BLINK, req.flash_freq);
+            out->pwm(out->ctx, 1, PWM_BLINK, req.flash_freq);
+        }
+    } else if (mode == 2 || mode == 3) {
+        // 回复帧由日志线程组帧，经链路层可靠发送；模式3加密
+        out->push(out->ctx, LOG_REPLY, c->r, c->special_phase | (mode == 3) << 8);
+    } else if (mode == 4) {
+        // 启动15秒后台记录，采样在控制循环中以10Hz推入日志线程
+        if (!c->logging) {
+            int flags = len >= 4 ? buf[2] : 0;
+            c->start_time = now;
+            c->stream_decim = 0;  // 日志与遥测共用串口，记录期间停止遥测
+            out->push(out->ctx, LOG_START, 0, flags);
+            c->logging = true;
+            if (c->verbose) printf("Logging to %s for %d ms\n", LOG_FILE, c->duration);
+        }
+    } else if (mode == 5 && len >= 5) {
+        // 订阅/取消连续遥测，应答与波特率切换由日志线程按顺序完成
+        int code = buf[2];
+        int flags = len >= 6 ? buf[4] : 0;
+        if (code >= (int)(sizeof(g_stream_bauds) / sizeof(g_stream_bauds[0]))) code = 0;
+        if (code) c->uart_baud = g_stream_bauds[code];
+        c->stream_decim = stream_negotiate_decim(buf[3], c->uart_baud);
+        c->stream_tick = 0;
+        out->push(out->ctx, LOG_STREAM_CFG, code | flags << 8, c->stream_decim);
+        if (c->verbose) printf("Telemetry stream: baud %d, decimation %d\n", c->uart_baud, c->stream_decim);
+    } else if (mode == 6) {
+        // 计时快照由日志线程组帧发送
+        out->push(out->ctx, LOG_TIMING, 0, len >= 4 ? buf[2] : 0);
+    } else if (mode == 7 && len >= 6) {
+        // 频谱报警规则：频带号（SPEC_RULE_OFF 关闭）和RMS阈值，阈值和阻值阈值一起持久化
+        params_t req = *param_get(c->params);
+        req.spec_band = buf[2];
+        req.spec_thresh = buf[3] << 8 | buf[4];
+        if (param_publish(c->params, &req, now) != 0 && c->verbose) printf("Rejected spectrum rule\n");
+    }
+}
+
+// 一个控制周期：换算阻值、推送日志采样、报警状态机和遥测，所有输出都经 out 发出
+void ctl_step(ctl_t *c, const ctl_out_t *out, int code, long long now) {
+    const params_t *p = param_get(c->params);  // 本周期内只用这一份参数
+
+    c->tick++;
+    c->r = g_calib.ohms[code];
+
+    // Mode 4 logging: hand the sample to the logger thread, never block here
+    if (c->tick % 10 == 0 && c->logging) {
+        if (now - c->start_time < c->duration) {
+            out->push(out->ctx, LOG_SAMPLE, c->r, 0);
+        } else {
+            out->push(out->ctx, LOG_END, 0, 0);
+            c->logging = false;
+        }
+    }
+
+    // 频带RMS超过阈值（振动、工频干扰）是第三种报警状态，阻值正常且频谱回落后才解除
+    int alarm = p->alarm[code];
+    bool vib = p->spec_band < SPEC_BANDS && c->spec_level[p->spec_band] > p->spec_thresh;
+    if (c->special_phase == 0) {
+        if (alarm == ALARM_HIGH) {
+            c->special_phase = 1;
+        } else if (alarm == ALARM_LOW) {
+            c->special_phase = 2;
+        } else if (vib) {
+            c->special_phase = 3;
+        }
+        if (c->special_phase != 0) {
+            out->pwm(out->ctx, PWM_BUZZER, PWM_ON, 0);
+            out->pwm(out->ctx, 0, PWM_BLINK, p->flash_freq);
+            out->pwm(out->ctx, 1, PWM_BLINK, p->flash_freq);
+        }
+    } else if (alarm == ALARM_NONE && !vib) {
+        c->special_phase = 0;
+        for (int i = 0; i < PWM_CHANNELS; i++) {
+            out->pwm(out->ctx, i, PWM_OFF, 0);
+        }
+    }
+
+    if (c->stream_decim > 0 && ++c->stream_tick >= c->stream_decim) {
+        c->stream_tick = 0;
+        out->push(out->ctx, LOG_STREAM, c->r, c->special_phase);
+    }
+    if (c->stream_decim > 0 && c->tick % SPEC_REPORT_TICKS == 0) {
+        out->push(out->ctx, LOG_SPECTRUM, 0, 0);
+    }
+}
+
+void ctl_pwm_real(void *ctx, int ch, int pattern, float freq) {
+    (void)ctx;
+    pwm_set(&g_pwm, ch, pattern, freq, 0.5, 0, 0, 0);
+}
+
+void ctl_push_real(void *ctx, int kind, int r, int aux) {
+    (void)ctx;
+    logger_push(&g_logger, kind, r, aux);
+}
+
+int trace_open_write(trace_t *tr, const char *path) {
+    unsigned char hdr[TRACE_HEADER_SIZE] = {'A', 'T', 'R', 'C', TRACE_VERSION, 0, 0, 0};
+
+    memset(tr, 0, sizeof(*tr));
+    if (!(tr->fp = fopen(path, "wb"))) return -1;
+    fwrite(hdr, 1, sizeof(hdr), tr->fp);
+    return 0;
+}
+
+// 记录一个事件。ADC 码值每个控制周期写一条，value 为码值（码值不变也要写，回放按它推进周期）；
+// 命令帧连同原始字节写入，value 为帧长；频带RMS由调用者判断变化，value 为编码后的值
+void trace_write(trace_t *tr, long long t_ms, int type, const unsigned char *data, int value) {
+    unsigned char rec[TRACE_RECORD_SIZE];
+
+    if (!tr->started) {
+        tr->last_ms = t_ms;
+        tr->started = true;
+    }
+    unsigned int dt = t_ms - tr->last_ms > 0xFFFF ? 0xFFFF : (unsigned int)(t_ms - tr->last_ms);
+    unsigned int word = (value & 0x0FFF) | (type << 12);
+    rec[0] = dt & 0xFF;
+    rec[1] = dt >> 8;
+    rec[2] = word & 0xFF;
+    rec[3] = word >> 8;
+    fwrite(rec, 1, sizeof(rec), tr->fp);
+    if (type == TRACE_CMD) fwrite(data, 1, value, tr->fp);
+    tr->last_ms += dt;
+    if (++tr->count % 64 == 0) fflush(tr->fp);  // 断电时最多丢失最近的几十条记录
+}
+
+// 回放时的输出：把事件格式化成一行文本，和期望文件逐行比较（没有期望文件时打印出来）
+static void replay_emit(replay_t *rp, const char *line) {
+    char want[128];
+
+    rp->events++;
+    if (!rp->expect) {
+        printf("%s\n", line);
+        return;
+    }
+    if (rp->mismatch) return;
+    if (!fgets(want, sizeof(want), rp->expect)) {
+        printf("event %u: unexpected '%s' (expected file ended)\n", rp->events, line);
+        rp->mismatch = true;
+        return;
+    }
+    want[strcspn(want, "\r\n")] = 0;
+    if (strcmp(want, line) != 0) {
+        printf("event %u: got '%s', expected '%s'\n", rp->events, line, want);
+        rp->mismatch = true;
+    }
+}
+
+void ctl_pwm_replay(void *ctx, int ch, int pattern, float freq) {
+    replay_t *rp = (replay_t *)ctx;
+    char line[128];
+    static const char *names[] = {"off", "on", "blink", "chirp", "burst"};
+
+    // 同一通道重复设置相同的模式不会改变输出，不算事件
+    if (rp->pattern[ch] == pattern && rp->freq[ch] == freq) return;
+    rp->pattern[ch] = pattern;
+    rp->freq[ch] = freq;
+    snprintf(line, sizeof(line), "%lld %s %s %.1f", rp->now, ch == PWM_BUZZER ? "buzzer" : ch == 0 ? "led0" : "led1",
+             names[pattern], freq);
+    replay_emit(rp, line);
+}
+
+void ctl_push_replay(void *ctx, int kind, int r, int aux) {
+    replay_t *rp = (replay_t *)ctx;
+    char line[128];
+    static const char *names[] = {"sample", "start", "end", "stream", "stream_cfg", "reply", "timing", "spectrum"};
+
+    snprintf(line, sizeof(line), "%lld uart %s %d %d", rp->now, names[kind], r, aux);
+    replay_emit(rp, line);
+}
+
+// 回放轨迹：按记录顺序在轨迹时间上推进控制逻辑，不睡眠。每条 TRACE_ADC 是实时运行中的一个周期，
+// 用记录的时间运行一次 ctl_step。有期望文件时逐条比较事件，全部一致返回0
+int trace_replay(const char *path, const char *expect_path) {
+    unsigned char hdr[TRACE_HEADER_SIZE], rec[TRACE_RECORD_SIZE], cmd[256];
+    replay_t rp;
+    ctl_t ctl;
+    param_store_t ps;
+    ctl_out_t out = {ctl_pwm_replay, ctl_push_replay, &rp};
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp) {
+        printf("open trace %s error\n", path);
+        return 1;
+    }
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || memcmp(hdr, "ATRC", 4) != 0 || hdr[4] != TRACE_VERSION) {
+        printf("%s: not a trace file\n", path);
+        fclose(fp);
+        return 1;
+    }
+    memset(&rp, 0, sizeof(rp));  // 所有通道初始为 PWM_OFF
+    if (expect_path && !(rp.expect = fopen(expect_path, "r"))) {
+        printf("open %s error\n", expect_path);
+        fclose(fp);
+        return 1;
+    }
+    param_init(&ps, NULL);
+    ctl_init(&ctl, &ps);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long long steps = 0;
+    while (!rp.mismatch && fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+        unsigned int word = rec[2] | rec[3] << 8;
+        int value = word & 0x0FFF;
+        rp.now += rec[0] | rec[1] << 8;
+        if (word >> 12 == TRACE_CMD) {
+            if (fread(cmd, 1, value, fp) != (size_t)value) break;
+            ctl_command(&ctl, &out, cmd, value, rp.now);
+        } else if (word >> 12 == TRACE_SPEC) {
+            ctl.spec_level[value >> 10] = value & 0x3FF;
+        } else {
+            ctl_step(&ctl, &out, value, rp.now);
+            steps++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fclose(fp);
+
+    double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "Replayed %lld steps (%.1f s of trace) in %.3f s, %u events\n", steps, rp.now / 1000.0, sec,
+            rp.events);
+    if (rp.expect) {
+        char extra[128];
+        if (!rp.mismatch && fgets(extra, sizeof(extra), rp.expect)) {
+            extra[strcspn(extra, "\r\n")] = 0;
+            printf("missing event %u: expected '%s'\n", rp.events + 1, extra);
+            rp.mismatch = true;
+        }
+        fclose(rp.expect);
+        printf(rp.mismatch ? "Replay FAILED\n" : "Replay OK\n");
+    }
+    return rp.mismatch ? 1 : 0;
+}
+
+// 创建并映射一个环形文件。空间预先分配，映射时预读入页，之后写记录不会再缺页
+static int fr_map_create(fr_map_t *m, const char *path) {
+    size_t size = sizeof(fr_header_t) + FR_RECORDS * sizeof(fr_record_t);
+
+    if ((m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+    if (posix_fallocate(m->fd, 0, size) != 0 && ftruncate(m->fd, size) != 0) {
+        close(m->fd);
+        return -1;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m->fd, 0);
+    if (p == MAP_FAILED) {
+        close(m->fd);
+        return -1;
+    }
+    m->hdr = (fr_header_t *)p;
+    m->rec = (fr_record_t *)(m->hdr + 1);
+    memset(m->hdr, 0, sizeof(fr_header_t));
+    memcpy(m->hdr->magic, "FREC", 4);
+    m->hdr->version = FR_VERSION;
+    m->hdr->record_size = sizeof(fr_record_t);
+    m->hdr->capacity = FR_RECORDS;
+    return 0;
+}
+
+static void fr_map_release(fr_map_t *m) {
+    size_t size = sizeof(fr_header_t) + FR_RECORDS * sizeof(fr_record_t);
+    msync(m->hdr, size, MS_SYNC);
+    munmap(m->hdr, size);
+    close(m->fd);
+    m->hdr = NULL;
+}
+
+// 开始往一个环里记录：写入起始时间
+static void fr_map_begin(fr_map_t *m) {
+    long long wall = get_timestamp();
+    m->t0 = get_mono_ms();
+    m->hdr->wall_sec = (uint32_t)(wall / 1000);
+    m->hdr->wall_ms = (uint16_t)(wall % 1000);
+}
+
+int flight_start(flight_t *fr) {
+    pthread_t tid;
+
+    memset(fr, 0, sizeof(*fr));
+    if (access(FR_FILE, F_OK) == 0 && rename(FR_FILE, FR_PREV_FILE) == 0) {
+        printf("Previous flight recorder ring kept as %s\n", FR_PREV_FILE);
+    }
+    if (fr_map_create(&fr->active, FR_FILE) != 0 || fr_map_create(&fr->spare, FR_SPARE_FILE) != 0) {
+        perror("flight recorder");
+        return -1;
+    }
+    fr_map_begin(&fr->active);
+    fr->spare_ready = 1;
+    pthread_mutex_init(&fr->lock, NULL);
+    pthread_cond_init(&fr->cond, NULL);
+    if (pthread_create(&tid, NULL, flight_thread, fr) != 0) {
+        perror("flight pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// 由控制循环调用：追加一条记录，只有内存写入
+void flight_record(flight_t *fr, int type, int value, int aux) {
+    fr_header_t *h = fr->active.hdr;
+    fr_record_t *r = &fr->active.rec[h->head % FR_RECORDS];
+
+    r->t_ms = (uint32_t)(get_mono_ms() - fr->active.t0);
+    r->value = value;
+    r->code = (aux & 0x3FFF) | type << 14;
+    h->head++;
+}
+
+// 由控制循环在报警触发时调用：冻结当前环并切换到备用环，不做任何文件操作
+void flight_freeze(flight_t *fr) {
+    if (!__atomic_load_n(&fr->spare_ready, __ATOMIC_ACQUIRE)) {
+        fr->missed++;  // 上一次冻结还没处理完，继续写当前环
+        printf("Flight recorder busy, alarm not frozen (%u)\n", fr->missed);
+        return;
+    }
+    fr->active.hdr->trigger = fr->active.hdr->head - 1;
+    fr->active.hdr->frozen = 1;
+    pthread_mutex_lock(&fr->lock);
+    fr->frozen = fr->active;
+    fr->active = fr->spare;
+    fr->pending = true;
+    __atomic_store_n(&fr->spare_ready, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&fr->cond);
+    pthread_mutex_unlock(&fr->lock);
+    fr_map_begin(&fr->active);
+}
+
+// 选择要覆盖的转储文件：优先用空位，否则用修改时间最早的
+static int fr_pick_slot(char *path, size_t len) {
+    int best = 0;
+    time_t oldest = 0;
+
+    for (int i = 0; i < FR_MAX_DUMPS; i++) {
+        struct stat st;
+        snprintf(path, len, FR_DUMP_FMT, i);
+        if (stat(path, &st) != 0) return i;
+        if (i == 0 || st.st_mtime < oldest) {
+            oldest = st.st_mtime;
+            best = i;
+        }
+    }
+    snprintf(path, len, FR_DUMP_FMT, best);
+    return best;
+}
+
+// 后台线程：冻结的环改名为转储文件并落盘，然后把备用文件改名为当前环，再准备新的备用文件
+void *flight_thread(void *arg) {
+    flight_t *fr = (flight_t *)arg;
+    char path[64];
+
+    while (1) {
+        pthread_mutex_lock(&fr->lock);
+        while (!fr->pending) {
+            pthread_cond_wait(&fr->cond, &fr->lock);
+        }
+        fr_map_t frozen = fr->frozen;
+        pthread_mutex_unlock(&fr->lock);
+
+        fr_pick_slot(path, sizeof(path));
+        if (rename(FR_FILE, path) != 0 || rename(FR_SPARE_FILE, FR_FILE) != 0) perror("flight rename");
+        fr_map_release(&frozen);
+        printf("Flight recorder frozen to %s\n", path);
+
+        pthread_mutex_lock(&fr->lock);
+        fr->pending = false;
+        pthread_mutex_unlock(&fr->lock);
+        if (fr_map_create(&fr->spare, FR_SPARE_FILE) != 0) {
+            perror("flight recorder spare");
+            continue;  // 以后的报警不再冻结，当前环照常记录
+        }
+        __atomic_store_n(&fr->spare_ready, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// 在满足请求的前提下保证遥测只占用线路带宽的80%（每字节10位）
+int stream_negotiate_decim(int decim, int baud) {
+    if (decim <= 0) return 0;
+    long need = (long)STREAM_CONTROL_HZ * STREAM_FRAME_MAX * 10 * 5;
+    long cap = (long)STREAM_BATCH * baud * 4;
+    int min_decim = (int)((need + cap - 1) / cap);
+    if (decim < min_decim) decim = min_decim;
+    if (decim > STREAM_CONTROL_HZ) decim = STREAM_CONTROL_HZ;
+    return decim;
+}
+
+// 命令帧是否已收全。参数是二进制的（如抽取比125、频谱阈值的低字节），可能正好是 0x7D，
+// 所以已知模式按帧长判断，只有未知模式才看最后一个字节
+bool cmd_frame_done(const unsigned char *buf, int len) {
+    if (len < 2) return false;
+    if (buf[1] < CMD_MODES && g_cmd_len[buf[1]]) return len >= g_cmd_len[buf[1]];
+    return buf[len - 1] == 0x7D;
+}
+
+// 读取ADC原始码值（0~4095），失败返回-1。驱动返回十进制文本，直接逐位解析
+int read_adc_raw(int fd_adc, char *buffer) {
+    int len = read(fd_adc, buffer, 12);
+    int i = 0, raw = 0;
+    if (len <= 0) return -1;
+    while (i < len && buffer[i] == ' ') i++;
+    if (i == len || buffer[i] < '0' || buffer[i] > '9') return -1;
+    for (; i < len && buffer[i] >= '0' && buffer[i] <= '9'; i++) {
+        raw = raw * 10 + (buffer[i] - '0');
+    }
+    return raw < ADC_CODES ? raw : ADC_CODES - 1;
+}
+
+// 加载标定表：先复制编译期生成的默认表，标定文件存在时用分段线性曲线覆盖。
+// 返回读到的标定点数，文件不存在时返回0
+int calib_load(calib_t *cal, const char *path) {
+    int pc[CAL_MAX_POINTS], po[CAL_MAX_POINTS];
+    int n = 0;
+    char line[128];
+
+    memcpy(cal->ohms, g_default_ohms, sizeof(cal->ohms));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    while (n < CAL_MAX_POINTS && fgets(line, sizeof(line), fp)) {
+        int code, ohms;
+        if (line[0] == '#' || sscanf(line, "%d %d", &code, &ohms) != 2) continue;
+        if (code < 0 || code >= ADC_CODES || ohms < 0 || ohms > 0x3FFF || (n > 0 && code <= pc[n - 1])) {
+            printf("%s: ignoring bad point '%d %d'\n", path, code, ohms);
+            continue;
+        }
+        pc[n] = code;
+        po[n] = ohms;
+        n++;
+    }
+    fclose(fp);
+    if (n < 2) {
+        printf("%s: need at least 2 points, using default calibration\n", path);
+        return 0;
+    }
+
+    // 两端以外保持端点阻值，中间逐段线性插值
+    int seg = 0;
+    for (int c = 0; c < ADC_CODES; c++) {
+        while (seg < n - 2 && c > pc[seg + 1]) seg++;
+        if (c <= pc[0]) {
+            cal->ohms[c] = po[0];
+        } else if (c >= pc[n - 1]) {
+            cal->ohms[c] = po[n - 1];
+        } else {
+            cal->ohms[c] = po[seg] + (po[seg + 1] - po[seg]) * (c - pc[seg]) / (pc[seg + 1] - pc[seg]);
+        }
+    }
+    return n;
+}
+
+// 按阈值生成报警分类表
+void calib_build_alarm(const calib_t *cal, uint8_t *alarm, int thresh_low, int thresh_high) {
+    for (int c = 0; c < ADC_CODES; c++) {
+        int r = cal->ohms[c];
+        if (r > thresh_high) {
+            alarm[c] = ALARM_HIGH;
+        } else if (r < thresh_low) {
+            alarm[c] = ALARM_LOW;
+        } else if (r > thresh_low && r < thresh_high) {
+            alarm[c] = ALARM_NONE;
+        } else {
+            alarm[c] = ALARM_EDGE;
+        }
+    }
+}
+
+// 初始化参数：默认值，path 不为 NULL 时用持久化文件里的参数覆盖（校验不通过则保留默认值）
+int param_init(param_store_t *ps, const char *path) {
+    static params_t req;  // 只用到标量字段，不必在栈上放一张报警表
+    unsigned int version = 1;
+
+    memset(ps, 0, sizeof(*ps));
+    req.thresh_low = 5000;
+    req.thresh_high = 9000;
+    req.flash_freq = 5.0;
+    req.spec_band = SPEC_RULE_OFF;
+    req.spec_thresh = SPEC_LEVEL_MAX;
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    if (fp) {
+        params_t f = req;
+        unsigned int v;
+        // 旧文件没有频谱报警字段，保持关闭
+        int n = fscanf(fp, "%u %d %d %f %d %d", &v, &f.thresh_low, &f.thresh_high, &f.flash_freq, &f.spec_band,
+                       &f.spec_thresh);
+        if (n >= 4 && param_validate(&f) == 0) {
+            version = v;
+            req = f;
+            printf("Loaded parameters v%u from %s: %d-%d ohm, %.1f Hz\n", version, path, req.thresh_low,
+                   req.thresh_high, req.flash_freq);
+        } else {
+            printf("%s: invalid parameters, using defaults\n", path);
+        }
+        fclose(fp);
+    }
+    // 先发布再设置路径，初始化时不写回文件；此时还没有读者，可以直接改版本号
+    if (param_publish(ps, &req, 0) != 0) return -1;
+    ps->cur->version = version;
+    ps->path = path;
+    return 0;
+}
+
+// 低阈值必须小于高阈值，闪烁频率在 (0, PARAM_FREQ_MAX] 内，频谱报警的频带和阈值在范围内
+int param_validate(const params_t *req) {
+    if (req->thresh_low < 0 || req->thresh_high > 0xFFFF || req->thresh_low >= req->thresh_high) return -1;
+    if (!(req->flash_freq > 0 && req->flash_freq <= PARAM_FREQ_MAX)) return -1;
+    if (req->spec_band != SPEC_RULE_OFF && (req->spec_band < 0 || req->spec_band >= SPEC_BANDS)) return -1;
+    if (req->spec_thresh < 0 || req->spec_thresh > SPEC_LEVEL_MAX) return -1;
+    return 0;
+}
+
+// 读者：每个控制周期调用一次，返回的块在本周期内保持有效
+const params_t *param_get(param_store_t *ps) {
+    return __atomic_load_n(&ps->cur, __ATOMIC_ACQUIRE);
+}
+
+// 写者（只有控制循环）：按 req 的标量字段校验、构建新块并发布，旧块挂到待回收列表，然后持久化。
+// 失败返回 -1，当前参数不变
+int param_publish(param_store_t *ps, const params_t *req, long long now) {
+    if (param_validate(req) != 0) {
+        ps->rejected++;
+        return -1;
+    }
+    // 宽限期已过的旧块可以释放了
+    int kept = 0;
+    for (int i = 0; i < ps->n_retired; i++) {
+        if (now - ps->retired_ms[i] >= PARAM_GRACE_MS) {
+            free(ps->retired[i]);
+        } else {
+            ps->retired[kept] = ps->retired[i];
+            ps->retired_ms[kept++] = ps->retired_ms[i];
+        }
+    }
+    ps->n_retired = kept;
+    if (ps->n_retired == PARAM_RETIRED) {
+        ps->rejected++;  // 更新过于频繁
+        return -1;
+    }
+
+    params_t *old = ps->cur;
+    params_t *p = malloc(sizeof(params_t));
+    if (!p) return -1;
+    p->version = old ? old->version + 1 : 1;
+    p->thresh_low = req->thresh_low;
+    p->thresh_high = req->thresh_high;
+    p->flash_freq = req->flash_freq;
+    p->spec_band = req->spec_band;
+    p->spec_thresh = req->spec_thresh;
+    calib_build_alarm(&g_calib, p->alarm, p->thresh_low, p->thresh_high);
+    __atomic_store_n(&ps->cur, p, __ATOMIC_RELEASE);
+    if (old) {
+        ps->retired[ps->n_retired] = old;
+        ps->retired_ms[ps->n_retired++] = now;
+    }
+    if (ps->path && param_save(p, ps->path) != 0) printf("save %s error\n", ps->path);
+    return 0;
+}
+
+// 写临时文件并 fsync 后改名，掉电时要么是旧参数要么是新参数
+int param_save(const params_t *p, const char *path) {
+    char tmp[128];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+    fprintf(fp, "%u %d %d %g %d %d\n", p->version, p->thresh_low, p->thresh_high, p->flash_freq, p->spec_band,
+            p->spec_thresh);
+    fflush(fp);
+    int ok = fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok) return -1;
+    return rename(tmp, path);
+}
+
+// 求和内核：一阶CIC（块平均抽取）在每个输出周期调用一次
+static int32_t sum_s32(const int32_t *x, int n) {
+    int32_t total = 0;
+    int i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 4 <= n; i += 4) {
+        acc = vaddq_s32(acc, vld1q_s32(x + i));
+    }
+    int32x2_t half = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    total = vget_lane_s32(vpadd_s32(half, half), 0);
+#endif
+    for (; i < n; i++) {
+        total += x[i];
+    }
+    return total;
+}
+
+// 中值：对窗口副本做插入排序，窗口很小（<=16）时比维护有序结构更快
+static int32_t median_s32(const int32_t *x, int n) {
+    int32_t v[ACQ_MAX_TAPS];
+    for (int i = 0; i < n; i++) {
+        int32_t t = x[i];
+        int j = i;
+        while (j > 0 && v[j - 1] > t) {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = t;
+    }
+    return v[n / 2];
+}
+
+// 运行单级滤波，产生输出时返回1（CIC 每 r 个输入才输出一次）
+static int filter_stage_run(filter_stage_t *st, int32_t x, int32_t *y) {
+    switch (st->type) {
+        case FILT_MA:
+            st->sum += x - st->hist[st->pos];
+            st->hist[st->pos] = x;
+            st->pos = (st->pos + 1) % st->n;
+            if (st->fill < st->n) st->fill++;
+            *y = st->fill < st->n ? st->sum / st->fill : (int32_t)(((int64_t)st->sum * st->recip) >> 16);
+            return 1;
+        case FILT_MEDIAN:
+            st->hist[st->pos] = x;
+            st->pos = (st->pos + 1) % st->n;
+            if (st->fill < st->n) st->fill++;
+            *y = median_s32(st->hist, st->fill);
+            return 1;
+        case FILT_IIR:
+            // y += (x - y) / 2^n，状态多保留8位小数避免小步长时截断停滞
+            if (st->fill == 0) {
+                st->acc = x << 8;
+                st->fill = 1;
+            }
+            st->acc += ((x << 8) - st->acc) >> st->n;
+            *y = st->acc >> 8;
+            return 1;
+        case FILT_CIC:
+            if (st->n == 1) {
+                // 一阶CIC即块平均：攒满 r 个输入后一次求和
+                st->hist[st->pos++] = x;
+                if (st->pos < st->r) return 0;
+                st->pos = 0;
+                *y = sum_s32(st->hist, st->r) / st->r;
+                return 1;
+            }
+            st->integ[0] += (uint32_t)x;
+            for (int i = 1; i < st->n; i++) {
+                st->integ[i] += st->integ[i - 1];
+            }
+            if (++st->pos < st->r) return 0;
+            st->pos = 0;
+            uint32_t v = st->integ[st->n - 1];
+            for (int i = 0; i < st->n; i++) {
+                uint32_t prev = st->comb[i];
+                st->comb[i] = v;
+                v -= prev;
+            }
+            // 前 n 个输出梳状器尚未填满，结果无意义
+            if (st->fill < st->n) {
+                st->fill++;
+                return 0;
+            }
+            *y = (int32_t)((int64_t)(int32_t)v / st->gain);
+            return 1;
+    }
+    return 0;
+}
+
+int filter_chain_run(filter_chain_t *fc, int32_t x, int32_t *y) {
+    for (int i = 0; i < fc->nstages; i++) {
+        if (!filter_stage_run(&fc->stage[i], x, &x)) return 0;
+    }
+    *y = x;
+    return 1;
+}
+
+// 解析滤波链描述，例如 "median:5,cic:3:10,iir:2"
+int filter_chain_parse(filter_chain_t *fc, const char *spec) {
+    char buf[128];
+    char *save = NULL;
+
+    memset(fc, 0, sizeof(*fc));
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (fc->nstages >= ACQ_MAX_STAGES) return -1;
+        filter_stage_t *st = &fc->stage[fc->nstages++];
+        int a = 0, b = 0;
+        if (sscanf(tok, "ma:%d", &a) == 1 && a >= 1 && a <= ACQ_MAX_TAPS) {
+            st->type = FILT_MA;
+            st->n = a;
+            st->recip = 65536 / a;
+        } else if (sscanf(tok, "median:%d", &a) == 1 && a >= 1 && a <= ACQ_MAX_TAPS) {
+            st->type = FILT_MEDIAN;
+            st->n = a;
+        } else if (sscanf(tok, "iir:%d", &a) == 1 && a >= 0 && a <= 15) {
+            st->type = FILT_IIR;
+            st->n = a;
+        } else if (sscanf(tok, "cic:%d:%d", &a, &b) == 2 && a >= 1 && a <= ACQ_CIC_MAX_ORDER && b >= 1 &&
+                   (a > 1 || b <= ACQ_MAX_TAPS)) {
+            st->type = FILT_CIC;
+            st->n = a;
+            st->r = b;
+            st->gain = 1;
+            for (int i = 0; i < a; i++) {
+                st->gain *= b;
+            }
+            // 码值 Q4 最大 2^16，增益后必须仍能放进32位
+            if (st->gain > (1 << 15)) return -1;
+        } else {
+            printf("bad filter stage '%s'\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int acq_start(acq_t *aq, int fd_adc, const char *spec) {
+    pthread_t tid;
+
+    memset(aq, 0, sizeof(*aq));
+    aq->fd_adc = fd_adc;
+    aq->rate_hz = ACQ_RATE_HZ;
+    if (filter_chain_parse(&aq->chain, spec) != 0) return -1;
+    spec_init(&aq->spec, aq->rate_hz);
+    if (pthread_create(&tid, NULL, acq_thread, aq) != 0) {
+        perror("acq pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// 采集线程：按绝对时间节拍读ADC，避免累积漂移
+void *acq_thread(void *arg) {
+    acq_t *aq = (acq_t *)arg;
+    long period_ns = 1000000000L / aq->rate_hz;
+    char buffer[16];
+    struct timespec next, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += period_ns;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) {
+            aq->overruns++;
+            next = now;  // 落后时不追赶，重新对齐节拍
+        } else {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+
+        int raw = read_adc_raw(aq->fd_adc, buffer);
+        if (raw < 0) continue;
+        spec_feed(&aq->spec, raw);  // 频谱用滤波前的码值，看得到被滤掉的振动和工频干扰
+        int32_t y;
+        if (filter_chain_run(&aq->chain, raw << ACQ_FRAC_BITS, &y)) {
+            int code = (y + (1 << (ACQ_FRAC_BITS - 1))) >> ACQ_FRAC_BITS;  // 四舍五入回码值，阻值由控制循环查表
+            if (code < 0) code = 0;
+            if (code >= ADC_CODES) code = ADC_CODES - 1;
+            __atomic_store_n(&aq->code, code, __ATOMIC_RELAXED);
+            aq->outputs++;
+        }
+    }
+    return NULL;
+}
+
+// 生成窗函数、旋转因子表和频带边界
+void spec_init(spec_t *sp, int rate_hz) {
+    memset(sp, 0, sizeof(*sp));
+    sp->rate_hz = rate_hz;
+    for (int i = 0; i < SPEC_N; i++) {
+        sp->window[i] = (int16_t)lround(32767 * (0.5 - 0.5 * cos(2 * M_PI * i / SPEC_N)));
+    }
+    for (int k = 0; k < SPEC_N / 2; k++) {
+        sp->cos_q15[k] = (int16_t)lround(32767 * cos(2 * M_PI * k / SPEC_N));
+        sp->sin_q15[k] = (int16_t)lround(32767 * sin(2 * M_PI * k / SPEC_N));
+    }
+    // 频点0是直流，SPEC_N/2 是奈奎斯特频率，都不计入频带
+    for (int b = 0; b <= SPEC_BANDS; b++) {
+        int bin = (int)lround((double)g_spec_band_hz[b] * SPEC_N / rate_hz);
+        sp->band_bin[b] = bin < 1 ? 1 : bin > SPEC_N / 2 ? SPEC_N / 2 : bin;
+    }
+}
+
+// 由采集线程对每个原始码值调用，攒够一跳就算一帧
+void spec_feed(spec_t *sp, int code) {
+    sp->ring[sp->pos] = code;
+    sp->pos = (sp->pos + 1) % SPEC_N;
+    if (sp->fill < SPEC_N) sp->fill++;
+    if (++sp->hop >= SPEC_HOP) {
+        sp->hop = 0;
+        if (sp->fill == SPEC_N) spec_run(sp);
+    }
+}
+
+// 去均值并乘 Q15 窗：(码值 - 均值) * w 不超过 2^27，右移后留出 FFT 的增长空间
+static void spec_window(int32_t *x, const int16_t *w, int32_t mean, int n) {
+    int i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t m = vdupq_n_s32(mean);
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t v = vmulq_s32(vsubq_s32(vld1q_s32(x + i), m), vmovl_s16(vld1_s16(w + i)));
+        vst1q_s32(x + i, vshrq_n_s32(v, SPEC_WIN_SHIFT));
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] = (x[i] - mean) * w[i] >> SPEC_WIN_SHIFT;
+    }
+}
+
+// N/2 点复数FFT（基2，按时间抽取，原位），偶数样本作实部、奇数样本作虚部按位反序装入。
+// 不逐级缩放：输入的绝对值之和不超过 2^29，中间结果不会溢出；旋转因子乘法用64位
+static void spec_fft(spec_t *sp) {
+    const int m = SPEC_N / 2;
+    int32_t *re = sp->re, *im = sp->im;
+
+    for (int i = 0, j = 0; i < m; i++) {
+        re[j] = sp->x[2 * i];
+        im[j] = sp->x[2 * i + 1];
+        int bit = m >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j |= bit;
+    }
+    for (int len = 2; len <= m; len <<= 1) {
+        int half = len >> 1, step = SPEC_N / len;  // W_len^j = W_N^(j*step)
+        for (int j = 0; j < half; j++) {
+            int64_t c = sp->cos_q15[j * step], s = sp->sin_q15[j * step];
+            for (int a = j; a < m; a += len) {
+                int b = a + half;
+                int32_t tr = (int32_t)((c * re[b] + s * im[b]) >> 15);
+                int32_t ti = (int32_t)((c * im[b] - s * re[b]) >> 15);
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
 
-int main() {
-    int fd_adc, fd_led, fd_bz, fd_uart;
-    char *adc = "/dev/adc";
-    char *leds = "/dev/leds";
-    char *buzzer = "/dev/buzzer_ctl";
-    char *uart1 = "/dev/ttySAC3";
-    if ((fd_adc = open(adc, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
-        printf("open ADC error\n");
-        return 1;
+// 算一帧频谱并发布。RMS 按 Parseval 定理由频点功率求和得到，并补偿 Hann 窗的能量损失（均方值 3/8）：
+// rms^2 = 2 * sum|X|^2 / (N^2 * 3/8)，X 的定点值是码值的 2^10 倍
+void spec_run(spec_t *sp) {
+    const int m = SPEC_N / 2;
+    double pw[SPEC_N / 2];
+    const double scale = 16.0 / (3.0 * SPEC_N * SPEC_N) / (1 << 20);
+
+    memcpy(sp->x, sp->ring + sp->pos, (SPEC_N - sp->pos) * sizeof(int32_t));
+    memcpy(sp->x + SPEC_N - sp->pos, sp->ring, sp->pos * sizeof(int32_t));
+    spec_window(sp->x, sp->window, sum_s32(sp->x, SPEC_N) / SPEC_N, SPEC_N);
+    spec_fft(sp);
+
+    // 由 Z = FFT(偶 + j*奇) 拆出实序列的频谱：X[k] = (Z[k] + conj(Z[m-k])) / 2 + W_N^k * (Z[k] - conj(Z[m-k])) / 2j
+    pw[0] = 0;
+    for (int k = 1; k < m; k++) {
+        int64_t ar = sp->re[k], ai = sp->im[k], cr = sp->re[m - k], ci = sp->im[m - k];
+        int64_t er = ar + cr, ei = ai - ci;       // 2 * 偶部
+        int64_t orr = ai + ci, oi = cr - ar;      // 2 * 奇部
+        int64_t c = sp->cos_q15[k], s = sp->sin_q15[k];
+        double xr = (double)((er << 15) + c * orr + s * oi) / (1 << 16);
+        double xi = (double)((ei << 15) + c * oi - s * orr) / (1 << 16);
+        pw[k] = xr * xr + xi * xi;
     }
-    if ((fd_led = open(leds, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
-        printf("open LED error\n");
-        return 1;
+
+    // 主频：跳过紧挨直流的频点，峰值附近用对数幅度的抛物线插值，精度远高于频点间隔
+    int peak = 2;
+    for (int k = 3; k < m - 1; k++) {
+        if (pw[k] > pw[peak]) peak = k;
     }
-    if ((fd_bz = open(buzzer, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
-        printf("open buzzer error\n");
-        return 1;
+    double la = log(pw[peak - 1] + 1), lb = log(pw[peak] + 1), lc = log(pw[peak + 1] + 1);
+    double den = la - 2 * lb + lc;
+    double delta = den < 0 ? 0.5 * (la - lc) / den : 0;
+    uint16_t res[SPEC_VALUES];
+    double level[SPEC_BANDS + 1];
+    res[SPEC_FDOM] = (uint16_t)lround((peak + delta) * sp->rate_hz / SPEC_N * 10);
+    level[0] = pw[peak - 1] + pw[peak] + pw[peak + 1];  // Hann 窗的主瓣占三个频点
+    for (int b = 0; b < SPEC_BANDS; b++) {
+        level[b + 1] = 0;
+        for (int k = sp->band_bin[b]; k < sp->band_bin[b + 1]; k++) {
+            level[b + 1] += pw[k];
+        }
     }
-    if ((fd_uart = open(uart1, O_RDWR | O_NOCTTY | O_NDELAY)) < 0) {
-        printf("open uart1 error\n");
-        return 1;
-    } else {
-        set_opt(fd_uart, 9600, 8, 'N', 1);
+    for (int i = 0; i <= SPEC_BANDS; i++) {
+        long v = lround(10 * sqrt(level[i] * scale));
+        res[SPEC_PEAK + i] = v > 0xFFFF ? 0xFFFF : (uint16_t)v;
     }
 
+    // seqlock 写端：只有采集线程写，序号为奇数期间读者重试
+    __atomic_store_n(&sp->seq, sp->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < SPEC_VALUES; i++) {
+        __atomic_store_n(&sp->res[i], res[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&sp->frames, sp->frames + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&sp->seq, sp->seq + 1, __ATOMIC_RELEASE);
+}
 
-    // Initialize clock for 100Hz loop
-    clock_t last_clock_time = 0;
+// 读最新一帧的结果，还没有算出过频谱时返回0
+int spec_read(spec_t *sp, uint16_t *v) {
+    unsigned int s1, frames;
 
-    //////////////////////////////////////////////////////////////////////////
-    // new
-    char uart_out[1000] = "";
-    char buffer[16];
-    char format_time_string[100];
-    int fd_file2;
-    long long start_time = get_timestamp();
-    long long current_time;
-    int duration = 15000; // 15秒，以毫秒为单位
-    //////////////////////////////////////////////////////////////////////////
-
-    int thresh_high = 9000;
-    int thresh_low = 5000;
-    float flash_freq = 5.0;
-    int led_period = 20;
+    do {
+        s1 = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < SPEC_VALUES; i++) {
+            v[i] = __atomic_load_n(&sp->res[i], __ATOMIC_RELAXED);
+        }
+        frames = __atomic_load_n(&sp->frames, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((s1 & 1) || s1 != __atomic_load_n(&sp->seq, __ATOMIC_RELAXED));
+    return frames > 0;
+}
 
-    int loop_times = 0;
-    int special_phase = 0;
-    bool led_on = false;
-    int r = 0;
+// 用合成信号（直流 + 37.5Hz 正弦 + 50Hz 工频 + 噪声）测量每帧耗时，并检查主频和频带RMS
+void spec_bench(void) {
+    static spec_t sp;
+    struct timespec t0, t1;
+    uint16_t v[SPEC_VALUES];
+
+    spec_init(&sp, ACQ_RATE_HZ);
+    srand(1);
+    for (int i = 0; i < SPEC_N; i++) {
+        double t = (double)i / ACQ_RATE_HZ;
+        sp.ring[i] = (int32_t)lround(2048 + 100 * sin(2 * M_PI * 37.5 * t) + 20 * sin(2 * M_PI * 50 * t)) + rand() % 5 - 2;
+    }
+    sp.fill = SPEC_N;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+    for (int i = 0; i < SPEC_BENCH_FRAMES; i++) {
+        spec_run(&sp);
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+    spec_read(&sp, v);
+    double us = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e3 / SPEC_BENCH_FRAMES;
+    printf("Spectrum: %d-point frame in %.1f us CPU, hop %d samples -> up to %.0f kHz sample rate\n", SPEC_N, us,
+           SPEC_HOP, SPEC_HOP / us * 1e3);
+    printf("  dominant %.1f Hz, peak rms %.1f (expect 37.5 Hz, 70.7)", v[SPEC_FDOM] / 10.0, v[SPEC_PEAK] / 10.0);
+    for (int b = 0; b < SPEC_BANDS; b++) {
+        printf(", %d-%d Hz %.1f", g_spec_band_hz[b], g_spec_band_hz[b + 1], v[SPEC_BAND + b] / 10.0);
+    }
+    printf("\n");
+}
 
-    ioctl(fd_led, 0, 0);
-    ioctl(fd_led, 0, 1);
-    led_on = false;
+static long long pwm_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    int mode = 0;
+static void pwm_output(pwm_t *pw, int ch, bool on) {
+    long long t = pwm_now_us();
+    if (ch == PWM_BUZZER) {
+        ioctl(pw->fd_bz, on ? 1 : 0);
+    } else {
+        ioctl(pw->fd_led, on ? 1 : 0, ch);
+    }
+    timing_add(&g_timing, TM_IOCTL, pwm_now_us() - t);
+}
 
-    char adc_tmp[16];
-    char uart_rx_tmp[100];
-    char uart_rx_buf[100];
-    int uart_rx_cnt = 0;
+// CHIRP 的周期在 span 内从 period 线性变化到 period2，然后重新开始
+static long pwm_period_us(pwm_channel_t *c, long long t) {
+    if (c->pattern != PWM_CHIRP) return c->period_us;
+    long long pos = (t - c->start_us) % c->span_us;
+    return c->period_us + (long)((c->period2_us - c->period_us) * pos / c->span_us);
+}
 
-    while (1) {
-        // Make sure loop runs at 100Hz
-        if (last_clock_time != 0 && (double)(clock() - last_clock_time) / CLOCKS_PER_SEC < 0.01) {
-            usleep(100);
-            continue;
+// 翻转一次电平并计算下一次翻转时刻
+static void pwm_advance(pwm_channel_t *c) {
+    long period = pwm_period_us(c, c->next_us);
+    long on_us = period * c->duty / 1000;
+    if (c->on) {
+        c->on = false;
+        c->next_us += period - on_us;
+        if (c->pattern == PWM_BURST && ++c->pulse >= c->count) {
+            c->pulse = 0;
+            c->next_us += c->span_us;
         }
-        last_clock_time = clock();
+    } else {
+        c->on = true;
+        c->next_us += on_us;
+    }
+}
 
-        loop_times++;
+int pwm_start(pwm_t *pw, int fd_led, int fd_bz) {
+    pthread_condattr_t attr;
+    pthread_t tid;
 
-        if (loop_times % 10 == 0) {
-            r = read_adc_value(fd_adc, adc_tmp);
-
-            int bytes_read = read(fd_uart, uart_rx_tmp, 100);
-            if (bytes_read > 0) {
-                memcpy(uart_rx_buf + uart_rx_cnt, uart_rx_tmp, bytes_read);
-                uart_rx_cnt += bytes_read;
-                if (uart_rx_buf[uart_rx_cnt - 1] == 0x7D) {
-                    // Print as hex
-                    printf("\n\nReceived message: ");
-                    for (int i = 0; i < uart_rx_cnt; i++) {
-                        printf("%02X ", uart_rx_buf[i]);
-                    }
-                    printf("\n");
-
-                    mode = uart_rx_buf[1];
-
-                    if (mode == 1) {
-                        thresh_low = uart_rx_buf[2] << 8 | uart_rx_buf[3];
-                        thresh_high = uart_rx_buf[4] << 8 | uart_rx_buf[5];
-                        flash_freq = uart_rx_buf[6] << 8 | uart_rx_buf[7];
-                        if (flash_freq > 0) {
-                            led_period = (int)(100.0 / flash_freq);
-                            if (led_period < 2) led_period = 2;
-                        }
-                        mode = 0;
-                    } else if (mode == 2) {
-                        char uart_tx_buf[] = {0x7B, 0x27, 0x10, 0x01, 0x02, 0x03, 0x4E, 0x7D};
-                        uart_tx_buf[1] = r >> 8;
-                        uart_tx_buf[2] = r & 0xFF;
-                        if (special_phase == 0) {
-                            uart_tx_buf[3] = 'o';
-                            uart_tx_buf[4] = 'k';
-                            uart_tx_buf[5] = ' ';
-                        } else if (special_phase == 1) {
-                            uart_tx_buf[3] = 'h';
-                            uart_tx_buf[4] = 'i';
-                            uart_tx_buf[5] = 'g';
-                        } else if (special_phase == 2) {
-                            uart_tx_buf[3] = 'l';
-                            uart_tx_buf[4] = 'o';
-                            uart_tx_buf[5] = 'w';
-                        }
-
-                        // Calculate BCC checksum to uart_tx_buf[6]
-                        uart_tx_buf[6] = 0;
-                        for (int i = 0; i < 6; i++) {
-                            uart_tx_buf[6] ^= uart_tx_buf[i];
-                        }
-
-                        // Print sent message as hex
-                        printf("Sent message: ");
-                        for (int i = 0; i < 8; i++) {
-                            printf("%02X ", uart_tx_buf[i]);
-                        }
-                        printf("\n");
-
-                        write(fd_uart, uart_tx_buf, 8);
-                        mode = 0;
-                    } else if (mode == 3) {
-                        char uart_tx_buf[] = {0x7B, 0x27, 0x10, 0x01, 0x02, 0x03, 0x4E, 0x7D};
-                        uart_tx_buf[1] = r >> 8;
-                        uart_tx_buf[2] = r & 0xFF;
-                        if (special_phase == 0) {
-                            uart_tx_buf[3] = 'o';
-                            uart_tx_buf[4] = 'k';
-                            uart_tx_buf[5] = ' ';
-                        } else if (special_phase == 1) {
-                            uart_tx_buf[3] = 'h';
-                            uart_tx_buf[4] = 'i';
-                            uart_tx_buf[5] = 'g';
-                        } else if (special_phase == 2) {
-                            uart_tx_buf[3] = 'l';
-                            uart_tx_buf[4] = 'o';
-                            uart_tx_buf[5] = 'w';
-                        }
-
-                        // Calculate BCC checksum to uart_tx_buf[6]
-                        uart_tx_buf[6] = 0;
-                        for (int i = 0; i < 6; i++) {
-                            uart_tx_buf[6] ^= uart_tx_buf[i];
-                        }
-
-                        // Print sent message as hex
-                        printf("Original message: ");
-                        for (int i = 0; i < 8; i++) {
-                            printf("%02X ", uart_tx_buf[i]);
-                        }
-                        printf("\n");
-
-                        // XOR Encrypt
-                        for (int i = 1; i < 7; i++) {
-                            uart_tx_buf[i] ^= 0xAA;
-                        }
-
-                        // Print sent message as hex
-                        printf("Sent Encrypted message: ");
-                        for (int i = 0; i < 8; i++) {
-                            printf("%02X ", uart_tx_buf[i]);
-                        }
-                        printf("\n");
-
-                        write(fd_uart, uart_tx_buf, 8);
-                        mode = 0;
-                    } else if (mode == 4) {
-                        start_time = get_timestamp();
-                        // 打开文件，使用写入模式（覆盖）
-                        if ((fd_file2 = open("2_4.txt", O_WRONLY | O_CREAT | O_TRUNC, 0777)) < 0) {
-                            printf("open 2_4.txt failed!\r\n");
-                            break;
-                        }
-
-                        // 循环15秒
-                        do {
-                            current_time = get_timestamp();
-                            // 读取ADC
-                            r = read_adc_value(fd_adc, buffer);
-                            // 获取格式化时间
-                            get_format_time_string(format_time_string);
-                            // 判断报警
-                            if (r < 1000 || r > 9000) {
-                                sprintf(uart_out, "Resistnce:%d ,Alert,%s\r\n", r, format_time_string);
-                            } else {
-                                sprintf(uart_out, "Resistnce:%d ,OK,%s\r\n", r, format_time_string);
-                            }
-                            // 写入文件
-                            write(fd_file2, uart_out, strlen(uart_out));
-
-                            // 等待100ms
-                            usleep(100000);
-                        } while (current_time - start_time < duration);
-
-                        close(fd_file2);
-
-                        // 现在重新打开文件读取内容
-                        if ((fd_file2 = open("2_4.txt", O_RDONLY)) < 0) {
-                            printf("open 2_4.txt for read failed!\r\n");
-                            break;
-                        }
-
-                        // 读取文件内容并发送
-                        printf("File content: ");
-                        int read_len;
-                        while ((read_len = read(fd_file2, uart_out, sizeof(uart_out))) > 0) {
-                            write(fd_uart, uart_out, read_len);
-                            // Print sent file content as text
-                            for (int i = 0; i < read_len; i++) {
-                                printf("%c", uart_out[i]);
-                            }
-                        }
-                        // 发送结束标志
-                        char end[2] = {0xff, 0xff};
-                        write(fd_uart, end, 2);
-                        close(fd_file2);
-                        printf("\n");
-
-                        // 提示完成
-                        printf("File content SENT!\n");
-                        mode = 0;
-                    }
-
-                    uart_rx_cnt = 0;
-                }
-            }
-        }
+    memset(pw, 0, sizeof(*pw));
+    pw->fd_led = fd_led;
+    pw->fd_bz = fd_bz;
+    for (int i = 0; i < PWM_CHANNELS; i++) {
+        pw->ch[i].hw = -1;  // 启动时把所有输出写成熄灭
+    }
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pw->cond, &attr);
+    if (pthread_create(&tid, NULL, pwm_thread, pw) != 0) {
+        perror("pwm pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
 
-        if (special_phase == 0) {
-            if (r > thresh_high) {
-                special_phase = 1;
-                loop_times = 0;
-                ioctl(fd_bz, 1);
-            } else if (r < thresh_low) {
-                special_phase = 2;
-                loop_times = 0;
-                ioctl(fd_bz, 1);
-            }
-        } else {
-            bool new_led_on = (loop_times % led_period) < (led_period / 2);
-            if (new_led_on != led_on) {
-                led_on = new_led_on;
-                if (led_on) {
-                    ioctl(fd_led, 1, 0);
-                    ioctl(fd_led, 1, 1);
-                } else {
-                    ioctl(fd_led, 0, 0);
-                    ioctl(fd_led, 0, 1);
-                }
-            }
+// 配置通道输出。freq 为闪烁频率(Hz)，duty 为亮的比例；CHIRP 在 span_ms 内扫到 freq2，
+// BURST 每 count 个脉冲后停 span_ms。同一模式下只更新参数、保持相位，可以每个采样周期调用
+void pwm_set(pwm_t *pw, int ch, int pattern, float freq, float duty, float freq2, long span_ms, int count) {
+    pwm_channel_t *c = &pw->ch[ch];
 
-            if (r > thresh_low && r < thresh_high) {
-                special_phase = 0;
-                ioctl(fd_bz, 0);
-                led_on = false;
-                ioctl(fd_led, 0, 0);
-                ioctl(fd_led, 0, 1);
-            }
-        }
+    if (pattern >= PWM_BLINK && (freq <= 0 || duty <= 0)) pattern = PWM_OFF;
+    if (pattern >= PWM_BLINK && duty >= 1) pattern = PWM_ON;
+    if (pattern == PWM_CHIRP && (freq2 <= 0 || span_ms <= 0)) pattern = PWM_BLINK;
+    if (pattern == PWM_BURST && count <= 0) pattern = PWM_BLINK;
 
-        usleep(1000);
+    pthread_mutex_lock(&pw->lock);
+    bool restart = c->pattern != pattern;
+    c->pattern = pattern;
+    if (pattern >= PWM_BLINK) {
+        c->period_us = freq > 1000 ? 1000 : (long)(1000000 / freq);
+        c->period2_us = pattern == PWM_CHIRP ? (freq2 > 1000 ? 1000 : (long)(1000000 / freq2)) : c->period_us;
+        c->span_us = span_ms * 1000;
+        c->duty = (int)(duty * 1000);
+        c->count = count;
     }
+    if (restart) {
+        c->on = pattern == PWM_ON;
+        c->start_us = c->next_us = pwm_now_us();
+        c->pulse = 0;
+        pthread_cond_signal(&pw->cond);
+    }
+    pthread_mutex_unlock(&pw->lock);
 }
 
-int read_adc_value(int fd_adc, char *buffer) {
-    int len = read(fd_adc, buffer, 12);
-    if (len == 0) {
-        printf("ADC read error \n");
-        return 0;
+void *pwm_thread(void *arg) {
+    pwm_t *pw = (pwm_t *)arg;
+
+    pthread_mutex_lock(&pw->lock);
+    while (1) {
+        long long now = pwm_now_us();
+        long long next = -1;
+        for (int i = 0; i < PWM_CHANNELS; i++) {
+            pwm_channel_t *c = &pw->ch[i];
+            if (c->pattern >= PWM_BLINK) {
+                if (now - c->next_us > 1000000) c->next_us = now;  // 长时间未调度时重新对齐，不补发翻转
+                while (c->next_us <= now) {
+                    pwm_advance(c);
+                }
+                if (next < 0 || c->next_us < next) next = c->next_us;
+            }
+            if (c->hw != (int)c->on) {
+                pwm_output(pw, i, c->on);
+                c->hw = c->on;
+            }
+        }
+        if (next < 0) {
+            pthread_cond_wait(&pw->cond, &pw->lock);
+        } else {
+            struct timespec ts;
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            pthread_cond_timedwait(&pw->cond, &pw->lock, &ts);
+        }
     }
-    return atoi(buffer) * 10000 / 4095;
+    return NULL;
 }
 
-int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop) {
+int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop, bool rtscts) {
     struct termios newtio, oldtio;           // 定义新旧两个termios结构体
     if (tcgetattr(fd_uart, &oldtio) != 0) {  // tcgetattr读取当期串口参数，确认串口是否可以配置（返回0时为执行成功）
         perror("SetupSerial 1");
@@ -369,6 +1887,10 @@ int set_opt(int fd_uart, int nSpeed, int nBits, char nEvent, int nStop) {
         newtio.c_cflag &= ~CSTOPB;
     else if (nStop == 2)
         newtio.c_cflag |= CSTOPB;
+    // 硬件流控：对端撤销 CTS 时由串口驱动暂停发送，接收端来不及处理也不会丢字节。
+    // 没有接 CTS 线时不能打开，否则发送会一直停住
+    if (rtscts)
+        newtio.c_cflag |= CRTSCTS;
     newtio.c_cc[VTIME] = 0;
     newtio.c_cc[VMIN] = 0;
     tcflush(fd_uart, TCIFLUSH);                       // 清除寄存器
@@ -395,17 +1917,785 @@ long long get_timestamp(void) // 获取时间戳函数
 
     return tmp;
 }
-void get_format_time_string(char *str_time) // 获取格式化时间
+
+long long get_mono_ms(void) // 单调时钟毫秒数，不受系统时间调整影响
 {
-    time_t now;
-    struct tm *tm_now;
-    char datetime[128];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long get_mono_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 记录一次耗时。每个阶段只有一个线程写入，快照和清零由日志线程按计数器原子交换完成
+void timing_add(timing_t *tm, int phase, long long us) {
+    timing_hist_t *h = &tm->h[phase];
+    uint32_t v = us < 0 ? 0 : (us > 0xFFFFFFFFLL ? 0xFFFFFFFF : (uint32_t)us);
+    int b = v ? 32 - __builtin_clz(v) : 0;
+
+    if (b >= TIMING_BUCKETS) b = TIMING_BUCKETS - 1;
+    __atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, v, __ATOMIC_RELAXED);
+    if (v > g_timing_budget_us[phase]) __atomic_fetch_add(&h->over, 1, __ATOMIC_RELAXED);
+    if (v > __atomic_load_n(&h->max_us, __ATOMIC_RELAXED)) __atomic_store_n(&h->max_us, v, __ATOMIC_RELAXED);
+}
+
+static unsigned char *put_le32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+// 读计数器，reset 时原子地读出并清零，与写入线程并发时不会丢计数
+static uint32_t timing_take(uint32_t *x, bool reset) {
+    return reset ? __atomic_exchange_n(x, 0, __ATOMIC_RELAXED) : __atomic_load_n(x, __ATOMIC_RELAXED);
+}
+
+// 按 'T' 帧格式编码一个阶段的快照，reset 时同时清零（跳过的节拍数随最后一个阶段清零）；返回负载长度
+int timing_encode(timing_t *tm, int phase, unsigned char *p, bool reset) {
+    timing_hist_t *h = &tm->h[phase];
+    unsigned char *q = p;
+    uint64_t sum = reset ? __atomic_exchange_n(&h->sum_us, 0, __ATOMIC_RELAXED)
+                         : __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+
+    *q++ = phase;
+    *q++ = TM_PHASES;
+    q = put_le32(q, timing_take(&tm->missed, reset && phase == TM_PHASES - 1));
+    q = put_le32(q, timing_take(&h->count, reset));
+    q = put_le32(q, timing_take(&h->max_us, reset));
+    q = put_le32(q, timing_take(&h->over, reset));
+    q = put_le32(q, (uint32_t)sum);
+    q = put_le32(q, (uint32_t)(sum >> 32));
+    for (int i = 0; i < TIMING_BUCKETS; i++) {
+        q = put_le32(q, timing_take(&h->bucket[i], reset));
+    }
+    return q - p;
+}
+
+int logger_start(logger_t *lg, int fd_uart) {
+    pthread_t tid;
+
+    memset(lg, 0, sizeof(*lg));
+    lg->fd_uart = fd_uart;
+    lg->baud = 9600;
+    lg->sync = 2;  // 启动后先通知上位机按板子的序号重新同步
+    if (pipe(lg->notify_fd) != 0) {
+        perror("logger pipe");
+        return -1;
+    }
+    fcntl(lg->notify_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(lg->notify_fd[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&tid, NULL, logger_thread, lg) != 0) {
+        perror("logger pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// 由控制循环调用：只写入环形缓冲区并唤醒日志线程，缓冲区满时丢弃而不阻塞
+int logger_push(logger_t *lg, int kind, int r, int aux) {
+    unsigned int head = lg->head;
+    unsigned int tail = __atomic_load_n(&lg->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= LOG_RING_SIZE) {
+        lg->dropped++;
+        return -1;
+    }
+    log_sample_t *s = &lg->ring[head & (LOG_RING_SIZE - 1)];
+    s->kind = kind;
+    s->r = r;
+    s->aux = aux;
+    s->t_ms = get_mono_ms();
+    __atomic_store_n(&lg->head, head + 1, __ATOMIC_RELEASE);
+    write(lg->notify_fd[1], "", 1);
+    return 0;
+}
+
+// 由控制循环调用：记下上位机的确认/否认/同步请求。确认是累计的，只保留最新一个，
+// 不经过环形缓冲区，日志线程在等待窗口或会话结束时也能及时处理
+void logger_link_rx(logger_t *lg, int type, int seq) {
+    int *slot;
+    if (type == 'A') {
+        slot = &lg->peer_ack;
+    } else if (type == 'N') {
+        slot = &lg->peer_nak;
+    } else if (type == 'R') {
+        slot = &lg->peer_sync;
+    } else {
+        return;
+    }
+    int v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    __atomic_store_n(slot, (((v >> 8) + 1) << 8) | (seq & 0xFF), __ATOMIC_RELEASE);
+    write(lg->notify_fd[1], "", 1);
+}
+
+// CRC-16/CCITT，按半字节查表；crc 传入初值 0xFFFF 或上一段的结果，可以分段计算
+uint16_t crc16_ccitt(uint16_t crc, const unsigned char *p, int len) {
+    static const uint16_t tab[16] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+                                     0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+    for (int i = 0; i < len; i++) {
+        crc = (crc << 4) ^ tab[(crc >> 12) ^ (p[i] >> 4)];
+        crc = (crc << 4) ^ tab[(crc >> 12) ^ (p[i] & 0x0F)];
+    }
+    return crc;
+}
+
+static int link_put(unsigned char *out, int n, unsigned char b) {
+    if (b == LINK_FLAG || b == LINK_ESC) {
+        out[n++] = LINK_ESC;
+        b ^= 0x20;
+    }
+    out[n++] = b;
+    return n;
+}
+
+// 组一个链路帧（含首尾标志和转义），返回编码后的长度，out 至少 LINK_FRAME_MAX 字节
+int link_encode(unsigned char *out, int type, int seq, const unsigned char *payload, int len) {
+    unsigned char head[2] = {type, seq};
+    uint16_t crc = crc16_ccitt(crc16_ccitt(0xFFFF, head, 2), payload, len);
+    int n = 0;
+
+    out[n++] = LINK_FLAG;
+    for (int i = 0; i < 2; i++) {
+        n = link_put(out, n, head[i]);
+    }
+    for (int i = 0; i < len; i++) {
+        n = link_put(out, n, payload[i]);
+    }
+    n = link_put(out, n, crc >> 8);
+    n = link_put(out, n, crc & 0xFF);
+    out[n++] = LINK_FLAG;
+    return n;
+}
+
+// 逐字节解析上位机发来的链路帧。收到完整且CRC正确的帧时返回不含CRC的长度，
+// 帧内容在 rx->buf 中（[0] 类型，[1] 序号）；否则返回0
+int link_rx_byte(link_rx_t *rx, unsigned char b) {
+    if (b == LINK_FLAG) {
+        int len = rx->len;
+        rx->len = 0;
+        rx->esc = false;
+        if (len == 0) {
+            rx->in_frame = true;  // 帧开始（或连续的标志）
+            return 0;
+        }
+        rx->in_frame = false;
+        if (len < 4 || len > LINK_RX_MAX) return 0;
+        if (crc16_ccitt(0xFFFF, rx->buf, len - 2) != (rx->buf[len - 2] << 8 | rx->buf[len - 1])) return 0;
+        return len - 2;
+    }
+    if (b == LINK_ESC) {
+        rx->esc = true;
+        return 0;
+    }
+    if (rx->esc) {
+        b ^= 0x20;
+        rx->esc = false;
+    }
+    if (rx->len < LINK_RX_MAX) {
+        rx->buf[rx->len] = b;
+    }
+    rx->len++;  // 超长的帧只计数，在结束标志处丢弃
+    return 0;
+}
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d)                                 \
+    do {                                                      \
+        a += b; d ^= a; d = CHACHA_ROTL(d, 16);               \
+        c += d; b ^= c; b = CHACHA_ROTL(b, 12);               \
+        a += b; d ^= a; d = CHACHA_ROTL(d, 8);                \
+        c += d; b ^= c; b = CHACHA_ROTL(b, 7);                \
+    } while (0)
+
+// 生成一个64字节密钥块（20轮），状态全部放在局部变量里便于编译器分配寄存器
+static void chacha_block(const uint32_t in[16], uint32_t out[16]) {
+    uint32_t x0 = in[0], x1 = in[1], x2 = in[2], x3 = in[3], x4 = in[4], x5 = in[5], x6 = in[6], x7 = in[7];
+    uint32_t x8 = in[8], x9 = in[9], x10 = in[10], x11 = in[11], x12 = in[12], x13 = in[13], x14 = in[14],
+             x15 = in[15];
+
+    for (int i = 0; i < 10; i++) {
+        CHACHA_QR(x0, x4, x8, x12);
+        CHACHA_QR(x1, x5, x9, x13);
+        CHACHA_QR(x2, x6, x10, x14);
+        CHACHA_QR(x3, x7, x11, x15);
+        CHACHA_QR(x0, x5, x10, x15);
+        CHACHA_QR(x1, x6, x11, x12);
+        CHACHA_QR(x2, x7, x8, x13);
+        CHACHA_QR(x3, x4, x9, x14);
+    }
+    out[0] = x0 + in[0];
+    out[1] = x1 + in[1];
+    out[2] = x2 + in[2];
+    out[3] = x3 + in[3];
+    out[4] = x4 + in[4];
+    out[5] = x5 + in[5];
+    out[6] = x6 + in[6];
+    out[7] = x7 + in[7];
+    out[8] = x8 + in[8];
+    out[9] = x9 + in[9];
+    out[10] = x10 + in[10];
+    out[11] = x11 + in[11];
+    out[12] = x12 + in[12];
+    out[13] = x13 + in[13];
+    out[14] = x14 + in[14];
+    out[15] = x15 + in[15];
+}
+
+static uint32_t load_le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void chacha_init(chacha_t *cc, const uint8_t key[32], const uint8_t nonce[CHACHA_NONCE_SIZE]) {
+    cc->state[0] = 0x61707865;  // "expand 32-byte k"
+    cc->state[1] = 0x3320646e;
+    cc->state[2] = 0x79622d32;
+    cc->state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        cc->state[4 + i] = load_le32(key + 4 * i);
+    }
+    cc->state[12] = 0;
+    for (int i = 0; i < 3; i++) {
+        cc->state[13 + i] = load_le32(nonce + 4 * i);
+    }
+    cc->ks_pos = 64;
+}
+
+// 定位到指定的块，下一次加密从该块的第一个字节开始
+void chacha_seek(chacha_t *cc, uint32_t block) {
+    cc->state[12] = block;
+    cc->ks_pos = 64;
+}
+
+// 加密/解密（异或密钥流）。块对齐的部分按32位字异或；板子和上位机都是小端，密钥块的字直接按内存顺序使用
+void chacha_xor(chacha_t *cc, uint8_t *p, int len) {
+    while (len > 0) {
+        if (cc->ks_pos == 64) {
+            chacha_block(cc->state, cc->ks);
+            cc->state[12]++;
+            cc->ks_pos = 0;
+        }
+        if (cc->ks_pos == 0 && len >= 64) {
+            for (int i = 0; i < 16; i++) {
+                uint32_t w;
+                memcpy(&w, p + 4 * i, 4);
+                w ^= cc->ks[i];
+                memcpy(p + 4 * i, &w, 4);
+            }
+            cc->ks_pos = 64;
+            p += 64;
+            len -= 64;
+            continue;
+        }
+        const uint8_t *ks = (const uint8_t *)cc->ks;
+        while (len > 0 && cc->ks_pos < 64) {
+            *p++ ^= ks[cc->ks_pos++];
+            len--;
+        }
+    }
+}
+
+// 读取256位密钥（64个十六进制字符）。文件不存在时随机生成一个并保存，成功返回0
+int crypt_load_key(uint8_t key[32], const char *path) {
+    char hex[80];
+    FILE *fp = fopen(path, "r");
+
+    if (fp) {
+        int ok = fgets(hex, sizeof(hex), fp) != NULL;
+        fclose(fp);
+        for (int i = 0; ok && i < 32; i++) {
+            unsigned int b;
+            ok = sscanf(hex + 2 * i, "%2x", &b) == 1;
+            key[i] = b;
+        }
+        return ok ? 0 : -1;
+    }
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, key, 32) != 32) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) return -1;
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + 2 * i, "%02x", key[i]);
+    }
+    hex[64] = '\n';
+    write(fd, hex, 65);
+    close(fd);
+    printf("Generated new stream key in %s, copy it to the host\n", path);
+    return 0;
+}
+
+// 每个会话的 nonce：优先取系统随机数，读取失败时用单调时钟和计数器拼出不重复的值
+void crypt_nonce(uint8_t nonce[CHACHA_NONCE_SIZE]) {
+    static uint32_t counter;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd >= 0 && read(fd, nonce, CHACHA_NONCE_SIZE) == CHACHA_NONCE_SIZE) {
+        close(fd);
+        return;
+    }
+    if (fd >= 0) close(fd);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint32_t w[3] = {(uint32_t)ts.tv_sec, (uint32_t)ts.tv_nsec, ++counter};
+    memcpy(nonce, w, CHACHA_NONCE_SIZE);
+}
+
+// -b：测量加密吞吐，并换算成 460800 波特率（每字节10位）满负荷加密时的CPU占用
+void crypt_bench(void) {
+    static uint8_t buf[4096];
+    uint8_t nonce[CHACHA_NONCE_SIZE] = {0};
+    struct timespec t0, t1;
+    chacha_t cc;
+
+    chacha_init(&cc, g_stream_key, nonce);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+    for (int done = 0; done < CRYPT_BENCH_BYTES; done += sizeof(buf)) {
+        chacha_xor(&cc, buf, sizeof(buf));
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+    double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double rate = CRYPT_BENCH_BYTES / sec;
+    printf("ChaCha20: %d bytes in %.3f s CPU, %.2f MB/s\n", CRYPT_BENCH_BYTES, sec, rate / 1e6);
+    printf("CPU at 460800 baud (%d B/s): %.3f%%\n", 460800 / 10, 460800 / 10 / rate * 100);
+}
+
+void log_encode_header(unsigned char *p, long long wall_ms) {
+    unsigned int sec = (unsigned int)(wall_ms / 1000);
+    unsigned int ms = (unsigned int)(wall_ms % 1000);
+
+    memcpy(p, "RLOG", 4);
+    p[4] = LOG_VERSION;
+    p[5] = LOG_RECORD_SIZE;
+    p[6] = LOG_PERIOD_MS & 0xFF;
+    p[7] = LOG_PERIOD_MS >> 8;
+    p[8] = sec & 0xFF;
+    p[9] = (sec >> 8) & 0xFF;
+    p[10] = (sec >> 16) & 0xFF;
+    p[11] = sec >> 24;
+    p[12] = ms & 0xFF;
+    p[13] = ms >> 8;
+    p[14] = 0;
+    p[15] = 0;
+}
+
+void log_encode_record(unsigned char *p, unsigned int dt, int value, int flag) {
+    unsigned int word = (value & 0x3FFF) | (flag << 14);
+    p[0] = dt & 0xFF;
+    p[1] = (dt >> 8) & 0xFF;
+    p[2] = word & 0xFF;
+    p[3] = word >> 8;
+}
+
+static int link_free(logger_t *lg) {
+    return LINK_WINDOW - (unsigned char)(lg->next_seq - lg->base);
+}
+
+// 把一帧放进发送窗口，调用前需保证窗口有空位
+static void logger_link_seal(logger_t *lg, int type, const unsigned char *p, int len) {
+    link_frame_t *f = &lg->win[lg->next_seq % LINK_WINDOW];
+    f->type = type;
+    f->len = len;
+    memcpy(f->data, p, len);
+    if (lg->next_seq == lg->base) lg->progress_ms = get_mono_ms();  // 窗口由空变非空，开始计时
+    lg->next_seq++;
+}
+
+// 未组帧的日志字节满一帧就组帧；force 时把剩余字节也组成一帧
+static void logger_link_seal_pending(logger_t *lg, bool force) {
+    while (lg->pend_len > 0 && link_free(lg) > 0 && (force || lg->pend_len >= LINK_PAYLOAD_MAX)) {
+        int n = lg->pend_len < LINK_PAYLOAD_MAX ? lg->pend_len : LINK_PAYLOAD_MAX;
+        logger_link_seal(lg, 'L', lg->pend, n);
+        memmove(lg->pend, lg->pend + n, lg->pend_len - n);
+        lg->pend_len -= n;
+        lg->pend_ms = get_mono_ms();
+    }
+}
+
+// 把编码好的日志字节同时追加到链路待发数据和文件块，块写满时整块落盘
+static void logger_append(logger_t *lg, const unsigned char *p, int len) {
+    if (lg->pend_len == 0) lg->pend_ms = get_mono_ms();
+    memcpy(lg->pend + lg->pend_len, p, len);
+    if (lg->dump_encrypt) chacha_xor(&lg->dump_cc, lg->pend + lg->pend_len, len);  // 只加密串口副本
+    lg->pend_len += len;
+    logger_link_seal_pending(lg, false);
+    memcpy(lg->block + lg->block_len, p, len);
+    lg->block_len += len;
+    if (lg->block_len == LOG_BLOCK_SIZE) {
+        if (lg->fd_file >= 0) pwrite(lg->fd_file, lg->block, LOG_BLOCK_SIZE, lg->block_index * LOG_BLOCK_SIZE);
+        lg->block_index++;
+        lg->block_len = 0;
+    }
+}
+
+// 只发往串口的数据（遥测帧、应答）
+static void logger_append_uart(logger_t *lg, const unsigned char *p, int len) {
+    memcpy(lg->batch[lg->fill] + lg->fill_len, p, len);
+    lg->fill_len += len;
+}
+
+// 处理控制循环转来的确认/否认/同步请求
+static void logger_link_input(logger_t *lg) {
+    unsigned char inflight = lg->next_seq - lg->base;
+    int v;
+
+    if ((v = __atomic_load_n(&lg->peer_ack, __ATOMIC_ACQUIRE)) != lg->seen_ack) {
+        lg->seen_ack = v;
+        unsigned char n = (unsigned char)v - lg->base;  // 本次确认的帧数
+        if (n > 0 && n <= inflight) {
+            for (; lg->base != (unsigned char)v; lg->base++) {
+                lg->resend &= ~(1u << (lg->base % LINK_WINDOW));
+            }
+            lg->retries = 0;
+            lg->progress_ms = get_mono_ms();
+        }
+    }
+    if ((v = __atomic_load_n(&lg->peer_nak, __ATOMIC_ACQUIRE)) != lg->seen_nak) {
+        lg->seen_nak = v;
+        // 上位机缓存了乱序到达的帧，只需重发它缺的那一帧
+        if ((unsigned char)((unsigned char)v - lg->base) < (unsigned char)(lg->send_seq - lg->base)) {
+            lg->resend |= 1u << ((unsigned char)v % LINK_WINDOW);
+        }
+    }
+    if ((v = __atomic_load_n(&lg->peer_sync, __ATOMIC_ACQUIRE)) != lg->seen_sync) {
+        lg->seen_sync = v;
+        if (lg->sync == 0) lg->sync = 1;
+        for (unsigned char q = lg->base; q != lg->send_seq; q++) {
+            lg->resend |= 1u << (q % LINK_WINDOW);
+        }
+    }
+}
+
+// 超时重发并把待发的链路帧编码进填充缓冲区
+static void logger_link_pump(logger_t *lg, bool flush) {
+    unsigned char frame[LINK_FRAME_MAX];
+    unsigned char inflight = lg->next_seq - lg->base;
+    long long now = get_mono_ms();
+
+    if (lg->pend_len > 0 && (flush || now - lg->pend_ms >= LOG_FLUSH_MS)) {
+        logger_link_seal_pending(lg, true);
+        inflight = lg->next_seq - lg->base;
+    }
+
+    // 超时时间按窗口内数据在当前波特率下的发送时间放宽（每字节10位）
+    if (inflight > 0) {
+        long bytes = 0;
+        for (unsigned char q = lg->base; q != lg->next_seq; q++) {
+            bytes += lg->win[q % LINK_WINDOW].len + 6;
+        }
+        if (now - lg->progress_ms >= LINK_RTO_MS + bytes * 10000 / lg->baud) {
+            lg->progress_ms = now;
+            if (++lg->retries > LINK_MAX_RETRIES) {
+                printf("Link: no ack from host, dropping %d frames\n", inflight);
+                lg->base = lg->send_seq = lg->next_seq;
+                lg->resend = 0;
+                lg->retries = 0;
+                lg->sync = 2;
+            } else {
+                lg->resend |= 1u << (lg->base % LINK_WINDOW);
+            }
+        }
+    }
+
+    if (lg->sync && lg->fill_len + LINK_FRAME_MAX <= LOG_BATCH_SIZE) {
+        unsigned char force = lg->sync == 2;
+        int n = link_encode(frame, 'R', lg->base, &force, 1);
+        logger_append_uart(lg, frame, n);
+        lg->sync = 0;
+        lg->fill_link = true;
+    }
+    // 先补发被否认或超时的帧，再发新帧
+    for (unsigned char q = lg->base; lg->resend && q != lg->send_seq; q++) {
+        unsigned int bit = 1u << (q % LINK_WINDOW);
+        if (!(lg->resend & bit)) continue;
+        if (lg->fill_len + LINK_FRAME_MAX > LOG_BATCH_SIZE) return;
+        link_frame_t *f = &lg->win[q % LINK_WINDOW];
+        int n = link_encode(frame, f->type, q, f->data, f->len);
+        logger_append_uart(lg, frame, n);
+        lg->resend &= ~bit;
+        lg->retransmits++;
+        lg->fill_link = true;
+    }
+    while (lg->send_seq != lg->next_seq && lg->fill_len + LINK_FRAME_MAX <= LOG_BATCH_SIZE) {
+        link_frame_t *f = &lg->win[lg->send_seq % LINK_WINDOW];
+        int n = link_encode(frame, f->type, lg->send_seq, f->data, f->len);
+        logger_append_uart(lg, frame, n);
+        lg->send_seq++;
+        lg->fill_link = true;
+    }
+}
+
+// 模式2/3回复帧：{0x7B, 阻值高, 阻值低, 状态3字符, BCC, 0x7D}，加密时整帧用新 nonce 加密并放在 nonce 之后
+static void logger_reply(logger_t *lg, int r, int phase, bool encrypt) {
+    unsigned char payload[CHACHA_NONCE_SIZE + 8];
+    unsigned char *frame = payload + CHACHA_NONCE_SIZE;
+    unsigned char plain[8] = {0x7B, r >> 8, r & 0xFF, 'o', 'k', ' ', 0, 0x7D};
+
+    memcpy(frame, plain, 8);
+    if (phase == 1) {
+        memcpy(frame + 3, "hig", 3);
+    } else if (phase == 2) {
+        memcpy(frame + 3, "low", 3);
+    } else if (phase == 3) {
+        memcpy(frame + 3, "vib", 3);
+    }
+    for (int i = 0; i < 6; i++) {
+        frame[6] ^= frame[i];
+    }
+    printf("Sent message: ");
+    for (int i = 0; i < 8; i++) {
+        printf("%02X ", frame[i]);
+    }
+    printf("\n");
+    if (encrypt) {
+        chacha_t cc;
+        crypt_nonce(payload);
+        chacha_init(&cc, g_stream_key, payload);
+        chacha_xor(&cc, frame, 8);
+    }
+    logger_link_seal_pending(lg, true);  // 保持与之前日志数据的先后顺序
+    if (encrypt) {
+        logger_link_seal(lg, 'F', payload, sizeof(payload));
+    } else {
+        logger_link_seal(lg, 'F', frame, 8);
+    }
+}
+
+// 打包一帧遥测读数，BCC 为帧尾前所有字节的异或
+static void logger_append_stream_frame(logger_t *lg) {
+    unsigned char frame[STREAM_FRAME_MAX];
+    int len = 0;
+
+    frame[len++] = 0x7B;
+    frame[len++] = lg->stream_encrypt ? 'E' : 'S';
+    frame[len++] = lg->stream_seq >> 8;
+    frame[len++] = lg->stream_seq & 0xFF;
+    frame[len++] = lg->stream_n;
+    for (int i = 0; i < lg->stream_n; i++) {
+        frame[len++] = lg->stream_vals[i] >> 8;
+        frame[len++] = lg->stream_vals[i] & 0xFF;
+    }
+    if (lg->stream_encrypt) {
+        chacha_seek(&lg->stream_cc, lg->stream_block++);
+        chacha_xor(&lg->stream_cc, frame + 5, len - 5);
+    }
+    unsigned char bcc = 0;
+    for (int i = 0; i < len; i++) {
+        bcc ^= frame[i];
+    }
+    frame[len++] = bcc;
+    frame[len++] = 0x7D;
+    logger_append_uart(lg, frame, len);
+    lg->stream_seq++;
+    lg->stream_n = 0;
+}
+
+// 频谱帧与读数帧格式相同，类型为 'P'（加密时 'Q'），值依次为主频、主频分量RMS和各频带RMS。
+// 还没有频谱（未过采样）时不发
+static void logger_append_spectrum_frame(logger_t *lg) {
+    uint16_t v[SPEC_VALUES];
+    unsigned char frame[5 + 2 * SPEC_VALUES + 2];
+    int len = 0;
 
-    time(&now);
-    tm_now = localtime(&now);
-    strftime(datetime, 128, "%Y-%m-%d %H:%M:%S", tm_now);
+    if (!spec_read(&g_acq.spec, v)) return;
+    frame[len++] = 0x7B;
+    frame[len++] = lg->stream_encrypt ? 'Q' : 'P';
+    frame[len++] = (lg->spec_block >> 8) & 0xFF;
+    frame[len++] = lg->spec_block & 0xFF;
+    frame[len++] = SPEC_VALUES;
+    for (int i = 0; i < SPEC_VALUES; i++) {
+        frame[len++] = v[i] >> 8;
+        frame[len++] = v[i] & 0xFF;
+    }
+    if (lg->stream_encrypt) {
+        chacha_seek(&lg->stream_cc, SPEC_BLOCK_BASE + lg->spec_block);
+        chacha_xor(&lg->stream_cc, frame + 5, len - 5);
+    }
+    unsigned char bcc = 0;
+    for (int i = 0; i < len; i++) {
+        bcc ^= frame[i];
+    }
+    frame[len++] = bcc;
+    frame[len++] = 0x7D;
+    logger_append_uart(lg, frame, len);
+    lg->spec_block++;
+}
 
-    printf("now datetime : %s\n", datetime);
-    strcpy(str_time, datetime);
+static void logger_append_record(logger_t *lg, long long t_ms, int value, int flag) {
+    unsigned char rec[LOG_RECORD_SIZE];
+    long long dt = t_ms - lg->last_ms;
+
+    if (dt < 0) dt = 0;
+    while (dt > 0xFFFF) {
+        log_encode_record(rec, 0xFFFF, LOG_CTRL_SKIP, LOG_FLAG_CTRL);
+        logger_append(lg, rec, LOG_RECORD_SIZE);
+        dt -= 0xFFFF;
+    }
+    log_encode_record(rec, (unsigned int)dt, value, flag);
+    logger_append(lg, rec, LOG_RECORD_SIZE);
+    lg->last_ms = t_ms;
 }
 
+void *logger_thread(void *arg) {
+    logger_t *lg = (logger_t *)arg;
+    int drain_len = 0, drain_off = 0;  // 另一个缓冲区中待发往串口的数据
+    bool ending = false;
+    long long last_flush = get_timestamp();
+
+    lg->fd_file = -1;
+    while (1) {
+        struct pollfd pfd[2];
+        int nfds = 1;
+        pfd[0].fd = lg->notify_fd[0];
+        pfd[0].events = POLLIN;
+        if (drain_off < drain_len) {
+            pfd[1].fd = lg->fd_uart;
+            pfd[1].events = POLLOUT;
+            nfds = 2;
+        }
+        poll(pfd, nfds, LOG_FLUSH_MS);
+        if (pfd[0].revents & POLLIN) {
+            char tmp[64];
+            while (read(lg->notify_fd[0], tmp, sizeof(tmp)) > 0) {
+            }
+        }
+
+        logger_link_input(lg);
+
+        // 把环形缓冲区中的采样编码到填充缓冲区（最坏情况每条采样前还有一条SKIP），
+        // 链路窗口至少留两个空位：一条采样最多凑满一帧日志，回复还要再占一帧
+        unsigned int tail = lg->tail;
+        unsigned int head = __atomic_load_n(&lg->head, __ATOMIC_ACQUIRE);
+        while (tail != head && !ending && !lg->pending_baud && lg->fill_len + LOG_ITEM_MAX <= LOG_BATCH_SIZE &&
+               link_free(lg) >= 2) {
+            log_sample_t *s = &lg->ring[tail & (LOG_RING_SIZE - 1)];
+            if (s->kind == LOG_TIMING && link_free(lg) < TM_PHASES + 1) break;  // 快照要一次放进窗口
+            if (s->kind == LOG_START) {
+                unsigned char hdr[LOG_HEADER_SIZE];
+                if (lg->fd_file >= 0) close(lg->fd_file);
+                if ((lg->fd_file = open(LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0777)) < 0) {
+                    printf("open %s failed!\r\n", LOG_FILE);
+                }
+                lg->block_len = 0;
+                lg->block_index = 0;
+                lg->last_ms = s->t_ms;
+                lg->dropped = 0;
+                lg->dump_encrypt = s->aux & CRYPT_ENCRYPT;
+                if (lg->dump_encrypt) {
+                    unsigned char nonce[CHACHA_NONCE_SIZE];
+                    crypt_nonce(nonce);
+                    chacha_init(&lg->dump_cc, g_stream_key, nonce);
+                    logger_link_seal_pending(lg, true);
+                    logger_link_seal(lg, 'K', nonce, sizeof(nonce));
+                }
+                log_encode_header(hdr, get_timestamp());
+                logger_append(lg, hdr, LOG_HEADER_SIZE);
+            } else if (s->kind == LOG_END) {
+                logger_append_record(lg, s->t_ms, LOG_CTRL_END, LOG_FLAG_CTRL);
+                ending = true;
+            } else if (s->kind == LOG_STREAM) {
+                lg->stream_vals[lg->stream_n++] = (s->r & 0x3FFF) | (s->aux << 14);
+                if (lg->stream_n == STREAM_BATCH) logger_append_stream_frame(lg);
+            } else if (s->kind == LOG_STREAM_CFG) {
+                int code = s->r & 0xFF;
+                unsigned char ack[6 + CHACHA_NONCE_SIZE] = {0x7B, 0x05, code, s->aux};
+                int n = 4;
+                lg->stream_encrypt = (s->r >> 8 & CRYPT_ENCRYPT) && s->aux > 0;
+                if (lg->stream_encrypt) {
+                    ack[1] = 'K';
+                    crypt_nonce(ack + n);
+                    chacha_init(&lg->stream_cc, g_stream_key, ack + n);
+                    n += CHACHA_NONCE_SIZE;
+                }
+                ack[n] = 0;
+                for (int i = 0; i < n; i++) {
+                    ack[n] ^= ack[i];
+                }
+                ack[n + 1] = 0x7D;
+                logger_append_uart(lg, ack, n + 2);
+                lg->stream_n = 0;
+                lg->stream_seq = 0;
+                lg->stream_block = 0;
+                lg->spec_block = 0;
+                if (code) lg->pending_baud = g_stream_bauds[code];
+            } else if (s->kind == LOG_REPLY) {
+                logger_reply(lg, s->r, s->aux & 0xFF, s->aux >> 8);
+            } else if (s->kind == LOG_SPECTRUM) {
+                logger_append_spectrum_frame(lg);
+            } else if (s->kind == LOG_TIMING) {
+                unsigned char payload[TIMING_FRAME_SIZE];
+                logger_link_seal_pending(lg, true);
+                for (int i = 0; i < TM_PHASES; i++) {
+                    logger_link_seal(lg, 'T', payload, timing_encode(&g_timing, i, payload, s->aux & TIMING_RESET));
+                }
+            } else {
+                // 判断报警
+                int flag = s->r > 9000 ? LOG_FLAG_HIGH : (s->r < 1000 ? LOG_FLAG_LOW : LOG_FLAG_OK);
+                logger_append_record(lg, s->t_ms, s->r, flag);
+            }
+            tail++;
+        }
+        __atomic_store_n(&lg->tail, tail, __ATOMIC_RELEASE);
+
+        logger_link_pump(lg, ending || lg->pending_baud);
+
+        // 串口空闲且记录已攒够（或超时/会话结束/有链路帧）时交换缓冲区，整批写文件并开始发送
+        long long now = get_timestamp();
+        if (drain_off >= drain_len && lg->fill_len > 0 &&
+            (lg->fill_len + LOG_ITEM_MAX > LOG_BATCH_SIZE || now - last_flush >= LOG_FLUSH_MS || ending ||
+             lg->pending_baud || lg->fill_link)) {
+            // 未写满的当前块按块偏移覆盖写入，保证文件写入始终块对齐
+            if (lg->fd_file >= 0 && lg->block_len > 0) {
+                pwrite(lg->fd_file, lg->block, lg->block_len, lg->block_index * LOG_BLOCK_SIZE);
+            }
+            drain_len = lg->fill_len;
+            drain_off = 0;
+            lg->fill ^= 1;
+            lg->fill_len = 0;
+            lg->fill_link = false;
+            last_flush = now;
+        }
+
+        // 非阻塞串口可能只写入一部分，剩余部分等下一次POLLOUT继续发送
+        if (drain_off < drain_len) {
+            pthread_mutex_lock(&g_uart_lock);
+            int n = write(lg->fd_uart, lg->batch[lg->fill ^ 1] + drain_off, drain_len - drain_off);
+            pthread_mutex_unlock(&g_uart_lock);
+            if (n > 0) drain_off += n;
+        }
+
+        // 应答已按原波特率完整发出后再切换
+        if (lg->pending_baud && lg->fill_len == 0 && drain_off >= drain_len) {
+            tcdrain(lg->fd_uart);
+            pthread_mutex_lock(&g_uart_lock);
+            set_opt(lg->fd_uart, lg->pending_baud, 8, 'N', 1, g_uart_rtscts);
+            pthread_mutex_unlock(&g_uart_lock);
+            lg->baud = lg->pending_baud;
+            lg->pending_baud = 0;
+        }
+
+        if (ending && lg->pend_len == 0 && lg->base == lg->next_seq && lg->fill_len == 0 && drain_off >= drain_len) {
+            // END记录已随最后一批发出并被上位机确认（或链路放弃重发）
+            if (lg->fd_file >= 0) close(lg->fd_file);
+            lg->fd_file = -1;
+            ending = false;
+            if (lg->dropped) printf("Logger dropped %u samples\n", lg->dropped);
+            if (lg->retransmits) printf("Link retransmitted %u times\n", lg->retransmits);
+            lg->retransmits = 0;
+            printf("File content SENT!\n");
+        }
+    }
+    return NULL;
+}
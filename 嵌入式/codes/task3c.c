@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,26 +10,352 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#define SEARCH_PAGE 20  // 服务器 SEARCH 每页最多返回的用户名数
+#define RECONNECT_BASE_MS 250   // 断线重连的首次退避时间，之后每次翻倍
+#define RECONNECT_MAX_MS 8000
+#define RECONNECT_TRIES 12
+#define RESUME_TIMEOUT_S 5      // 重连后等 RESUME 应答的最长时间
+#define MAX_CONVS 64            // 客户端同时保留的对话数
+#define CONV_HISTORY 100        // 每个对话保留的消息行数
+
 char g_username[256] = {0};
 int g_logged_in = 0;
+char g_token[64] = {0};         // LOGIN 应答中的恢复令牌，断线重连时用它回到原账号
+char g_reply_arg[64] = {0};     // 最近一条应答 "状态$消息$附加字段" 的附加字段
+struct sockaddr_in g_server_addr;
+int g_cfd = -1;                 // 服务器套接字，供只有输入提示参数的 get_input 使用
+int g_conn_gen = 0;             // 每次重连加一，等应答时据此发现请求随旧连接丢了
+
+// 一个对话（按对方用户名）的消息缓冲区。服务器推来的消息不管在菜单还是聊天窗口都先放进这里，
+// 当前聊天窗口的对话直接显示，其他对话只累计未读数，/switch 过去时再显示
+typedef struct {
+    char peer[256];
+    char *lines[CONV_HISTORY];  // 环形，最旧的一行在 head
+    int head, n;
+    int unread;                 // 末尾还没显示的行数
+    unsigned long last_id;      // 对方消息已收到的最大编号，会话恢复后重发的据此去重
+    unsigned long read_id, read_sent;  // 已显示到的编号、已经用 READ 告诉服务器的编号
+} conv_t;
+
+conv_t g_convs[MAX_CONVS];
+int g_n_convs = 0;
+conv_t *g_active = NULL;        // 当前聊天窗口的对话，NULL 表示在菜单中
+
+// 应答帧（OK/FAIL/SEARCH/FRIENDS）在有请求等待时交给它，没有时当作服务器提示显示
+int g_waiting = 0;
+char g_reply[1024];
+int g_reply_len = -1;
+
+// 标准输入也自己缓冲按行取，stdio 的缓冲会让 select 看不到已经读进来的行
+char g_kbd[1024];
+int g_kbd_len = 0;
+
+// 服务器的每一帧以 '\n' 结尾，一次 recv 可能收到多帧或半帧，先放进接收缓冲区
+char g_rx[4096];
+int g_rx_len = 0;
+
+// 好友上下线通知 "PRESENCE$+上线者$-下线者..."，buf 中的 '$' 已替换为 '\0'
+void print_presence(const char *buf, int len) {
+    printf("[Presence]");
+    for (int i = 0; i < len; i++) {
+        if (buf[i] == '\0' && i + 2 < len) {
+            printf(" %s %s", &buf[i + 2], buf[i + 1] == '+' ? "online" : "offline");
+        }
+    }
+    printf("\n");
+}
+
+// 从接收缓冲区取出一帧（去掉 '\n'），没有完整的帧返回 -1
+int pop_frame(char *frame, int size) {
+    char *nl = memchr(g_rx, '\n', g_rx_len);
+    if (!nl) return -1;
+    int len = nl - g_rx;
+    int n = len < size - 1 ? len : size - 1;
+    memcpy(frame, g_rx, n);
+    frame[n] = '\0';
+    g_rx_len -= len + 1;
+    memmove(g_rx, nl + 1, g_rx_len);
+    return n;
+}
+
+// 读一次套接字追加到接收缓冲区，连接断开返回 -1
+int fill_rx(int cfd) {
+    if (g_rx_len == sizeof(g_rx)) g_rx_len = 0;  // 超长的帧丢弃
+    int len = recv(cfd, g_rx + g_rx_len, sizeof(g_rx) - g_rx_len, 0);
+    if (len <= 0) return -1;
+    g_rx_len += len;
+    return len;
+}
+
+// 阻塞直到收到一帧，连接断开返回 -1
+int recv_frame(int cfd, char *frame, int size) {
+    int len;
+    while ((len = pop_frame(frame, size)) < 0) {
+        if (fill_rx(cfd) < 0) return -1;
+    }
+    return len;
+}
+
+// 丢掉全部对话。消息编号只在服务器内存中，会话没有恢复（重新登录、服务器重启过）时
+// 服务器可能从1重新编号，旧的去重编号会把新消息当成重发的丢掉
+void conv_clear_all(void) {
+    for (int i = 0; i < g_n_convs; i++) {
+        for (int j = 0; j < g_convs[i].n; j++) free(g_convs[i].lines[(g_convs[i].head + j) % CONV_HISTORY]);
+    }
+    g_n_convs = 0;
+    g_active = NULL;
+}
+
+// 连接断开后重连。退避时间从 RECONNECT_BASE_MS 起每次翻倍，实际等待在 [0, 退避时间] 内随机，
+// 服务器重启后大量客户端不会同时涌入。新套接字用 dup2 放到原来的描述符上，调用者的 cfd 不变。
+// 已登录时发 "RESUME$令牌" 回到原账号，没有令牌或令牌失效则回到未登录状态。连不上返回 -1
+int reconnect(int cfd) {
+    int backoff = RECONNECT_BASE_MS;
+    g_rx_len = 0;  // 旧连接剩下的半帧
+    for (int attempt = 0; attempt < RECONNECT_TRIES; attempt++) {
+        int wait = rand() % (backoff + 1);
+        printf("Connection lost, reconnecting in %d ms...\n", wait);
+        usleep(wait * 1000);
+        backoff = backoff * 2 < RECONNECT_MAX_MS ? backoff * 2 : RECONNECT_MAX_MS;
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) continue;
+        if (connect(fd, (struct sockaddr *)&g_server_addr, sizeof(g_server_addr)) == -1 || dup2(fd, cfd) == -1) {
+            close(fd);
+            continue;
+        }
+        close(fd);
+        g_rx_len = 0;
+        g_conn_gen++;
+        if (!g_logged_in) {
+            printf("Reconnected to server.\n");
+            return 0;
+        }
+
+        char buffer[1024] = "";
+        if (g_token[0]) {
+            int len = snprintf(buffer, sizeof(buffer), "RESUME$%s\n", g_token);
+            struct timeval tv = {RESUME_TIMEOUT_S, 0};  // 服务器不应答时不要一直等下去
+            setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            int ok = send(cfd, buffer, len, 0) == len && recv_frame(cfd, buffer, sizeof(buffer)) >= 0;
+            tv.tv_sec = 0;
+            setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            if (!ok) continue;
+        }
+        if (strncmp(buffer, "OK$", 3) == 0) {
+            printf("Reconnected, session resumed.\n");
+        } else {
+            printf("Reconnected, but the session could not be resumed. Please log in again.\n");
+            g_logged_in = 0;
+            g_token[0] = '\0';
+            conv_clear_all();
+        }
+        return 0;
+    }
+    printf("Could not reconnect to the server.\n");
+    return -1;
+}
 
+// 查找和对方的对话，create 为真时不存在就新建；满了换掉一个没有未读的
+conv_t *conv_find(const char *peer, int create) {
+    for (int i = 0; i < g_n_convs; i++) {
+        if (strcmp(g_convs[i].peer, peer) == 0) return &g_convs[i];
+    }
+    if (!create || !peer[0]) return NULL;
+    conv_t *cv = NULL;
+    if (g_n_convs < MAX_CONVS) {
+        cv = &g_convs[g_n_convs++];
+    } else {
+        for (int i = 0; i < MAX_CONVS && !cv; i++) {
+            if (g_convs[i].unread == 0 && &g_convs[i] != g_active) cv = &g_convs[i];
+        }
+        if (!cv) cv = &g_convs[g_active == &g_convs[0] ? 1 : 0];
+        for (int i = 0; i < cv->n; i++) free(cv->lines[(cv->head + i) % CONV_HISTORY]);
+    }
+    memset(cv, 0, sizeof(*cv));
+    snprintf(cv->peer, sizeof(cv->peer), "%s", peer);
+    return cv;
+}
+
+// 对话追加一行。当前聊天窗口的对话直接显示（show 为假时只记录，例如自己刚输入的消息），
+// 其他对话记为未读，第一条未读时提示一次
+void conv_add_line(conv_t *cv, const char *line, int show) {
+    char *copy = strdup(line);
+    if (!copy) return;
+    if (cv->n == CONV_HISTORY) {
+        free(cv->lines[cv->head]);
+        cv->head = (cv->head + 1) % CONV_HISTORY;
+        cv->n--;
+    }
+    cv->lines[(cv->head + cv->n++) % CONV_HISTORY] = copy;
+    if (cv == g_active) {
+        if (show) printf("%s\n", line);
+    } else if (cv->unread++ == 0) {
+        printf("[New message from %s, open Chat and /switch %s]\n", cv->peer, cv->peer);
+    }
+    if (cv->unread > cv->n) cv->unread = cv->n;
+}
+
+// 显示对话的未读行（没有未读时显示最近几行），之后都算已读
+void conv_show(conv_t *cv) {
+    int from = cv->unread > 0 ? cv->n - cv->unread : (cv->n > 10 ? cv->n - 10 : 0);
+    for (int i = from; i < cv->n; i++) {
+        printf("%s\n", cv->lines[(cv->head + i) % CONV_HISTORY]);
+    }
+    cv->unread = 0;
+    cv->read_id = cv->last_id;
+}
+
+// 每个对话把新显示到的编号合成一条 "READ$对方$编号" 发给服务器
+void flush_reads(int cfd) {
+    char buffer[512];
+    for (int i = 0; i < g_n_convs; i++) {
+        conv_t *cv = &g_convs[i];
+        if (cv->read_id <= cv->read_sent) continue;
+        int len = snprintf(buffer, sizeof(buffer), "READ$%s$%lu\n", cv->peer, cv->read_id);
+        send(cfd, buffer, len, 0);
+        cv->read_sent = cv->read_id;
+    }
+}
+
+// 分发服务器发来的一帧
+void handle_frame(char *frame, int len) {
+    if (strncmp(frame, "OK$", 3) == 0 || strncmp(frame, "FAIL$", 5) == 0 || strncmp(frame, "SEARCH$", 7) == 0 ||
+        strncmp(frame, "FRIENDS", 7) == 0) {
+        if (g_waiting && g_reply_len < 0) {
+            memcpy(g_reply, frame, len + 1);
+            g_reply_len = len;
+        } else {
+            printf("[Server]: %s\n", strchr(frame, '$') ? strchr(frame, '$') + 1 : frame);
+        }
+        return;
+    }
+    if (strncmp(frame, "PRESENCE", 8) == 0) {
+        for (int i = 0; i < len; i++) {
+            if (frame[i] == '$') frame[i] = '\0';
+        }
+        print_presence(frame, len);
+        return;
+    }
+
+    // Replace '$' with '\0'，正文中的 '$' 保留
+    char *cmd = frame;
+    char *fields[3] = {"", "", ""};
+    char *p = frame;
+    for (int part = 0; part < 3 && (p = strchr(p, '$')) != NULL; part++) {
+        *p++ = '\0';
+        fields[part] = p;
+    }
+    char line[1200];
+    if (strcmp(cmd, "MSG") == 0) {
+        // "MSG$发送者$id$正文"，重连后重发的已收到消息丢掉
+        conv_t *cv = conv_find(fields[0], 1);
+        unsigned long id = strtoul(fields[1], NULL, 10);
+        if (!cv || id <= cv->last_id) return;
+        cv->last_id = id;
+        snprintf(line, sizeof(line), "[%s]: %s", fields[0], fields[2]);
+        conv_add_line(cv, line, 1);
+        if (cv == g_active) cv->read_id = id;
+    } else if (strcmp(cmd, "SENT") == 0) {
+        // 本账号在其他设备上发出的消息带正文 "SENT$接收者$id$正文"，自己发的只有 id
+        conv_t *cv = *fields[2] ? conv_find(fields[0], 1) : NULL;
+        if (!cv) return;
+        snprintf(line, sizeof(line), "[me -> %s]: %s", fields[0], fields[2]);
+        conv_add_line(cv, line, 1);
+    } else if (strcmp(cmd, "ACK") == 0) {
+        // "ACK$接收者$已送达$已读"，累计值，只在聊天窗口显示
+        if (g_active && strcmp(fields[0], g_active->peer) == 0) {
+            printf("(%s: delivered up to #%s, read up to #%s)\n", fields[0], fields[1], fields[2]);
+        }
+    } else {
+        printf("[Server]: %s\n", fields[0]);
+    }
+}
+
+// 客户端唯一的事件循环：等服务器套接字和（want_stdin 为真时）标准输入，服务器发来的帧随到随处理，
+// 所以无论在菜单、输入提示还是等应答，服务器那边都不会因为这个客户端不读而积压。
+// 返回 1 表示标准输入有数据可读。断线时自动重连，重连不上就退出
+int pump(int cfd, int want_stdin) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(cfd, &read_fds);
+    if (want_stdin) FD_SET(STDIN_FILENO, &read_fds);
+    int max_fd = (STDIN_FILENO > cfd) ? STDIN_FILENO : cfd;
+
+    // 接收缓冲区里还有完整的帧（例如重连时和应答一起收到的）时不等新数据
+    struct timeval no_wait = {0, 0};
+    int activity = select(max_fd + 1, &read_fds, NULL, NULL, memchr(g_rx, '\n', g_rx_len) ? &no_wait : NULL);
+    if (activity < 0) {
+        if (errno == EINTR) return 0;
+        perror("select");
+        exit(EXIT_FAILURE);
+    }
+
+    if (FD_ISSET(cfd, &read_fds) && fill_rx(cfd) < 0) {
+        printf("Server disconnected.\n");
+        if (reconnect(cfd) != 0) exit(EXIT_FAILURE);
+    }
+    char frame[1024];
+    int len;
+    while ((len = pop_frame(frame, sizeof(frame))) >= 0) {
+        handle_frame(frame, len);
+    }
+    flush_reads(cfd);
+    fflush(stdout);
+    return want_stdin && FD_ISSET(STDIN_FILENO, &read_fds);
+}
+
+// 显示提示并读一行输入，等输入期间照常处理服务器消息。标准输入结束时退出
 void get_input(const char *prompt, char *buffer, size_t size) {
     printf("%s", prompt);
-    fgets(buffer, size, stdin);
-    buffer[strcspn(buffer, "\n")] = 0;  // 移除换行符
+    fflush(stdout);
+    char *nl;
+    while (!(nl = memchr(g_kbd, '\n', g_kbd_len))) {
+        if (g_kbd_len == (int)sizeof(g_kbd)) g_kbd_len = 0;  // 超长的行丢弃
+        if (!pump(g_cfd, 1)) continue;
+        int n = read(STDIN_FILENO, g_kbd + g_kbd_len, sizeof(g_kbd) - g_kbd_len);
+        if (n <= 0) {
+            close(g_cfd);
+            exit(EXIT_SUCCESS);
+        }
+        g_kbd_len += n;
+    }
+    int len = nl - g_kbd;
+    snprintf(buffer, size, "%.*s", len, g_kbd);
+    g_kbd_len -= len + 1;
+    memmove(g_kbd, nl + 1, g_kbd_len);
+    buffer[strcspn(buffer, "\r")] = 0;
+}
+
+// 等刚发出的请求的应答，期间照常处理推送的消息。应答放在 reply 中（'$' 未替换），
+// 连接在此期间断开（请求随旧连接丢了）返回 -1
+int wait_reply(int cfd, char *reply, int size) {
+    int gen = g_conn_gen;
+    g_waiting = 1;
+    g_reply_len = -1;
+    while (g_reply_len < 0 && gen == g_conn_gen) {
+        pump(cfd, 0);
+    }
+    g_waiting = 0;
+    if (g_reply_len < 0) {
+        printf("The request was not completed, please try again.\n");
+        return -1;
+    }
+    int len = g_reply_len < size - 1 ? g_reply_len : size - 1;
+    memcpy(reply, g_reply, len);
+    reply[len] = '\0';
+    g_reply_len = -1;
+    return len;
 }
 
 // 处理服务器响应并返回状态 (1 for OK, 0 for FAIL)
 int handle_server_response(int cfd) {
     char buffer[1024];
-    int len = recv(cfd, buffer, sizeof(buffer) - 1, 0);
-    if (len <= 0) {
-        printf("Server disconnected or error occurred.\n");
-        return 0;
-    }
-    buffer[len] = '\0';
+    int len = wait_reply(cfd, buffer, sizeof(buffer));
+    if (len < 0) return 0;
 
     // Replace '$' with '\0'
     for (int i = 0; i < len; i++) {
@@ -39,9 +366,11 @@ int handle_server_response(int cfd) {
 
     char *status = buffer;
     char *message = "";
-    for (int i = 0; i < len; i++) {
-        if (buffer[i] == '\0') {
-            message = &buffer[i + 1];
+    g_reply_arg[0] = '\0';
+    for (int i = 0, part = 0; i < len; i++) {
+        if (buffer[i] == '\0' && ++part == 1) message = &buffer[i + 1];
+        if (buffer[i] == '\0' && part == 2) {
+            snprintf(g_reply_arg, sizeof(g_reply_arg), "%.*s", (int)sizeof(g_reply_arg) - 1, &buffer[i + 1]);
             break;
         }
     }
@@ -55,7 +384,7 @@ void do_register(int cfd) {
     get_input("Enter username: ", username, sizeof(username));
     get_input("Enter password: ", password, sizeof(password));
 
-    int len = snprintf(buffer, sizeof(buffer), "REG$%s$%s", username, password);
+    int len = snprintf(buffer, sizeof(buffer), "REG$%s$%s\n", username, password);
     send(cfd, buffer, len, 0);
     handle_server_response(cfd);
 }
@@ -65,17 +394,23 @@ void do_login(int cfd) {
     get_input("Enter username: ", username, sizeof(username));
     get_input("Enter password: ", password, sizeof(password));
 
-    int len = snprintf(buffer, sizeof(buffer), "LOGIN$%s$%s", username, password);
+    int len = snprintf(buffer, sizeof(buffer), "LOGIN$%s$%s\n", username, password);
+    conv_clear_all();  // 登录成功后服务器紧接着重发的未读消息进新的对话
     send(cfd, buffer, len, 0);
 
     if (handle_server_response(cfd)) {
         g_logged_in = 1;
         strcpy(g_username, username);
+        snprintf(g_token, sizeof(g_token), "%s", g_reply_arg);
     }
 }
 
-void do_logout() {
+void do_logout(int cfd) {
+    send(cfd, "LOGOUT\n", 7, 0);
+    handle_server_response(cfd);
     g_logged_in = 0;
+    g_token[0] = '\0';
+    conv_clear_all();
     memset(g_username, 0, sizeof(g_username));
     printf("You have been logged out.\n");
 }
@@ -85,16 +420,67 @@ void do_change_password(int cfd) {
     get_input("Enter old password: ", old_pass, sizeof(old_pass));
     get_input("Enter new password: ", new_pass, sizeof(new_pass));
 
-    int len = snprintf(buffer, sizeof(buffer), "CHGPWD$%s$%s", old_pass, new_pass);
+    int len = snprintf(buffer, sizeof(buffer), "CHGPWD$%s$%s\n", old_pass, new_pass);
     send(cfd, buffer, len, 0);
     handle_server_response(cfd);
 }
 
+// 按前缀搜索用户名并分页显示，选中的用户名写入 out，返回1表示选中
+int search_users(int cfd, const char *prefix, char *out, size_t size) {
+    char buffer[1024], after[256] = "", input[64];
+    char *names[SEARCH_PAGE];
+    while (1) {
+        int len = snprintf(buffer, sizeof(buffer), "SEARCH$%s$%s\n", prefix, after);
+        send(cfd, buffer, len, 0);
+        if ((len = wait_reply(cfd, buffer, sizeof(buffer))) < 0) return 0;
+        for (int i = 0; i < len; i++) {
+            if (buffer[i] == '$') buffer[i] = '\0';
+        }
+        if (strcmp(buffer, "SEARCH") != 0) {
+            printf("Search failed: %s\n", len > (int)strlen(buffer) ? buffer + strlen(buffer) + 1 : buffer);
+            return 0;
+        }
+
+        // "SEARCH$还有下一页$用户名..."
+        char *more = buffer + 7;
+        int n = 0;
+        for (int i = 8; i < len && n < SEARCH_PAGE; i++) {
+            if (buffer[i] == '\0') names[n++] = &buffer[i + 1];
+        }
+        if (n == 0) {
+            printf("No users start with \"%s\".\n", prefix);
+            return 0;
+        }
+        for (int i = 0; i < n; i++) {
+            printf("  %2d. %s\n", i + 1, names[i]);
+        }
+        get_input(strcmp(more, "1") == 0 ? "Pick a number, 'n' for the next page, Enter to cancel: "
+                                         : "Pick a number, Enter to cancel: ",
+                  input, sizeof(input));
+        if (strcmp(input, "n") == 0 && strcmp(more, "1") == 0) {
+            snprintf(after, sizeof(after), "%s", names[n - 1]);
+            continue;
+        }
+        int pick = atoi(input);
+        if (pick < 1 || pick > n) return 0;
+        snprintf(out, size, "%s", names[pick - 1]);
+        return 1;
+    }
+}
+
 void do_add_friend(int cfd) {
     char friend_name[256], buffer[1024];
-    get_input("Enter friend's username to add: ", friend_name, sizeof(friend_name));
+    get_input("Enter friend's username to add (or a prefix ending in '*' to search): ", friend_name,
+              sizeof(friend_name));
+    size_t n = strlen(friend_name);
+    if (n > 0 && friend_name[n - 1] == '*') {
+        char prefix[256];
+        friend_name[n - 1] = '\0';
+        snprintf(prefix, sizeof(prefix), "%s", friend_name);
+        if (!search_users(cfd, prefix, friend_name, sizeof(friend_name))) return;
+    }
 
-    int len = snprintf(buffer, sizeof(buffer), "ADDFRIEND$%s", friend_name);
+    int len = snprintf(buffer, sizeof(buffer), "ADDFRIEND$%s\n", friend_name);
     send(cfd, buffer, len, 0);
     handle_server_response(cfd);
 }
@@ -103,81 +489,60 @@ void do_del_friend(int cfd) {
     char friend_name[256], buffer[1024];
     get_input("Enter friend's username to delete: ", friend_name, sizeof(friend_name));
 
-    int len = snprintf(buffer, sizeof(buffer), "DELFRIEND$%s", friend_name);
+    int len = snprintf(buffer, sizeof(buffer), "DELFRIEND$%s\n", friend_name);
     send(cfd, buffer, len, 0);
     handle_server_response(cfd);
 }
 
+void print_conversations(void) {
+    if (g_n_convs == 0) printf("No conversations yet.\n");
+    for (int i = 0; i < g_n_convs; i++) {
+        printf("  %s%s (%d unread)\n", g_convs[i].peer, &g_convs[i] == g_active ? " *" : "", g_convs[i].unread);
+    }
+}
+
+// 聊天窗口：输入的行发给当前对话，"/switch 用户名" 切换对话，"/list" 列出对话和未读数，Q 返回菜单。
+// 消息由事件循环按发送者放进各自的对话，不会串到当前窗口里
 void do_chat(int cfd) {
     char recipient[256];
-    get_input("Enter username to chat with: ", recipient, sizeof(recipient));
-    printf("--- Entering chat with %s. Type 'Q' on a new line to exit. ---\n", recipient);
-
-    fd_set read_fds;
     char send_buf[1024];
-    char recv_buf[1024];
-
-    while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
-        FD_SET(cfd, &read_fds);
-
-        int max_fd = (STDIN_FILENO > cfd) ? STDIN_FILENO : cfd;
-
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-
-        if ((activity < 0) && (errno != EINTR)) {
-            printf("select error\n");
+    get_input("Enter username to chat with (/list to see conversations): ", recipient, sizeof(recipient));
+    if (strcmp(recipient, "/list") == 0) {
+        print_conversations();
+        get_input("Enter username to chat with: ", recipient, sizeof(recipient));
+    }
+    if (!(g_active = conv_find(recipient, 1))) return;
+    printf("--- Chat with %s. /switch <user> to change, /list for all, 'Q' to exit. ---\n", recipient);
+    conv_show(g_active);
+    flush_reads(cfd);
+
+    while (g_logged_in) {
+        get_input("", send_buf, sizeof(send_buf));
+        if (!g_logged_in || !g_active) break;  // 等输入期间断线且会话没能恢复
+        if (strcmp(send_buf, "Q") == 0 || strcmp(send_buf, "q") == 0) {
             break;
         }
-
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            fgets(send_buf, sizeof(send_buf), stdin);
-            if (strcmp(send_buf, "Q\n") == 0 || strcmp(send_buf, "q\n") == 0) {
-                break;
-            }
-            send_buf[strcspn(send_buf, "\n")] = 0;
-            char packet[1024];
-            int len = snprintf(packet, sizeof(packet), "MSG$%s$%s", recipient, send_buf);
-            send(cfd, packet, len, 0);
+        if (strcmp(send_buf, "/list") == 0) {
+            print_conversations();
+            continue;
         }
-
-        if (FD_ISSET(cfd, &read_fds)) {
-            int len = recv(cfd, recv_buf, sizeof(recv_buf) - 1, 0);
-            if (len <= 0) {
-                printf("Server disconnected.\n");
-                g_logged_in = 0;
-                break;
-            }
-            recv_buf[len] = '\0';
-
-            // Replace '$' with '\0'
-            for (int i = 0; i < len; i++) {
-                if (recv_buf[i] == '$') {
-                    recv_buf[i] = '\0';
-                }
-            }
-
-            char *cmd = recv_buf;
-            char *sender = "";
-            char *message = "";
-            int part = 0;
-            for (int i = 0; i < len; ++i) {
-                if (recv_buf[i] == '\0') {
-                    part++;
-                    if (part == 1) sender = &recv_buf[i + 1];
-                    if (part == 2) message = &recv_buf[i + 1];
-                }
-            }
-
-            if (strcmp(cmd, "MSG") == 0) {
-                printf("[%s]: %s\n", sender, message);
-            } else {
-                printf("[Server]: %s\n", (strchr(recv_buf, '\0') + 1));
-            }
+        if (strncmp(send_buf, "/switch ", 8) == 0) {
+            conv_t *cv = conv_find(send_buf + 8, 1);
+            if (!cv) continue;
+            g_active = cv;
+            printf("--- Chat with %s ---\n", cv->peer);
+            conv_show(cv);
+            flush_reads(cfd);
+            continue;
         }
+        char packet[1200], line[1200];
+        int len = snprintf(packet, sizeof(packet), "MSG$%s$%s\n", g_active->peer, send_buf);
+        send(cfd, packet, len, 0);
+        snprintf(line, sizeof(line), "[me]: %s", send_buf);
+        conv_add_line(g_active, line, 0);
     }
-    printf("--- Exited chat with %s. ---\n", recipient);
+    printf("--- Exited chat. ---\n");
+    g_active = NULL;
 }
 
 void show_menu() {
@@ -203,6 +568,9 @@ int main() {
     struct sockaddr_in s_add;
     unsigned short portnum = 2333;
 
+    signal(SIGPIPE, SIG_IGN);  // 连接断开后的 send 返回错误，由接收方向发现断线并重连
+    srand(time(NULL) ^ getpid());
+
     cfd = socket(AF_INET, SOCK_STREAM, 0);
     if (-1 == cfd) {
         perror("socket fail");
@@ -220,18 +588,22 @@ int main() {
         return -1;
     }
 
+    g_server_addr = s_add;
+    g_cfd = cfd;
     printf("Connected to server!\n");
 
     int choice = -1;
     while (choice != 0) {
+        char input[64], *end;
         show_menu();
-        if (scanf("%d", &choice) != 1) {
+        // 等输入期间事件循环照常收消息，菜单下收到的消息记为未读
+        get_input("", input, sizeof(input));
+        choice = strtol(input, &end, 10);
+        if (end == input) {
             printf("Invalid input. Please enter a number.\n");
-            while (getchar() != '\n');  // Clear input buffer
             choice = -1;
             continue;
         }
-        while (getchar() != '\n');  // Clear trailing newline
 
         if (g_logged_in) {
             switch (choice) {
@@ -248,7 +620,7 @@ int main() {
                     do_chat(cfd);
                     break;
                 case 7:
-                    do_logout();
+                    do_logout(cfd);
                     break;
                 case 0:
                     break;
@@ -2,400 +2,2906 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_CLIENTS 10
+#define MAX_CLIENTS 1024
 #define BUFFER_SIZE 1024
 #define USERS_FILE "users.txt"
 #define FRIENDS_FILE "friends.txt"
+#define USER_BUCKETS 1024      // 在线用户哈希表的桶数（2的幂）
+#define PRESENCE_WINDOW_MS 500 // 上下线通知的合并窗口
+#define MAX_EVENTS 64
+#define INBUF_SIZE (BUFFER_SIZE * 4)  // 每个连接的接收缓冲区，命令以 '\n' 结尾
+#define OUTBUF_MAX (256 * 1024)       // 发送队列上限，超过按不读数据的慢接收者断开
+#define TURN_BUDGET 8                 // 每个连接每轮最多处理的命令数
+#define THROTTLE_TICK_MS 10           // 被限速的连接多久检查一次令牌
+#define SESSION_RATE 20               // 每个连接每秒补充的令牌
+#define SESSION_BURST 40
+#define IP_RATE 100                   // 同一 IP 的全部连接共享，每秒补充的令牌
+#define IP_BURST 200
+#define IP_BUCKETS 256
+#define SEARCH_PAGE 20          // SEARCH 每页最多返回的用户名数
+#define INDEX_BLOCK 16          // 用户名索引每块的用户名数
+#define INDEX_DELTA_MAX 4096    // 新注册的用户名攒够这么多再并入索引
+#define KDF_WORKERS 4           // 口令哈希工作线程数
+#define KDF_QUEUE_MAX 256       // 最多同时排队的口令哈希任务，满了回复服务器忙
+#define KDF_NICE 10
+#define KDF_LOG2_N 14           // scrypt 参数 N = 2^14, r = 8, p = 1：每次 16MB 内存
+#define KDF_R 8
+#define KDF_P 1
+#define KDF_SALT_LEN 16
+#define KDF_HASH_LEN 32
+#define KDF_RECORD_MAX 160
+#define CRED_CACHE_SLOTS 4096   // 已验证登录缓存的槽数（2的幂）
+#define CONV_BUCKETS 4096       // 对话表的桶数（2的幂）
+#define ACK_WINDOW_MS 200       // DELIVERED/READ 回执的合并窗口
+#define CONV_LOG_MAX 128        // 每个对话保留的未读消息数，会话恢复时重发
+#define RESUME_BUCKETS 4096     // 恢复令牌表的桶数（2的幂）
+#define RESUME_TOKEN_LEN 16
+#define RESUME_TTL_MS (10 * 60 * 1000)  // 连接断开后令牌的有效期
+#define STORE_PAGE 4096         // 用户表文件的页大小
+#define STORE_MEMTABLE_MAX 4096 // 内存表攒够这么多用户写成一个表文件
+#define STORE_MEM_BUCKETS 8192
+#define STORE_FANOUT 4          // 相邻两层表文件的大小比例
+#define STORE_MAX_RUNS 32
+#define STORE_CACHE_MB 4        // 页缓存的默认大小，启动参数 -c 可改
+#define STORE_MAGIC 0x55534c54u
+#define STORE_RUN_FMT "users.%06d.sst"
+#define STORE_MANIFEST "users.manifest"  // 当前有效的表文件，从旧到新
+#define BLOOM_BITS_PER_KEY 10   // 误判率约 1%
+#define BLOOM_K 7
+#define UPGRADE_PATH "task3s.upgrade"  // 热升级时新旧进程交接用的 AF_UNIX 套接字
+#define UPGRADE_MAGIC 0x33535550u
+#define UPGRADE_CHUNK 65536
+#define UPGRADE_TIMEOUT_S 2
+
+typedef struct user_entry user_entry_t;
+typedef struct friend_node friend_node_t;
+typedef struct client_info client_info_t;
+typedef struct conversation conversation_t;
+typedef struct resume resume_t;
+
+// 令牌桶：按时间补充令牌，每条命令按开销扣除，不够时连接进入限速队列
+typedef struct {
+    double tokens;
+    long long last_ms;
+} token_bucket_t;
+
+// 同一 IP 的连接共享的令牌桶，按引用计数释放
+typedef struct ip_limit {
+    in_addr_t addr;
+    token_bucket_t bucket;
+    int refs;
+    struct ip_limit *next;
+} ip_limit_t;
+
+// 热升级：先发一条带监听套接字的头，然后每个连接一条带套接字的状态，
+// 后面跟接收缓冲区和发送队列中的数据（发送队列按 UPGRADE_CHUNK 分成多条）
+typedef struct {
+    unsigned int magic;
+    int n_clients;
+    int n_convs;   // 连接之后是每个对话一条 upgrade_conv_t 和它的未读消息，消息编号在新进程中继续
+    int n_resume;  // 最后是每个等待恢复的令牌一条 upgrade_resume_t
+} upgrade_hdr_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    char username[256];
+    int logged_in, want_presence, eof;
+    double tokens;
+    int in_len, out_len;
+    int has_token;
+    unsigned char token[RESUME_TOKEN_LEN];
+} upgrade_conn_t;
+
+typedef struct {
+    char from[256], to[256];
+    unsigned int next_id, delivered, read, acked_delivered, acked_read;
+    int n_log;  // 后面跟 n_log 条 upgrade_msg_t
+} upgrade_conv_t;
+
+typedef struct {
+    unsigned int id;
+    int len;
+    char frame[BUFFER_SIZE];
+} upgrade_msg_t;
+
+typedef struct {
+    unsigned char token[RESUME_TOKEN_LEN];
+    char username[256];
+    long long expires;
+} upgrade_resume_t;
+
+// 对话日志中的一条消息，frame 是发给接收者的 "MSG$发送者$id$正文"
+typedef struct {
+    unsigned int id;
+    int len;
+    char frame[];
+} conv_msg_t;
+
+// 已放进发送队列、等待写出的 MSG 帧，写完后该对话的 delivered 推进到 id
+typedef struct {
+    conversation_t *conv;
+    unsigned int id;
+    long long end;  // 帧最后一个字节在连接发送流中的位置
+} delivery_t;
 
 typedef struct {
+    client_info_t *head, *tail;
+    int n;
+} conn_queue_t;
+
+struct client_info {
     int sockfd;
     struct sockaddr_in addr;
     char username[256];
     int logged_in;
-} client_info_t;
+    user_entry_t *user;  // 登录后所属的在线用户
+    int want_presence;   // 刚登录，下一个通知窗口发送在线好友快照
+    char in[INBUF_SIZE]; // 收到还没处理的数据
+    int in_len;
+    int eof;             // 对端已关闭写方向，处理完剩下的命令后关闭
+    char *out;           // 等待发送的数据 [out_off, out_len)
+    int out_off, out_len, out_cap;
+    long long out_queued, out_sent;  // 放入发送队列和已经写出的总字节数
+    delivery_t *dlv;     // 按 end 递增的待写出 MSG 帧 [dlv_head, dlv_len)
+    int dlv_head, dlv_len, dlv_cap;
+    unsigned int events; // 当前在 epoll 中关注的事件
+    token_bucket_t bucket;
+    ip_limit_t *ip;
+    int need;            // 被限速时下一条命令需要的令牌
+    conn_queue_t *queue; // 所在的调度队列（就绪或限速），NULL 表示不在队列中
+    client_info_t *q_prev, *q_next;
+    int pending_job;     // 在 KDF 工作线程中还没完成的任务数
+    resume_t *resume;    // 登录时发的恢复令牌
+    int closing;         // 已决定关闭，本轮循环结束时释放
+    client_info_t *next_closing;
+};
+
+// 在线用户表：用户名 -> 该用户当前登录的全部会话（同一账号可以多端同时在线）。
+// MSG 按哈希找到接收者后直接遍历它的会话数组，不扫描全部连接
+struct user_entry {
+    char username[256];
+    client_info_t **sessions;
+    int n_sessions, cap;
+    user_entry_t *next;  // 同一哈希桶的下一个用户
+    char presence[BUFFER_SIZE];  // 本窗口待发给该用户的上下线通知
+    int presence_len;
+    int presence_queued;          // 已在本窗口的通知用户链上
+    user_entry_t *presence_next;  // 本窗口有通知的用户链
+};
+
+// 对话：from 发给 to 的消息按 id 从1连续编号。回执是累积的：delivered 表示 to 的某个会话
+// 已经写出了 id 不超过它的全部消息，read 表示 to 已显示到哪条。变化的对话挂到待回执链上，
+// 每 ACK_WINDOW_MS 给 from 的会话发一帧 "ACK$to$delivered$read"
+struct conversation {
+    char from[256], to[256];
+    unsigned int next_id;
+    unsigned int delivered, read;
+    unsigned int acked_delivered, acked_read;  // 上一次 ACK 帧中的值
+    int dirty;
+    conv_msg_t **log;   // 还没读的消息 [log_head, log_head + log_n)，环形，满了丢最旧的
+    int log_head, log_n;
+    conversation_t *next, *next_dirty;
+    conversation_t *next_inbox, *next_outbox;  // 同一接收者、同一发送者的下一个对话
+};
+
+// 恢复令牌：LOGIN 成功时发给客户端，连接断开后客户端在 RESUME_TTL_MS 内用 "RESUME$令牌"
+// 回到原来的账号，不再验证口令。令牌是随机数，按前几个字节直接定位哈希桶
+struct resume {
+    unsigned char token[RESUME_TOKEN_LEN];
+    char username[256];
+    client_info_t *cl;   // 使用这个令牌的会话，NULL 表示已断开、等待恢复
+    long long expires;   // 断开后的过期时间
+    resume_t *next;
+};
+
+// 好友关系的内存邻接表，启动时从 FRIENDS_FILE 加载，增删好友时同步更新。
+// 上下线通知：用户的第一个会话登录或最后一个会话断开时只把用户挂到待通知链上，
+// 事件循环每 PRESENCE_WINDOW_MS 处理一次：窗口内上线又下线的抵消，每个在线好友
+// 每个窗口只收到一帧 "PRESENCE$+上线者$-下线者..."（放不下时分成几帧）
+struct friend_node {
+    char username[256];
+    friend_node_t **friends;
+    int n_friends, cap;
+    int announced;              // 最近一次通知给好友的状态，1 为在线
+    int dirty;                  // 已在待通知链上
+    int n_resumable;            // 已断开、还能恢复的会话数，这期间发给该用户的消息记在对话日志里
+    conversation_t *inbox;      // 发给该用户的对话
+    conversation_t *outbox;     // 该用户发出的对话
+    friend_node_t *next;        // 同一哈希桶的下一个用户
+    friend_node_t *next_dirty;
+};
+
+// 全局客户端列表、在线用户表、好友邻接表。服务器是单线程事件循环，不需要加锁
+client_info_t *g_clients[MAX_CLIENTS];
+user_entry_t *g_online[USER_BUCKETS];
+friend_node_t *g_friend_graph[USER_BUCKETS];
+friend_node_t *g_presence_dirty;
+ip_limit_t *g_ip_limits[IP_BUCKETS];
+conversation_t *g_convs[CONV_BUCKETS];
+conversation_t *g_ack_dirty;
+int g_n_convs;
+resume_t *g_resume[RESUME_BUCKETS];
+int g_n_resume;
+
+// 调度：有完整命令的连接在就绪队列中轮转，每轮最多处理 TURN_BUDGET 条后排到队尾；
+// 令牌不够的连接放到限速队列，期间不再读它的套接字，接收缓冲区满后由 TCP 流控让对端慢下来
+int g_epfd = -1;
+int g_upgrade_fd = -1;
+conn_queue_t g_ready, g_throttled;
+client_info_t *g_closing;
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int add_client(client_info_t *cl) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!g_clients[i]) {
+            g_clients[i] = cl;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 字符串哈希（FNV-1a）
+unsigned int hash_name(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+// 查找在线用户，create 为真时不存在就新建
+user_entry_t *online_lookup(const char *username, int create) {
+    user_entry_t **pp = &g_online[hash_name(username) & (USER_BUCKETS - 1)];
+    for (user_entry_t *u = *pp; u; u = u->next) {
+        if (strcmp(u->username, username) == 0) return u;
+    }
+    if (!create) return NULL;
+    user_entry_t *u = calloc(1, sizeof(user_entry_t));
+    if (!u) return NULL;
+    snprintf(u->username, sizeof(u->username), "%s", username);
+    u->next = *pp;
+    *pp = u;
+    return u;
+}
+
+// 查找好友邻接表中的用户，create 为真时不存在就新建
+friend_node_t *graph_node(const char *username, int create) {
+    friend_node_t **pp = &g_friend_graph[hash_name(username) & (USER_BUCKETS - 1)];
+    for (friend_node_t *n = *pp; n; n = n->next) {
+        if (strcmp(n->username, username) == 0) return n;
+    }
+    if (!create) return NULL;
+    friend_node_t *n = calloc(1, sizeof(friend_node_t));
+    if (!n) return NULL;
+    snprintf(n->username, sizeof(n->username), "%s", username);
+    n->announced = online_lookup(username, 0) != NULL;  // 在线时才加第一个好友的用户，下线仍要通知
+    n->next = *pp;
+    *pp = n;
+    return n;
+}
+
+int graph_has_edge(const friend_node_t *a, const friend_node_t *b) {
+    for (int i = 0; a && b && i < a->n_friends; i++) {
+        if (a->friends[i] == b) return 1;
+    }
+    return 0;
+}
+
+static int graph_add_edge(friend_node_t *a, friend_node_t *b) {
+    if (a->n_friends == a->cap) {
+        int cap = a->cap ? a->cap * 2 : 4;
+        friend_node_t **f = realloc(a->friends, cap * sizeof(friend_node_t *));
+        if (!f) return -1;
+        a->friends = f;
+        a->cap = cap;
+    }
+    a->friends[a->n_friends++] = b;
+    return 0;
+}
+
+static void graph_del_edge(friend_node_t *a, friend_node_t *b) {
+    for (int i = 0; i < a->n_friends; i++) {
+        if (a->friends[i] == b) {
+            a->friends[i] = a->friends[--a->n_friends];
+            return;
+        }
+    }
+}
+
+// 建立双向好友关系，已经是好友时返回0
+int graph_link(const char *user1, const char *user2) {
+    friend_node_t *a = graph_node(user1, 1), *b = graph_node(user2, 1);
+    if (!a || !b) return -1;
+    if (graph_has_edge(a, b)) return 0;
+    if (graph_add_edge(a, b) != 0) return -1;
+    if (graph_add_edge(b, a) != 0) {
+        graph_del_edge(a, b);
+        return -1;
+    }
+    return 1;
+}
+
+void graph_unlink(const char *user1, const char *user2) {
+    friend_node_t *a = graph_node(user1, 0), *b = graph_node(user2, 0);
+    if (!a || !b) return;
+    graph_del_edge(a, b);
+    graph_del_edge(b, a);
+}
+
+// 启动时加载好友文件
+int friends_load(void) {
+    FILE *fp = fopen(FRIENDS_FILE, "r");
+    if (!fp) return 0;
+    char line[512];
+    int n = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char u1[256], u2[256];
+        if (sscanf(line, "%255s %255s", u1, u2) == 2 && graph_link(u1, u2) > 0) n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+// 用户在线状态可能变了，挂到待通知链上（没有好友的用户不需要通知）
+void presence_mark(const char *username) {
+    friend_node_t *n = graph_node(username, 0);
+    if (n && !n->dirty) {
+        n->dirty = 1;
+        n->next_dirty = g_presence_dirty;
+        g_presence_dirty = n;
+    }
+}
+
+// 查找 from -> to 的对话，create 为真时不存在就新建
+conversation_t *conv_lookup(const char *from, const char *to, int create) {
+    conversation_t **pp = &g_convs[(hash_name(from) * 31 + hash_name(to)) & (CONV_BUCKETS - 1)];
+    for (conversation_t *cv = *pp; cv; cv = cv->next) {
+        if (strcmp(cv->from, from) == 0 && strcmp(cv->to, to) == 0) return cv;
+    }
+    if (!create) return NULL;
+    conversation_t *cv = calloc(1, sizeof(conversation_t));
+    if (!cv) return NULL;
+    snprintf(cv->from, sizeof(cv->from), "%s", from);
+    snprintf(cv->to, sizeof(cv->to), "%s", to);
+    cv->next_id = 1;
+    cv->next = *pp;
+    *pp = cv;
+    g_n_convs++;
+    friend_node_t *n = graph_node(to, 1), *m = graph_node(from, 1);
+    if (n) {
+        cv->next_inbox = n->inbox;
+        n->inbox = cv;
+    }
+    if (m) {
+        cv->next_outbox = m->outbox;
+        m->outbox = cv;
+    }
+    return cv;
+}
+
+static conv_msg_t *conv_log_at(const conversation_t *cv, int i) {
+    return cv->log[(cv->log_head + i) % CONV_LOG_MAX];
+}
+
+static void conv_log_pop(conversation_t *cv) {
+    free(cv->log[cv->log_head]);
+    cv->log_head = (cv->log_head + 1) % CONV_LOG_MAX;
+    cv->log_n--;
+}
+
+// 记下一条消息，接收者读到之前都可以重发
+void conv_log(conversation_t *cv, unsigned int id, const char *frame, int len) {
+    if (!cv->log && !(cv->log = calloc(CONV_LOG_MAX, sizeof(conv_msg_t *)))) return;
+    conv_msg_t *m = malloc(sizeof(conv_msg_t) + len);
+    if (!m) return;
+    m->id = id;
+    m->len = len;
+    memcpy(m->frame, frame, len);
+    if (cv->log_n == CONV_LOG_MAX) conv_log_pop(cv);
+    cv->log[(cv->log_head + cv->log_n++) % CONV_LOG_MAX] = m;
+}
+
+// 丢掉已读的消息
+static void conv_log_trim(conversation_t *cv) {
+    while (cv->log_n > 0 && conv_log_at(cv, 0)->id <= cv->read) conv_log_pop(cv);
+}
+
+// 推进对话的回执进度（只增不减，已读蕴含已送达），有变化时挂到待回执链上
+void conv_advance(conversation_t *cv, unsigned int delivered, unsigned int read) {
+    if (read >= cv->next_id) read = cv->next_id - 1;
+    if (delivered < read) delivered = read;
+    if (delivered >= cv->next_id) delivered = cv->next_id - 1;
+    if (delivered <= cv->delivered && read <= cv->read) return;
+    if (delivered > cv->delivered) cv->delivered = delivered;
+    if (read > cv->read) {
+        cv->read = read;
+        conv_log_trim(cv);
+    }
+    if (!cv->dirty) {
+        cv->dirty = 1;
+        cv->next_dirty = g_ack_dirty;
+        g_ack_dirty = cv;
+    }
+}
+
+// 用户在线，或者有断开后还能恢复的会话
+static int user_active(const char *username) {
+    friend_node_t *n = graph_node(username, 0);
+    return online_lookup(username, 0) || (n && n->n_resumable > 0);
+}
+
+// 对话两端都不在线也不能恢复、日志已清空、回执也处理完了：没人会再用到它，释放掉，再有消息时重新从1编号
+static void conv_free_idle(conversation_t *cv) {
+    if (cv->dirty || cv->log_n > 0 || user_active(cv->from) || user_active(cv->to)) return;
+    conversation_t **pp = &g_convs[(hash_name(cv->from) * 31 + hash_name(cv->to)) & (CONV_BUCKETS - 1)];
+    while (*pp != cv) pp = &(*pp)->next;
+    *pp = cv->next;
+    friend_node_t *n = graph_node(cv->to, 0), *m = graph_node(cv->from, 0);
+    for (pp = n ? &n->inbox : NULL; pp && *pp; pp = &(*pp)->next_inbox) {
+        if (*pp == cv) {
+            *pp = cv->next_inbox;
+            break;
+        }
+    }
+    for (pp = m ? &m->outbox : NULL; pp && *pp; pp = &(*pp)->next_outbox) {
+        if (*pp == cv) {
+            *pp = cv->next_outbox;
+            break;
+        }
+    }
+    g_n_convs--;
+    free(cv->log);
+    free(cv);
+}
+
+// 用户已离线且没有可恢复的会话：发给他的对话日志没人会再来取，释放掉，再释放他参与的、已经空闲的对话
+void inbox_release(const char *username) {
+    friend_node_t *n = graph_node(username, 0);
+    if (!n || user_active(username)) return;
+    for (conversation_t *cv = n->inbox, *next; cv; cv = next) {
+        next = cv->next_inbox;
+        while (cv->log_n > 0) conv_log_pop(cv);
+        free(cv->log);
+        cv->log = NULL;
+        cv->log_head = 0;
+        conv_free_idle(cv);
+    }
+    for (conversation_t *cv = n->outbox, *next; cv; cv = next) {
+        next = cv->next_outbox;
+        conv_free_idle(cv);
+    }
+}
+
+// 会话从所属用户的会话数组中移除，用户没有会话了就从在线表删除
+void session_detach(client_info_t *cl) {
+    user_entry_t *u = cl->user;
+    if (!u) return;
+    for (int i = 0; i < u->n_sessions; i++) {
+        if (u->sessions[i] == cl) {
+            u->sessions[i] = u->sessions[--u->n_sessions];
+            break;
+        }
+    }
+    cl->user = NULL;
+    cl->logged_in = 0;
+    cl->dlv_head = cl->dlv_len = 0;  // 离开账号后不再为它推进送达回执，对话可能随后被释放
+    if (u->n_sessions > 0) return;
+    presence_mark(u->username);
+    for (user_entry_t **pp = &g_online[hash_name(u->username) & (USER_BUCKETS - 1)]; *pp; pp = &(*pp)->next) {
+        if (*pp == u) {
+            *pp = u->next;
+            break;
+        }
+    }
+    inbox_release(u->username);
+    free(u->sessions);
+    free(u);
+}
+
+// 登录成功：会话加入该用户的会话集合（同一连接换账号登录时先离开原账号）
+int session_attach(client_info_t *cl, const char *username) {
+    session_detach(cl);
+    user_entry_t *u = online_lookup(username, 1);
+    if (u && u->n_sessions == u->cap) {
+        int cap = u->cap ? u->cap * 2 : 2;
+        client_info_t **s = realloc(u->sessions, cap * sizeof(client_info_t *));
+        if (s) {
+            u->sessions = s;
+            u->cap = cap;
+        }
+    }
+    if (u && u->n_sessions < u->cap) {
+        u->sessions[u->n_sessions++] = cl;
+        snprintf(cl->username, sizeof(cl->username), "%s", username);
+        cl->user = u;
+        cl->logged_in = 1;
+        cl->want_presence = 1;
+        if (u->n_sessions == 1) presence_mark(username);
+        return 0;
+    }
+    if (u && u->n_sessions == 0) {
+        session_detach(cl);  // 新建的空用户项
+    }
+    return -1;
+}
+
+static void queue_push(conn_queue_t *q, client_info_t *cl) {
+    cl->queue = q;
+    cl->q_next = NULL;
+    cl->q_prev = q->tail;
+    if (q->tail) {
+        q->tail->q_next = cl;
+    } else {
+        q->head = cl;
+    }
+    q->tail = cl;
+    q->n++;
+}
+
+static void queue_remove(client_info_t *cl) {
+    conn_queue_t *q = cl->queue;
+    if (!q) return;
+    if (cl->q_prev) {
+        cl->q_prev->q_next = cl->q_next;
+    } else {
+        q->head = cl->q_next;
+    }
+    if (cl->q_next) {
+        cl->q_next->q_prev = cl->q_prev;
+    } else {
+        q->tail = cl->q_prev;
+    }
+    q->n--;
+    cl->queue = NULL;
+    cl->q_prev = cl->q_next = NULL;
+}
+
+// 按经过的时间补充令牌，不超过桶容量
+static void bucket_refill(token_bucket_t *b, double rate, double burst, long long now) {
+    b->tokens += (now - b->last_ms) * rate / 1000.0;
+    if (b->tokens > burst) b->tokens = burst;
+    b->last_ms = now;
+}
+
+// 连接自己和所在 IP 的令牌都够 cost 时返回1，take 为真时同时扣除
+int bucket_check(client_info_t *cl, int cost, int take, long long now) {
+    bucket_refill(&cl->bucket, SESSION_RATE, SESSION_BURST, now);
+    bucket_refill(&cl->ip->bucket, IP_RATE, IP_BURST, now);
+    if (cl->bucket.tokens < cost || cl->ip->bucket.tokens < cost) return 0;
+    if (take) {
+        cl->bucket.tokens -= cost;
+        cl->ip->bucket.tokens -= cost;
+    }
+    return 1;
+}
+
+static unsigned int ip_slot(in_addr_t addr) {
+    return ((unsigned int)addr * 2654435761u) >> 24 & (IP_BUCKETS - 1);
+}
+
+// 取得（没有就新建）该 IP 的共享令牌桶
+ip_limit_t *ip_limit_get(in_addr_t addr, long long now) {
+    ip_limit_t **pp = &g_ip_limits[ip_slot(addr)];
+    for (ip_limit_t *l = *pp; l; l = l->next) {
+        if (l->addr == addr) {
+            l->refs++;
+            return l;
+        }
+    }
+    ip_limit_t *l = calloc(1, sizeof(ip_limit_t));
+    if (!l) return NULL;
+    l->addr = addr;
+    l->bucket.tokens = IP_BURST;
+    l->bucket.last_ms = now;
+    l->refs = 1;
+    l->next = *pp;
+    *pp = l;
+    return l;
+}
+
+void ip_limit_put(ip_limit_t *l) {
+    if (!l || --l->refs > 0) return;
+    for (ip_limit_t **pp = &g_ip_limits[ip_slot(l->addr)]; *pp; pp = &(*pp)->next) {
+        if (*pp == l) {
+            *pp = l->next;
+            break;
+        }
+    }
+    free(l);
+}
+
+// 标记连接关闭：立即移出调度队列，释放推迟到本轮循环结束（其他连接的命令可能还在遍历它）
+void conn_close(client_info_t *cl, const char *reason) {
+    if (cl->closing) return;
+    printf("Client %s:%d %s\n", inet_ntoa(cl->addr.sin_addr), ntohs(cl->addr.sin_port), reason);
+    cl->closing = 1;
+    queue_remove(cl);
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, cl->sockfd, NULL);
+    cl->next_closing = g_closing;
+    g_closing = cl;
+}
+
+// 按接收缓冲区和发送队列的状态更新 epoll 关注的事件
+void conn_update_events(client_info_t *cl) {
+    unsigned int events = 0;
+    if (!cl->eof && cl->in_len < INBUF_SIZE) events |= EPOLLIN;
+    if (cl->out_off < cl->out_len) events |= EPOLLOUT;
+    if (events == cl->events) return;
+    struct epoll_event ev = {.events = events, .data.ptr = cl};
+    epoll_ctl(g_epfd, EPOLL_CTL_MOD, cl->sockfd, &ev);
+    cl->events = events;
+}
+
+// 尽量发出发送队列中的数据，剩下的等 EPOLLOUT
+void conn_flush(client_info_t *cl) {
+    while (cl->out_off < cl->out_len) {
+        ssize_t n = send(cl->sockfd, cl->out + cl->out_off, cl->out_len - cl->out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            cl->out_off += n;
+            cl->out_sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            conn_close(cl, "send error");
+            return;
+        }
+    }
+    if (cl->out_off == cl->out_len) cl->out_off = cl->out_len = 0;
+    // 整帧写进内核的 MSG 算送达
+    while (cl->dlv_head < cl->dlv_len && cl->dlv[cl->dlv_head].end <= cl->out_sent) {
+        delivery_t *d = &cl->dlv[cl->dlv_head++];
+        conv_advance(d->conv, d->id, 0);
+    }
+    if (cl->dlv_head == cl->dlv_len) cl->dlv_head = cl->dlv_len = 0;
+    conn_update_events(cl);
+}
+
+// 把一帧（自动加 '\n'）放入发送队列并尝试立即发送。队列超过 OUTBUF_MAX 的连接断开
+int conn_send(client_info_t *cl, const char *frame, int len) {
+    if (cl->closing) return -1;
+    int pending = cl->out_len - cl->out_off;
+    if (pending + len + 1 > OUTBUF_MAX) {
+        conn_close(cl, "send queue overflow");
+        return -1;
+    }
+    if (cl->out_len + len + 1 > cl->out_cap && cl->out_off > 0) {
+        memmove(cl->out, cl->out + cl->out_off, pending);
+        cl->out_off = 0;
+        cl->out_len = pending;
+    }
+    if (cl->out_len + len + 1 > cl->out_cap) {
+        int cap = cl->out_cap ? cl->out_cap : BUFFER_SIZE;
+        while (cap < cl->out_len + len + 1) cap *= 2;
+        char *out = realloc(cl->out, cap);
+        if (!out) {
+            conn_close(cl, "out of memory");
+            return -1;
+        }
+        cl->out = out;
+        cl->out_cap = cap;
+    }
+    memcpy(cl->out + cl->out_len, frame, len);
+    cl->out_len += len;
+    cl->out[cl->out_len++] = '\n';
+    cl->out_queued += len + 1;
+    if (pending == 0) conn_flush(cl);
+    return cl->closing ? -1 : 0;
+}
+
+void reply(client_info_t *cl, const char *msg) {
+    conn_send(cl, msg, strlen(msg));
+}
+
+// 把同一帧发给用户的所有会话（except 除外），返回发出的会话数
+int deliver_to_user(const char *username, const char *frame, int len, const client_info_t *except) {
+    int n = 0;
+    user_entry_t *u = online_lookup(username, 0);
+    for (int i = 0; u && i < u->n_sessions; i++) {
+        if (u->sessions[i] != except && conn_send(u->sessions[i], frame, len) == 0) n++;
+    }
+    return n;
+}
+
+// 发送对话中编号为 id 的 MSG 帧，写出后推进该对话的 delivered
+int conn_send_msg(client_info_t *cl, const char *frame, int len, conversation_t *cv, unsigned int id) {
+    if (cl->closing) return -1;
+    if (cl->dlv_len == cl->dlv_cap) {
+        if (cl->dlv_head > 0) {
+            memmove(cl->dlv, cl->dlv + cl->dlv_head, (cl->dlv_len - cl->dlv_head) * sizeof(delivery_t));
+            cl->dlv_len -= cl->dlv_head;
+            cl->dlv_head = 0;
+        } else {
+            int cap = cl->dlv_cap ? cl->dlv_cap * 2 : 16;
+            delivery_t *d = realloc(cl->dlv, cap * sizeof(delivery_t));
+            if (!d) return conn_send(cl, frame, len);  // 只是少一个送达回执
+            cl->dlv = d;
+            cl->dlv_cap = cap;
+        }
+    }
+    cl->dlv[cl->dlv_len++] = (delivery_t){cv, id, cl->out_queued + len + 1};
+    return conn_send(cl, frame, len);
+}
+
+// 把发给该会话用户的未读消息按编号重发一遍，客户端按编号去重
+int conv_replay(client_info_t *cl) {
+    friend_node_t *n = graph_node(cl->username, 0);
+    int sent = 0;
+    for (conversation_t *cv = n ? n->inbox : NULL; cv; cv = cv->next_inbox) {
+        for (int i = 0; i < cv->log_n && !cl->closing; i++) {
+            conv_msg_t *m = conv_log_at(cv, i);
+            if (conn_send_msg(cl, m->frame, m->len, cv, m->id) == 0) sent++;
+        }
+    }
+    return sent;
+}
+
+static unsigned int resume_slot(const unsigned char *token) {
+    return ((unsigned int)token[0] | token[1] << 8 | token[2] << 16) & (RESUME_BUCKETS - 1);
+}
+
+resume_t *resume_find(const unsigned char *token) {
+    for (resume_t *r = g_resume[resume_slot(token)]; r; r = r->next) {
+        unsigned char diff = 0;
+        for (int i = 0; i < RESUME_TOKEN_LEN; i++) diff |= r->token[i] ^ token[i];
+        if (diff == 0) return r;
+    }
+    return NULL;
+}
+
+// 登记一个令牌，cl 为 NULL 表示会话已断开、expires 之前可以恢复
+resume_t *resume_insert(const unsigned char *token, const char *username, client_info_t *cl, long long expires) {
+    resume_t *r = calloc(1, sizeof(resume_t));
+    if (!r) return NULL;
+    memcpy(r->token, token, RESUME_TOKEN_LEN);
+    snprintf(r->username, sizeof(r->username), "%s", username);
+    r->cl = cl;
+    r->expires = expires;
+    if (cl) {
+        cl->resume = r;
+    } else {
+        friend_node_t *n = graph_node(username, 1);
+        if (n) n->n_resumable++;
+    }
+    resume_t **pp = &g_resume[resume_slot(token)];
+    r->next = *pp;
+    *pp = r;
+    g_n_resume++;
+    return r;
+}
+
+// 会话断开：令牌转为等待恢复
+static void resume_park(client_info_t *cl, long long now) {
+    resume_t *r = cl->resume;
+    if (!r) return;
+    cl->resume = NULL;
+    r->cl = NULL;
+    r->expires = now + RESUME_TTL_MS;
+    friend_node_t *n = graph_node(r->username, 1);
+    if (n) n->n_resumable++;
+}
+
+// 令牌被恢复的会话接管
+static void resume_claim(resume_t *r, client_info_t *cl) {
+    if (r->cl) {
+        r->cl->resume = NULL;  // 服务器还没发现旧连接已断
+        conn_close(r->cl, "session resumed elsewhere");
+    } else {
+        friend_node_t *n = graph_node(r->username, 0);
+        if (n && n->n_resumable > 0) n->n_resumable--;
+    }
+    r->cl = cl;
+    cl->resume = r;
+}
+
+void resume_free(resume_t *r) {
+    for (resume_t **pp = &g_resume[resume_slot(r->token)]; *pp; pp = &(*pp)->next) {
+        if (*pp == r) {
+            *pp = r->next;
+            break;
+        }
+    }
+    g_n_resume--;
+    if (r->cl) {
+        r->cl->resume = NULL;
+    } else {
+        friend_node_t *n = graph_node(r->username, 0);
+        if (n && n->n_resumable > 0) n->n_resumable--;
+        inbox_release(r->username);
+    }
+    free(r);
+}
+
+// 释放过期的令牌
+void resume_sweep(long long now) {
+    for (int b = 0; b < RESUME_BUCKETS; b++) {
+        for (resume_t *r = g_resume[b], *next; r; r = next) {
+            next = r->next;
+            if (!r->cl && r->expires <= now) resume_free(r);
+        }
+    }
+}
+
+void remove_client(client_info_t *cl) {
+    resume_park(cl, now_ms());
+    session_detach(cl);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (g_clients[i] == cl) {
+            g_clients[i] = NULL;
+            break;
+        }
+    }
+}
+
+static void send_sessions(user_entry_t *u, const char *frame, int len) {
+    for (int i = 0; i < u->n_sessions; i++) {
+        conn_send(u->sessions[i], frame, len);
+    }
+}
+
+// 向用户的会话发出本窗口的通知帧。刚登录的会话跳过，窗口末尾的在线好友快照已经反映了这些变化
+static void presence_send(user_entry_t *u) {
+    for (int i = 0; i < u->n_sessions; i++) {
+        if (!u->sessions[i]->want_presence) conn_send(u->sessions[i], u->presence, u->presence_len);
+    }
+}
+
+// 把一条 "+用户" / "-用户" 追加到接收者本窗口的通知帧，放不下时先发出已有的部分再重新开始一帧。
+// 接收者每个窗口只进一次通知用户链
+static user_entry_t *presence_append(user_entry_t *to, user_entry_t *touched, const char *username, int online) {
+    int need = strlen(username) + 2;
+    if (to->presence_len > 0 && to->presence_len + need >= BUFFER_SIZE) {
+        presence_send(to);
+        to->presence_len = 0;
+    }
+    if (to->presence_len == 0) to->presence_len = snprintf(to->presence, BUFFER_SIZE, "PRESENCE");
+    if (!to->presence_queued) {
+        to->presence_queued = 1;
+        to->presence_next = touched;
+        touched = to;
+    }
+    to->presence_len += snprintf(to->presence + to->presence_len, BUFFER_SIZE - to->presence_len, "$%c%s",
+                                 online ? '+' : '-', username);
+    return touched;
+}
+
+// 处理一个窗口内积累的上下线变化和新会话的在线好友快照
+void presence_flush(void) {
+    user_entry_t *touched = NULL;
+    char frame[BUFFER_SIZE];
+
+    friend_node_t *dirty = g_presence_dirty;
+    g_presence_dirty = NULL;
+    for (friend_node_t *n = dirty; n; n = n->next_dirty) {
+        n->dirty = 0;
+        int online = online_lookup(n->username, 0) != NULL;
+        if (online == n->announced) continue;  // 窗口内上线又下线
+        n->announced = online;
+        for (int i = 0; i < n->n_friends; i++) {
+            user_entry_t *to = online_lookup(n->friends[i]->username, 0);
+            if (to) touched = presence_append(to, touched, n->username, online);
+        }
+    }
+    for (user_entry_t *u = touched; u; u = u->presence_next) {
+        presence_send(u);
+        u->presence_len = 0;
+        u->presence_queued = 0;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        client_info_t *cl = g_clients[i];
+        if (!cl || !cl->want_presence) continue;
+        cl->want_presence = 0;
+        friend_node_t *n = graph_node(cl->username, 0);
+        int len = snprintf(frame, sizeof(frame), "PRESENCE");
+        for (int j = 0; n && j < n->n_friends; j++) {
+            const char *f = n->friends[j]->username;
+            if (!online_lookup(f, 0)) continue;
+            if (len + strlen(f) + 2 >= sizeof(frame)) {
+                conn_send(cl, frame, len);
+                len = snprintf(frame, sizeof(frame), "PRESENCE");
+            }
+            len += snprintf(frame + len, sizeof(frame) - len, "$+%s", f);
+        }
+        if (len > 8) conn_send(cl, frame, len);
+    }
+}
+
+// 用户名索引：全部用户名排序去重后每 INDEX_BLOCK 个一块做前缀压缩（front coding），
+// 每条存 [与上一条的公共前缀长度][后缀长度][后缀]，块首的公共前缀为0，就是完整用户名。
+// 查找时按块首二分定位，再从那一块顺序解码。索引建好后注册的用户先放进小的有序数组
+// g_names_delta，满 INDEX_DELTA_MAX 个后和索引归并重建
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+    unsigned int *blocks;  // 每块在 data 中的偏移
+    int n_blocks, block_cap;
+    int n_names;
+} name_index_t;
+
+typedef struct {
+    const name_index_t *ix;
+    size_t pos;  // 下一条在 data 中的偏移
+    char name[256];
+    int valid;
+} name_iter_t;
+
+name_index_t g_names;
+char **g_names_delta;
+int g_n_delta, g_delta_cap;
+
+// 把一个用户名追加到索引末尾，调用者保证按升序追加；prev 保存上一个追加的用户名
+static int index_append(name_index_t *ix, const char *name, char *prev) {
+    int n = strlen(name);
+    if (n > 255) n = 255;
+    if (ix->n_names > 0 && strncmp(prev, name, n) == 0 && prev[n] == '\0') return 0;  // 重复
+    int shared = 0;
+    if (ix->n_names % INDEX_BLOCK == 0) {
+        if (ix->n_blocks == ix->block_cap) {
+            int cap = ix->block_cap ? ix->block_cap * 2 : 1024;
+            unsigned int *b = realloc(ix->blocks, cap * sizeof(unsigned int));
+            if (!b) return -1;
+            ix->blocks = b;
+            ix->block_cap = cap;
+        }
+        ix->blocks[ix->n_blocks++] = ix->len;
+    } else {
+        while (shared < n && prev[shared] == name[shared]) shared++;
+    }
+    if (ix->len + 2 + n - shared > ix->cap) {
+        size_t cap = ix->cap ? ix->cap * 2 : 65536;
+        while (cap < ix->len + 2 + n - shared) cap *= 2;
+        unsigned char *d = realloc(ix->data, cap);
+        if (!d) return -1;
+        ix->data = d;
+        ix->cap = cap;
+    }
+    ix->data[ix->len++] = shared;
+    ix->data[ix->len++] = n - shared;
+    memcpy(ix->data + ix->len, name + shared, n - shared);
+    ix->len += n - shared;
+    memcpy(prev, name, n);
+    prev[n] = '\0';
+    ix->n_names++;
+    return 0;
+}
+
+static void index_free(name_index_t *ix) {
+    free(ix->data);
+    free(ix->blocks);
+    memset(ix, 0, sizeof(*ix));
+}
+
+// 解码下一条用户名，到末尾时 valid 为0
+static void iter_next(name_iter_t *it) {
+    const name_index_t *ix = it->ix;
+    it->valid = it->pos < ix->len;
+    if (!it->valid) return;
+    int shared = ix->data[it->pos], n = ix->data[it->pos + 1];
+    memcpy(it->name + shared, ix->data + it->pos + 2, n);
+    it->name[shared + n] = '\0';
+    it->pos += 2 + n;
+}
+
+// 定位到第一个不小于 key 的用户名（strict 为真时是第一个大于 key 的）
+static void iter_seek(const name_index_t *ix, name_iter_t *it, const char *key, int strict) {
+    int lo = 0, hi = ix->n_blocks - 1, start = 0;
+    it->ix = ix;
+    while (lo <= hi) {  // 最后一个块首 <= key 的块
+        int mid = (lo + hi) / 2;
+        it->pos = ix->blocks[mid];
+        iter_next(it);
+        if (strcmp(it->name, key) <= 0) {
+            start = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    it->pos = ix->n_blocks > 0 ? ix->blocks[start] : 0;
+    do {
+        iter_next(it);
+    } while (it->valid && (strict ? strcmp(it->name, key) <= 0 : strcmp(it->name, key) < 0));
+}
+
+// 有序数组中第一个不小于（strict 时大于）key 的位置
+static int delta_seek(const char *key, int strict) {
+    int lo = 0, hi = g_n_delta;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(g_names_delta[mid], key);
+        if (c < 0 || (strict && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// 新索引和 g_names_delta 归并成一个新的索引
+static int names_merge(void) {
+    name_index_t ix = {0};
+    name_iter_t it = {.ix = &g_names};
+    char prev[256] = "";
+    int d = 0;
+    iter_next(&it);
+    while (it.valid || d < g_n_delta) {
+        int from_delta = !it.valid || (d < g_n_delta && strcmp(g_names_delta[d], it.name) < 0);
+        if (index_append(&ix, from_delta ? g_names_delta[d] : it.name, prev) != 0) {
+            index_free(&ix);
+            return -1;
+        }
+        if (from_delta) {
+            d++;
+        } else {
+            iter_next(&it);
+        }
+    }
+    index_free(&g_names);
+    g_names = ix;
+    for (int i = 0; i < g_n_delta; i++) free(g_names_delta[i]);
+    g_n_delta = 0;
+    return 0;
+}
+
+// 注册的新用户加入索引
+void names_add(const char *username) {
+    int pos = delta_seek(username, 0);
+    if (pos < g_n_delta && strcmp(g_names_delta[pos], username) == 0) return;
+    if (g_n_delta == g_delta_cap) {
+        int cap = g_delta_cap ? g_delta_cap * 2 : 64;
+        char **d = realloc(g_names_delta, cap * sizeof(char *));
+        if (!d) return;
+        g_names_delta = d;
+        g_delta_cap = cap;
+    }
+    char *name = strdup(username);
+    if (!name) return;
+    memmove(g_names_delta + pos + 1, g_names_delta + pos, (g_n_delta - pos) * sizeof(char *));
+    g_names_delta[pos] = name;
+    g_n_delta++;
+    if (g_n_delta >= INDEX_DELTA_MAX) names_merge();
+}
+
+// 用户表：小型 LSM。最近的写入在内存表里（同时追加到 USERS_FILE 作为预写日志），
+// 攒够 STORE_MEMTABLE_MAX 个写成一个按用户名排序的表文件，日志随之清空。表文件由定长页组成，
+// 每页放若干条 "用户名\0口令记录\0"；文件尾部是布隆过滤器和每页第一个用户名，打开时读进内存。
+// 查找依次查内存表和各层表文件（新的在前）：布隆过滤器说没有就不碰磁盘，否则二分定位到一页，
+// 经页缓存读这一页。相邻两层大小相差不到 STORE_FANOUT 倍时合并成一层，同一用户以新的为准
+typedef struct mem_entry {
+    char *name, *record;
+    struct mem_entry *next;
+} mem_entry_t;
+
+typedef struct {
+    unsigned int magic;
+    int n_pages;
+    long long n_entries;
+    unsigned int bloom_bits;
+    unsigned int index_len;
+} run_footer_t;
+
+typedef struct {
+    int id;
+    int fd;
+    int n_pages;
+    long long n_entries;
+    unsigned char *bloom;
+    unsigned int bloom_bits;
+    char *index;        // 每页第一个用户名，'\0' 分隔
+    char **first_keys;
+} store_run_t;
+
+typedef struct cache_page {
+    int run_id, page;
+    struct cache_page *hnext;        // 同一哈希桶
+    struct cache_page *prev, *next;  // LRU 链，表头最近用过
+    char data[STORE_PAGE];
+} cache_page_t;
+
+mem_entry_t *g_memtable[STORE_MEM_BUCKETS];
+int g_mem_n;
+store_run_t *g_runs[STORE_MAX_RUNS];  // 从旧到新
+int g_n_runs, g_next_run_id = 1;
+cache_page_t **g_cache;
+cache_page_t *g_lru_head, *g_lru_tail;
+int g_cache_cap, g_cache_n, g_cache_buckets;
+long long g_store_lookups, g_store_page_reads, g_store_disk_reads;
+
+static unsigned int hash2_name(const char *s) {
+    unsigned int h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h | 1;
+}
+
+static void bloom_add(unsigned char *bits, unsigned int n, const char *name) {
+    unsigned int h1 = hash_name(name), h2 = hash2_name(name);
+    for (int i = 0; i < BLOOM_K; i++, h1 += h2) bits[(h1 % n) / 8] |= 1 << (h1 % n % 8);
+}
+
+static int bloom_maybe(const unsigned char *bits, unsigned int n, const char *name) {
+    unsigned int h1 = hash_name(name), h2 = hash2_name(name);
+    for (int i = 0; i < BLOOM_K; i++, h1 += h2) {
+        if (!(bits[(h1 % n) / 8] & 1 << (h1 % n % 8))) return 0;
+    }
+    return 1;
+}
+
+static mem_entry_t *mem_lookup(const char *name) {
+    for (mem_entry_t *e = g_memtable[hash_name(name) & (STORE_MEM_BUCKETS - 1)]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) return e;
+    }
+    return NULL;
+}
+
+static int mem_put(const char *name, const char *record) {
+    mem_entry_t *e = mem_lookup(name);
+    char *r = strdup(record);
+    if (!r) return -1;
+    if (e) {
+        free(e->record);
+        e->record = r;
+        return 0;
+    }
+    if (!(e = calloc(1, sizeof(mem_entry_t))) || !(e->name = strdup(name))) {
+        free(e);
+        free(r);
+        return -1;
+    }
+    e->record = r;
+    mem_entry_t **pp = &g_memtable[hash_name(name) & (STORE_MEM_BUCKETS - 1)];
+    e->next = *pp;
+    *pp = e;
+    g_mem_n++;
+    return 0;
+}
+
+static void mem_clear(void) {
+    for (int b = 0; b < STORE_MEM_BUCKETS; b++) {
+        while (g_memtable[b]) {
+            mem_entry_t *e = g_memtable[b];
+            g_memtable[b] = e->next;
+            free(e->name);
+            free(e->record);
+            free(e);
+        }
+    }
+    g_mem_n = 0;
+}
+
+static void run_path(int id, char *path, size_t size) {
+    snprintf(path, size, STORE_RUN_FMT, id);
+}
+
+static void run_close(store_run_t *r) {
+    if (!r) return;
+    if (r->fd >= 0) close(r->fd);
+    free(r->bloom);
+    free(r->index);
+    free(r->first_keys);
+    free(r);
+}
+
+// 打开表文件，读入尾部的布隆过滤器和页索引
+store_run_t *run_open(int id) {
+    char path[64];
+    run_path(id, path, sizeof(path));
+    store_run_t *r = calloc(1, sizeof(store_run_t));
+    if (!r) return NULL;
+    r->id = id;
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    run_footer_t f;
+    if (r->fd < 0 || fstat(r->fd, &st) != 0 || st.st_size < (off_t)sizeof(f) ||
+        pread(r->fd, &f, sizeof(f), st.st_size - sizeof(f)) != sizeof(f) || f.magic != STORE_MAGIC ||
+        (off_t)f.n_pages * STORE_PAGE + f.bloom_bits / 8 + f.index_len + (off_t)sizeof(f) != st.st_size) {
+        run_close(r);
+        return NULL;
+    }
+    r->n_pages = f.n_pages;
+    r->n_entries = f.n_entries;
+    r->bloom_bits = f.bloom_bits;
+    off_t off = (off_t)f.n_pages * STORE_PAGE;
+    r->bloom = malloc(f.bloom_bits / 8);
+    r->index = malloc(f.index_len + 1);
+    r->first_keys = malloc((f.n_pages + 1) * sizeof(char *));
+    if (!r->bloom || !r->index || !r->first_keys || f.bloom_bits == 0 ||
+        pread(r->fd, r->bloom, f.bloom_bits / 8, off) != (ssize_t)(f.bloom_bits / 8) ||
+        pread(r->fd, r->index, f.index_len, off + f.bloom_bits / 8) != (ssize_t)f.index_len) {
+        run_close(r);
+        return NULL;
+    }
+    r->index[f.index_len] = '\0';
+    for (unsigned int i = 0, k = 0; k < (unsigned int)f.n_pages; k++) {
+        r->first_keys[k] = r->index + i;
+        i += strlen(r->index + i) + 1;
+        if (i > f.index_len) {
+            run_close(r);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+// 经页缓存取表文件的一页，缓存满时换出最久没用的页
+static const char *cache_get(store_run_t *r, int page) {
+    unsigned int b = ((unsigned int)r->id * 2654435761u ^ (unsigned int)page * 40503u) & (g_cache_buckets - 1);
+    cache_page_t *c;
+    g_store_page_reads++;
+    for (c = g_cache[b]; c; c = c->hnext) {
+        if (c->run_id == r->id && c->page == page) break;
+    }
+    if (!c) {
+        if (g_cache_n < g_cache_cap && (c = malloc(sizeof(cache_page_t)))) {
+            g_cache_n++;
+        } else if ((c = g_lru_tail)) {
+            unsigned int ob = ((unsigned int)c->run_id * 2654435761u ^ (unsigned int)c->page * 40503u) &
+                              (g_cache_buckets - 1);
+            for (cache_page_t **pp = &g_cache[ob]; *pp; pp = &(*pp)->hnext) {
+                if (*pp == c) {
+                    *pp = c->hnext;
+                    break;
+                }
+            }
+            g_lru_tail = c->prev;
+            if (g_lru_tail) g_lru_tail->next = NULL; else g_lru_head = NULL;
+        } else {
+            return NULL;
+        }
+        g_store_disk_reads++;
+        if (pread(r->fd, c->data, STORE_PAGE, (off_t)page * STORE_PAGE) != STORE_PAGE) {
+            free(c);
+            g_cache_n--;
+            return NULL;
+        }
+        c->run_id = r->id;
+        c->page = page;
+        c->hnext = g_cache[b];
+        g_cache[b] = c;
+        c->prev = c->next = NULL;
+    } else {
+        if (c == g_lru_head) return c->data;
+        c->prev->next = c->next;  // 从 LRU 链中摘下
+        if (c->next) c->next->prev = c->prev; else g_lru_tail = c->prev;
+    }
+    c->prev = NULL;
+    c->next = g_lru_head;
+    if (g_lru_head) g_lru_head->prev = c;
+    g_lru_head = c;
+    if (!g_lru_tail) g_lru_tail = c;
+    return c->data;
+}
+
+// 在一个表文件中查找用户，找到时复制口令记录（record 可为 NULL）并返回1
+static int run_get(store_run_t *r, const char *name, char *record, size_t size) {
+    if (!bloom_maybe(r->bloom, r->bloom_bits, name)) return 0;
+    int lo = 0, hi = r->n_pages - 1;  // 最后一个第一个用户名不大于 name 的页
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (strcmp(r->first_keys[mid], name) <= 0) lo = mid; else hi = mid - 1;
+    }
+    if (r->n_pages == 0 || strcmp(r->first_keys[lo], name) > 0) return 0;
+    const char *page = cache_get(r, lo);
+    for (int off = 0; page && off < STORE_PAGE && page[off];) {
+        const char *key = page + off, *rec = key + strlen(key) + 1;
+        if (strcmp(key, name) == 0) {
+            if (record) snprintf(record, size, "%s", rec);
+            return 1;
+        }
+        off = rec + strlen(rec) + 1 - page;
+    }
+    return 0;
+}
+
+// 写表文件：按用户名顺序逐条加入，写满一页换下一页
+typedef struct {
+    int fd;
+    char page[STORE_PAGE];
+    int used, n_pages;
+    long long n_entries;
+    unsigned char *bloom;
+    unsigned int bloom_bits;
+    char *index;
+    size_t index_len, index_cap;
+    int failed;
+} run_writer_t;
+
+static int writer_open(run_writer_t *w, int id, long long max_entries) {
+    char path[64];
+    run_path(id, path, sizeof(path));
+    memset(w, 0, sizeof(*w));
+    w->bloom_bits = ((max_entries * BLOOM_BITS_PER_KEY + 64) / 64) * 64;
+    w->bloom = calloc(w->bloom_bits / 8, 1);
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    return w->bloom && w->fd >= 0 ? 0 : -1;
+}
+
+static void writer_page(run_writer_t *w) {
+    if (w->used == 0) return;
+    memset(w->page + w->used, 0, STORE_PAGE - w->used);
+    if (write(w->fd, w->page, STORE_PAGE) != STORE_PAGE) w->failed = 1;
+    w->n_pages++;
+    w->used = 0;
+}
+
+static void writer_add(run_writer_t *w, const char *name, const char *record) {
+    int nlen = strlen(name) + 1, len = nlen + strlen(record) + 1;
+    if (w->used + len > STORE_PAGE) writer_page(w);
+    if (w->used == 0) {  // 新页：记下第一个用户名
+        if (w->index_len + nlen > w->index_cap) {
+            size_t cap = w->index_cap ? w->index_cap * 2 : 4096;
+            while (cap < w->index_len + nlen) cap *= 2;
+            char *p = realloc(w->index, cap);
+            if (!p) {
+                w->failed = 1;
+                return;
+            }
+            w->index = p;
+            w->index_cap = cap;
+        }
+        memcpy(w->index + w->index_len, name, nlen);
+        w->index_len += nlen;
+    }
+    memcpy(w->page + w->used, name, nlen);
+    strcpy(w->page + w->used + nlen, record);
+    w->used += len;
+    w->n_entries++;
+    bloom_add(w->bloom, w->bloom_bits, name);
+}
+
+// 写完尾部并刷到磁盘，成功返回0
+static int writer_close(run_writer_t *w) {
+    writer_page(w);
+    run_footer_t f = {STORE_MAGIC, w->n_pages, w->n_entries, w->bloom_bits, w->index_len};
+    if (write(w->fd, w->bloom, w->bloom_bits / 8) != (ssize_t)(w->bloom_bits / 8) ||
+        (w->index_len && write(w->fd, w->index, w->index_len) != (ssize_t)w->index_len) ||
+        write(w->fd, &f, sizeof(f)) != sizeof(f) || fsync(w->fd) != 0) {
+        w->failed = 1;
+    }
+    close(w->fd);
+    free(w->bloom);
+    free(w->index);
+    return w->failed ? -1 : 0;
+}
+
+// 顺序读表文件的游标（合并用，不经页缓存）
+typedef struct {
+    store_run_t *run;
+    char page[STORE_PAGE];
+    int page_no, off;
+    const char *name, *record;  // 当前条目，NULL 表示读完
+} run_cursor_t;
+
+static void cursor_next(run_cursor_t *c) {
+    while (1) {
+        if (c->off >= 0 && c->off < STORE_PAGE && c->page[c->off]) {
+            c->name = c->page + c->off;
+            c->record = c->name + strlen(c->name) + 1;
+            c->off = c->record + strlen(c->record) + 1 - c->page;
+            return;
+        }
+        if (c->page_no >= c->run->n_pages ||
+            pread(c->run->fd, c->page, STORE_PAGE, (off_t)c->page_no * STORE_PAGE) != STORE_PAGE) {
+            c->name = c->record = NULL;
+            return;
+        }
+        c->page_no++;
+        c->off = 0;
+    }
+}
+
+static void cursor_open(run_cursor_t *c, store_run_t *r) {
+    c->run = r;
+    c->page_no = 0;
+    c->off = -1;
+    cursor_next(c);
+}
+
+// 把当前的表文件列表写进清单（先写临时文件再改名，不会留下半个清单）
+static int manifest_save(void) {
+    FILE *fp = fopen(STORE_MANIFEST ".tmp", "w");
+    if (!fp) return -1;
+    for (int i = 0; i < g_n_runs; i++) fprintf(fp, "%d\n", g_runs[i]->id);
+    int ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    fclose(fp);
+    return ok && rename(STORE_MANIFEST ".tmp", STORE_MANIFEST) == 0 ? 0 : -1;
+}
+
+static void run_remove(store_run_t *r) {
+    char path[64];
+    run_path(r->id, path, sizeof(path));
+    unlink(path);
+    run_close(r);
+}
+
+// 合并最新的两层，同一用户保留新层的记录
+static int store_merge_last(void) {
+    store_run_t *older = g_runs[g_n_runs - 2], *newer = g_runs[g_n_runs - 1];
+    run_writer_t w;
+    int id = g_next_run_id++;
+    if (writer_open(&w, id, older->n_entries + newer->n_entries) != 0) {
+        writer_close(&w);
+        return -1;
+    }
+    run_cursor_t a, b;
+    cursor_open(&a, older);
+    cursor_open(&b, newer);
+    while (a.name || b.name) {
+        int cmp = !a.name ? 1 : !b.name ? -1 : strcmp(a.name, b.name);
+        if (cmp < 0) {
+            writer_add(&w, a.name, a.record);
+            cursor_next(&a);
+        } else {
+            writer_add(&w, b.name, b.record);
+            if (cmp == 0) cursor_next(&a);
+            cursor_next(&b);
+        }
+    }
+    store_run_t *r;
+    if (writer_close(&w) != 0 || !(r = run_open(id))) return -1;
+    g_runs[g_n_runs - 2] = r;
+    g_n_runs--;
+    if (manifest_save() != 0) return -1;
+    run_remove(older);
+    run_remove(newer);
+    return 0;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    return strcmp((*(mem_entry_t *const *)a)->name, (*(mem_entry_t *const *)b)->name);
+}
+
+// 内存表写成最新一层，然后把大小相近的层合并。clear_log 为真时清空预写日志
+int store_flush(int clear_log) {
+    if (g_mem_n == 0) return 0;
+    if (g_n_runs == STORE_MAX_RUNS) return -1;
+    mem_entry_t **sorted = malloc(g_mem_n * sizeof(mem_entry_t *));
+    if (!sorted) return -1;
+    int n = 0;
+    for (int b = 0; b < STORE_MEM_BUCKETS; b++) {
+        for (mem_entry_t *e = g_memtable[b]; e; e = e->next) sorted[n++] = e;
+    }
+    qsort(sorted, n, sizeof(mem_entry_t *), cmp_entry);
+    run_writer_t w;
+    int id = g_next_run_id++;
+    int ok = writer_open(&w, id, n) == 0;
+    for (int i = 0; ok && i < n; i++) writer_add(&w, sorted[i]->name, sorted[i]->record);
+    free(sorted);
+    store_run_t *r = NULL;
+    if (writer_close(&w) != 0 || !ok || !(r = run_open(id))) {
+        run_close(r);
+        return -1;
+    }
+    g_runs[g_n_runs++] = r;
+    if (manifest_save() != 0) return -1;
+    mem_clear();
+    if (clear_log) {
+        FILE *fp = fopen(USERS_FILE, "w");
+        if (fp) fclose(fp);
+    }
+    while (g_n_runs >= 2 && g_runs[g_n_runs - 2]->n_entries <= STORE_FANOUT * g_runs[g_n_runs - 1]->n_entries) {
+        if (store_merge_last() != 0) return -1;
+    }
+    return 0;
+}
+
+// 启动：按清单打开各层表文件，重放预写日志。日志很大（从纯文本用户文件升级）时边读边写表文件
+int store_open(int cache_mb) {
+    g_cache_cap = cache_mb > 0 ? cache_mb * (1024 * 1024 / STORE_PAGE) : 1;
+    for (g_cache_buckets = 1; g_cache_buckets < g_cache_cap; g_cache_buckets *= 2);
+    if (!(g_cache = calloc(g_cache_buckets, sizeof(cache_page_t *)))) return -1;
+
+    FILE *fp = fopen(STORE_MANIFEST, "r");
+    int id;
+    while (fp && fscanf(fp, "%d", &id) == 1) {
+        store_run_t *r = g_n_runs < STORE_MAX_RUNS ? run_open(id) : NULL;
+        if (!r) {
+            fprintf(stderr, "user store: cannot open table %d\n", id);
+            fclose(fp);
+            return -1;
+        }
+        g_runs[g_n_runs++] = r;
+        if (id >= g_next_run_id) g_next_run_id = id + 1;
+    }
+    if (fp) fclose(fp);
+
+    int flushed = 0;
+    char line[512];
+    if ((fp = fopen(USERS_FILE, "r"))) {
+        while (fgets(line, sizeof(line), fp)) {
+            char user[256], record[256];
+            if (sscanf(line, "%255s %255s", user, record) != 2 || mem_put(user, record) != 0) continue;
+            if (g_mem_n >= STORE_MEMTABLE_MAX) {
+                if (store_flush(0) != 0) break;
+                flushed = 1;
+            }
+        }
+        fclose(fp);
+    }
+    if (flushed) store_flush(1);  // 日志中的记录都进了表文件
+    return 0;
+}
+
+// 查找用户的口令记录（record 可为 NULL），新写入的优先
+static int store_get(const char *name, char *record, size_t size) {
+    g_store_lookups++;
+    mem_entry_t *e = mem_lookup(name);
+    if (e) {
+        if (record) snprintf(record, size, "%s", e->record);
+        return 1;
+    }
+    for (int i = g_n_runs - 1; i >= 0; i--) {
+        if (run_get(g_runs[i], name, record, size)) return 1;
+    }
+    return 0;
+}
+
+// 写入一个用户的口令记录：先追加预写日志再进内存表，内存表满了写成表文件
+static int store_put(const char *name, const char *record) {
+    FILE *fp = fopen(USERS_FILE, "a");
+    if (!fp) return -1;
+    int ok = fprintf(fp, "%s %s\n", name, record) > 0;
+    if (fclose(fp) != 0 || !ok || mem_put(name, record) != 0) return -1;
+    if (g_mem_n >= STORE_MEMTABLE_MAX && store_flush(1) != 0) perror("user store flush");
+    return 0;
+}
+
+// 遍历全部用户名（同一用户可能出现多次，由调用者去重）
+static void store_scan(void (*fn)(const char *name, void *ctx), void *ctx) {
+    for (int b = 0; b < STORE_MEM_BUCKETS; b++) {
+        for (mem_entry_t *e = g_memtable[b]; e; e = e->next) fn(e->name, ctx);
+    }
+    for (int i = 0; i < g_n_runs; i++) {
+        run_cursor_t c;
+        for (cursor_open(&c, g_runs[i]); c.name; cursor_next(&c)) fn(c.name, ctx);
+    }
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+typedef struct {
+    char **names;
+    int n, cap;
+} name_list_t;
+
+static void names_collect(const char *name, void *ctx) {
+    name_list_t *l = ctx;
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 1024;
+        char **p = realloc(l->names, cap * sizeof(char *));
+        if (!p) return;
+        l->names = p;
+        l->cap = cap;
+    }
+    if ((l->names[l->n] = strdup(name))) l->n++;
+}
+
+// 启动时从用户表建立索引，返回用户数
+int names_load(void) {
+    name_list_t l = {NULL, 0, 0};
+    char prev[256] = "";
+    store_scan(names_collect, &l);
+    char **names = l.names;
+    int n = l.n;
+    qsort(names, n, sizeof(char *), cmp_name);
+    index_free(&g_names);
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && strcmp(names[i], names[i - 1]) == 0) continue;  // 改过口令的用户在几层里都有
+        if (index_append(&g_names, names[i], prev) != 0) break;
+    }
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
+    return g_names.n_names;
+}
+
+// 按前缀搜索用户名，after 非空时从它之后开始（上一页的最后一个）。
+// 应答 "SEARCH$还有下一页$用户名..."，每页最多 SEARCH_PAGE 个且不超过 size
+int names_search(const char *prefix, const char *after, char *out, size_t size) {
+    size_t plen = strlen(prefix);
+    int strict = after && strcmp(after, prefix) > 0;
+    const char *key = strict ? after : prefix;
+    name_iter_t it;
+    iter_seek(&g_names, &it, key, strict);
+    int d = delta_seek(key, strict);
+    int len = snprintf(out, size, "SEARCH$0"), count = 0;
+    while (it.valid || d < g_n_delta) {
+        int from_delta = !it.valid || (d < g_n_delta && strcmp(g_names_delta[d], it.name) < 0);
+        const char *name = from_delta ? g_names_delta[d] : it.name;
+        if (strncmp(name, prefix, plen) != 0) break;
+        if (count == SEARCH_PAGE || len + strlen(name) + 1 >= size) {
+            out[7] = '1';
+            break;
+        }
+        len += snprintf(out + len, size - len, "$%s", name);
+        count++;
+        if (from_delta) {
+            d++;
+        } else {
+            iter_next(&it);
+        }
+    }
+    return len;
+}
+
+// 口令哈希：scrypt（RFC 7914，内部用 PBKDF2-HMAC-SHA256），不依赖外部库。
+// 计算一次要 128*r*N 字节内存和几十毫秒 CPU，所以放在 KDF 工作线程中做
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t n;
+} sha256_t;
+
+typedef struct {
+    sha256_t inner, outer;
+} hmac_sha256_t;
+
+static const uint32_t g_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha256_block(sha256_t *s, const unsigned char *p) {
+    uint32_t w[64], a[8];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(a, s->h, sizeof(a));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = a[7] + (ROR32(a[4], 6) ^ ROR32(a[4], 11) ^ ROR32(a[4], 25)) + ((a[4] & a[5]) ^ (~a[4] & a[6])) +
+                      g_sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a[0], 2) ^ ROR32(a[0], 13) ^ ROR32(a[0], 22)) + ((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+        memmove(a + 1, a, 7 * sizeof(uint32_t));
+        a[4] += t1;
+        a[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) s->h[i] += a[i];
+}
+
+void sha256_init(sha256_t *s) {
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+    s->n = 0;
+}
+
+void sha256_update(sha256_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->len += len;
+    while (len > 0) {
+        size_t n = 64 - s->n < len ? 64 - s->n : len;
+        memcpy(s->buf + s->n, p, n);
+        s->n += n;
+        p += n;
+        len -= n;
+        if (s->n == 64) {
+            sha256_block(s, s->buf);
+            s->n = 0;
+        }
+    }
+}
+
+void sha256_final(sha256_t *s, unsigned char out[32]) {
+    uint64_t bits = s->len * 8;
+    unsigned char pad = 0x80, len_be[8];
+    sha256_update(s, &pad, 1);
+    pad = 0;
+    while (s->n != 56) sha256_update(s, &pad, 1);
+    for (int i = 0; i < 8; i++) len_be[i] = bits >> (56 - 8 * i);
+    sha256_update(s, len_be, 8);
+    for (int i = 0; i < 32; i++) out[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void hmac_sha256_init(hmac_sha256_t *h, const unsigned char *key, size_t klen) {
+    unsigned char k[64] = {0}, pad[64];
+    if (klen > 64) {
+        sha256_t s;
+        sha256_init(&s);
+        sha256_update(&s, key, klen);
+        sha256_final(&s, k);
+    } else {
+        memcpy(k, key, klen);
+    }
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+    sha256_init(&h->inner);
+    sha256_update(&h->inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+    sha256_init(&h->outer);
+    sha256_update(&h->outer, pad, 64);
+}
+
+void hmac_sha256_final(hmac_sha256_t *h, unsigned char out[32]) {
+    sha256_final(&h->inner, out);
+    sha256_update(&h->outer, out, 32);
+    sha256_final(&h->outer, out);
+}
+
+// PBKDF2-HMAC-SHA256，scrypt 只用 c = 1
+void pbkdf2_sha256(const unsigned char *pass, size_t plen, const unsigned char *salt, size_t slen, int c,
+                   unsigned char *out, size_t dklen) {
+    hmac_sha256_t base, h;
+    hmac_sha256_init(&base, pass, plen);
+    for (uint32_t block = 1; dklen > 0; block++) {
+        unsigned char ctr[4] = {block >> 24, block >> 16, block >> 8, block}, u[32], t[32];
+        h = base;
+        sha256_update(&h.inner, salt, slen);
+        sha256_update(&h.inner, ctr, 4);
+        hmac_sha256_final(&h, u);
+        memcpy(t, u, 32);
+        for (int i = 1; i < c; i++) {
+            h = base;
+            sha256_update(&h.inner, u, 32);
+            hmac_sha256_final(&h, u);
+            for (int k = 0; k < 32; k++) t[k] ^= u[k];
+        }
+        size_t n = dklen < 32 ? dklen : 32;
+        memcpy(out, t, n);
+        out += n;
+        dklen -= n;
+    }
+}
+
+static void salsa20_8(uint32_t b[16]) {
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= ROL32(x[0] + x[12], 7);   x[8] ^= ROL32(x[4] + x[0], 9);
+        x[12] ^= ROL32(x[8] + x[4], 13);  x[0] ^= ROL32(x[12] + x[8], 18);
+        x[9] ^= ROL32(x[5] + x[1], 7);    x[13] ^= ROL32(x[9] + x[5], 9);
+        x[1] ^= ROL32(x[13] + x[9], 13);  x[5] ^= ROL32(x[1] + x[13], 18);
+        x[14] ^= ROL32(x[10] + x[6], 7);  x[2] ^= ROL32(x[14] + x[10], 9);
+        x[6] ^= ROL32(x[2] + x[14], 13);  x[10] ^= ROL32(x[6] + x[2], 18);
+        x[3] ^= ROL32(x[15] + x[11], 7);  x[7] ^= ROL32(x[3] + x[15], 9);
+        x[11] ^= ROL32(x[7] + x[3], 13);  x[15] ^= ROL32(x[11] + x[7], 18);
+        x[1] ^= ROL32(x[0] + x[3], 7);    x[2] ^= ROL32(x[1] + x[0], 9);
+        x[3] ^= ROL32(x[2] + x[1], 13);   x[0] ^= ROL32(x[3] + x[2], 18);
+        x[6] ^= ROL32(x[5] + x[4], 7);    x[7] ^= ROL32(x[6] + x[5], 9);
+        x[4] ^= ROL32(x[7] + x[6], 13);   x[5] ^= ROL32(x[4] + x[7], 18);
+        x[11] ^= ROL32(x[10] + x[9], 7);  x[8] ^= ROL32(x[11] + x[10], 9);
+        x[9] ^= ROL32(x[8] + x[11], 13);  x[10] ^= ROL32(x[9] + x[8], 18);
+        x[12] ^= ROL32(x[15] + x[14], 7); x[13] ^= ROL32(x[12] + x[15], 9);
+        x[14] ^= ROL32(x[13] + x[12], 13); x[15] ^= ROL32(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++) b[i] += x[i];
+}
+
+// scrypt BlockMix：b 有 2r 个64字节子块，y 是同样大小的临时区
+static void scrypt_blockmix(uint32_t *b, uint32_t *y, int r) {
+    uint32_t x[16];
+    memcpy(x, &b[(2 * r - 1) * 16], 64);
+    for (int i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 16; k++) x[k] ^= b[i * 16 + k];
+        salsa20_8(x);
+        memcpy(&y[i * 16], x, 64);
+    }
+    for (int i = 0; i < r; i++) {
+        memcpy(&b[i * 16], &y[2 * i * 16], 64);
+        memcpy(&b[(i + r) * 16], &y[(2 * i + 1) * 16], 64);
+    }
+}
+
+static void scrypt_romix(unsigned char *block, int r, uint32_t n, uint32_t *v, uint32_t *x, uint32_t *y) {
+    size_t words = 32 * r;
+    for (size_t k = 0; k < words; k++) {
+        const unsigned char *p = block + 4 * k;
+        x[k] = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(&v[i * words], x, words * 4);
+        scrypt_blockmix(x, y, r);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t j = x[words - 16] & (n - 1);
+        for (size_t k = 0; k < words; k++) x[k] ^= v[j * words + k];
+        scrypt_blockmix(x, y, r);
+    }
+    for (size_t k = 0; k < words; k++) {
+        unsigned char *p = block + 4 * k;
+        p[0] = x[k];
+        p[1] = x[k] >> 8;
+        p[2] = x[k] >> 16;
+        p[3] = x[k] >> 24;
+    }
+}
+
+// scrypt(pass, salt, N, r, p)，N 必须是2的幂；内存不够返回 -1
+int scrypt(const unsigned char *pass, size_t plen, const unsigned char *salt, size_t slen, uint32_t n, int r, int p,
+           unsigned char *out, size_t dklen) {
+    size_t blen = 128 * (size_t)r;
+    unsigned char *b = malloc(blen * p);
+    uint32_t *v = malloc(blen * n);
+    uint32_t *xy = malloc(blen * 2);
+    int ret = -1;
+    if (b && v && xy) {
+        pbkdf2_sha256(pass, plen, salt, slen, 1, b, blen * p);
+        for (int i = 0; i < p; i++) scrypt_romix(b + i * blen, r, n, v, xy, xy + 32 * r);
+        pbkdf2_sha256(pass, plen, b, blen * p, 1, out, dklen);
+        ret = 0;
+    }
+    free(b);
+    free(v);
+    free(xy);
+    return ret;
+}
+
+static void to_hex(const unsigned char *in, int n, char *out) {
+    for (int i = 0; i < n; i++) sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+static int from_hex(const char *in, unsigned char *out, int n) {
+    for (int i = 0; i < n; i++) {
+        unsigned int byte;
+        if (sscanf(in + 2 * i, "%2x", &byte) != 1) return -1;
+        out[i] = byte;
+    }
+    return 0;
+}
+
+// 为口令生成用户文件中的记录 "$s1$log2N$r$p$盐$哈希"（没有空格，和用户名用空格分隔）
+int kdf_hash(const char *password, char *record, size_t size) {
+    unsigned char salt[KDF_SALT_LEN], dk[KDF_HASH_LEN];
+    if (getrandom(salt, sizeof(salt), 0) != sizeof(salt)) return -1;
+    if (scrypt((const unsigned char *)password, strlen(password), salt, sizeof(salt), 1u << KDF_LOG2_N, KDF_R, KDF_P,
+               dk, sizeof(dk)) != 0) {
+        return -1;
+    }
+    char salt_hex[2 * KDF_SALT_LEN + 1], dk_hex[2 * KDF_HASH_LEN + 1];
+    to_hex(salt, sizeof(salt), salt_hex);
+    to_hex(dk, sizeof(dk), dk_hex);
+    int len = snprintf(record, size, "$s1$%d$%d$%d$%s$%s", KDF_LOG2_N, KDF_R, KDF_P, salt_hex, dk_hex);
+    return len < (int)size ? 0 : -1;
+}
+
+// 记录是否已经是 scrypt 哈希（旧的用户文件存的是明文）
+int kdf_is_hashed(const char *record) {
+    return strncmp(record, "$s1$", 4) == 0;
+}
+
+// 用记录验证口令，返回1表示正确。明文记录直接比较，登录成功后由主线程换成哈希
+int kdf_verify(const char *record, const char *password) {
+    if (!kdf_is_hashed(record)) return strcmp(record, password) == 0;
+    int log2_n, r, p;
+    char salt_hex[2 * KDF_SALT_LEN + 1], dk_hex[2 * KDF_HASH_LEN + 1];
+    unsigned char salt[KDF_SALT_LEN], dk[KDF_HASH_LEN], want[KDF_HASH_LEN];
+    if (sscanf(record, "$s1$%d$%d$%d$%32[0-9a-f]$%64[0-9a-f]", &log2_n, &r, &p, salt_hex, dk_hex) != 5 ||
+        log2_n < 1 || log2_n > 20 || r < 1 || r > 32 || p < 1 || p > 16 || strlen(salt_hex) != 2 * KDF_SALT_LEN ||
+        strlen(dk_hex) != 2 * KDF_HASH_LEN || from_hex(salt_hex, salt, sizeof(salt)) != 0 ||
+        from_hex(dk_hex, want, sizeof(want)) != 0) {
+        return 0;
+    }
+    if (scrypt((const unsigned char *)password, strlen(password), salt, sizeof(salt), 1u << log2_n, r, p, dk,
+               sizeof(dk)) != 0) {
+        return 0;
+    }
+    unsigned char diff = 0;
+    for (int i = 0; i < KDF_HASH_LEN; i++) diff |= dk[i] ^ want[i];
+    return diff == 0;
+}
+
+// 把一个窗口内变化的回执发给发送者的会话；发送者不在线时保留，下次变化时一起发。两端都已离线的对话随后释放
+void acks_flush(void) {
+    char frame[BUFFER_SIZE];
+    conversation_t *dirty = g_ack_dirty;
+    g_ack_dirty = NULL;
+    for (conversation_t *cv = dirty, *next; cv; cv = next) {
+        next = cv->next_dirty;
+        cv->dirty = 0;
+        user_entry_t *u = online_lookup(cv->from, 0);
+        if (u && (cv->delivered != cv->acked_delivered || cv->read != cv->acked_read)) {
+            int len = snprintf(frame, sizeof(frame), "ACK$%s$%u$%u", cv->to, cv->delivered, cv->read);
+            send_sessions(u, frame, len);
+            cv->acked_delivered = cv->delivered;
+            cv->acked_read = cv->read;
+        }
+        conv_free_idle(cv);
+    }
+}
+
+// 计算文件MD5值
+int get_md5_by_cmd(const char *filename, char *result, size_t result_size) {
+    char cmd[256];
+    FILE *fp;
+
+    // 构建命令字符串
+    snprintf(cmd, sizeof(cmd), "md5sum %s | awk '{print $1}'", filename);
+
+    // 执行命令并获取输出
+    if ((fp = popen(cmd, "r")) == NULL) {
+        perror("popen failed");
+        return -1;
+    }
+
+    // 读取命令输出
+    if (fgets(result, result_size, fp) == NULL) {
+        pclose(fp);
+        return -1;
+    }
+
+    // 移除末尾的换行符
+    result[strcspn(result, "\n")] = '\0';
+
+    pclose(fp);
+    return 0;
+}
+
+// 检查用户是否存在（不存在时多数由布隆过滤器直接排除，不读磁盘）
+int user_exists(const char *username) {
+    return store_get(username, NULL, 0);
+}
+
+// 添加用户，record 是 kdf_hash 生成的口令记录
+void register_user(const char *username, const char *record) {
+    if (store_put(username, record) == 0) {
+        names_add(username);
+    }
+}
+
+// 取出用户的口令记录（登录验证由 KDF 工作线程用它完成），用户不存在返回0
+int user_record(const char *username, char *record, size_t size) {
+    return store_get(username, record, size);
+}
+
+// 修改密码：old_pass / new_pass 是口令记录，表中的记录仍是 old_pass 时才写入新记录
+int change_password(const char *username, const char *old_pass, const char *new_pass) {
+    char record[256];
+    if (!store_get(username, record, sizeof(record))) return 0;  // 用户不存在
+    if (strcmp(record, old_pass) != 0) return -2;               // 密码错误
+    return store_put(username, new_pass) == 0 ? 1 : -1;
+}
+
+// 检查是否是好友（查内存邻接表）
+int are_friends(const char *user1, const char *user2) {
+    return graph_has_edge(graph_node(user1, 0), graph_node(user2, 0));
+}
+
+// 添加好友：新关系追加到文件；双方在线的会话在下一个窗口重新收到在线好友快照
+void add_friend(const char *user1, const char *user2) {
+    int added = graph_link(user1, user2) > 0;
+    for (int k = 0; added && k < 2; k++) {
+        user_entry_t *u = online_lookup(k ? user2 : user1, 0);
+        for (int i = 0; u && i < u->n_sessions; i++) {
+            u->sessions[i]->want_presence = 1;
+        }
+    }
+    if (!added) return;
+    FILE *fp = fopen(FRIENDS_FILE, "a");
+    if (fp) {
+        fprintf(fp, "%s %s\n", user1, user2);
+        fclose(fp);
+    }
+}
+
+// 删除好友
+void remove_friend(const char *user1, const char *user2) {
+    graph_unlink(user1, user2);
+    FILE *fp = fopen(FRIENDS_FILE, "r");
+    if (!fp) return;
+    FILE *temp_fp = fopen("friends.tmp", "w");
+    if (!temp_fp) {
+        fclose(fp);
+        return;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        char u1[256], u2[256];
+        sscanf(line, "%s %s", u1, u2);
+        if (!((strcmp(u1, user1) == 0 && strcmp(u2, user2) == 0) ||
+              (strcmp(u1, user2) == 0 && strcmp(u2, user1) == 0))) {
+            fprintf(temp_fp, "%s", line);
+        }
+    }
+    fclose(fp);
+    fclose(temp_fp);
+    remove(FRIENDS_FILE);
+    rename("friends.tmp", FRIENDS_FILE);
+}
+
+// 列出好友，格式 "FRIENDS$好友1$好友2..."
+int list_friends(const char *user, char *out, size_t size) {
+    int len = snprintf(out, size, "FRIENDS");
+    friend_node_t *n = graph_node(user, 0);
+    for (int i = 0; n && i < n->n_friends; i++) {
+        const char *other = n->friends[i]->username;
+        if (len + strlen(other) + 1 < size) {
+            len += snprintf(out + len, size - len, "$%s", other);
+        }
+    }
+    return len;
+}
+
+// KDF 工作线程池：主线程只做文件查找和组任务，口令哈希在 KDF_WORKERS 个线程中完成，
+// 结果放到完成链上并写 eventfd 唤醒事件循环，再由主线程回复发起命令的连接。
+// 连接有任务在算时暂停处理它后面的命令，保证应答顺序
+typedef enum { KDF_REG, KDF_LOGIN, KDF_CHGPWD } kdf_op_t;
+
+typedef struct kdf_job {
+    kdf_op_t op;
+    client_info_t *cl;
+    char username[256];
+    char password[256];               // LOGIN / CHGPWD 要验证的口令
+    char new_pass[256];               // REG / CHGPWD 的新口令
+    char record[KDF_RECORD_MAX];      // 提交时用户文件中的记录
+    char new_record[KDF_RECORD_MAX];  // 工作线程算出的新记录
+    int ok;                           // 口令验证结果
+    struct kdf_job *next;
+} kdf_job_t;
+
+pthread_mutex_t g_kdf_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_kdf_cond = PTHREAD_COND_INITIALIZER;
+kdf_job_t *g_kdf_head, *g_kdf_tail;  // 待算的任务
+kdf_job_t *g_kdf_done;               // 算完等主线程处理的任务
+int g_kdf_efd = -1;
+int g_kdf_inflight;                  // 已提交还没处理完的任务数（只由主线程访问）
+
+// 已验证的登录缓存：直接映射，槽位由用户名哈希决定，冲突时覆盖。
+// 只存 HMAC(进程随机密钥, 用户名\0口令) 和验证时的记录，记录变了（改过密码）就不再命中
+typedef struct {
+    char username[256];
+    unsigned char mac[32];
+    char record[KDF_RECORD_MAX];
+} cred_cache_t;
+
+cred_cache_t g_cred_cache[CRED_CACHE_SLOTS];
+unsigned char g_cred_key[32];
+
+void *kdf_worker(void *arg) {
+    (void)arg;
+    // 降低工作线程优先级，CPU 紧张时事件循环先运行（Linux 上 nice 值按线程生效）
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), KDF_NICE);
+    while (1) {
+        pthread_mutex_lock(&g_kdf_mutex);
+        while (!g_kdf_head) pthread_cond_wait(&g_kdf_cond, &g_kdf_mutex);
+        kdf_job_t *job = g_kdf_head;
+        g_kdf_head = job->next;
+        if (!g_kdf_head) g_kdf_tail = NULL;
+        pthread_mutex_unlock(&g_kdf_mutex);
+
+        if (job->op != KDF_REG) job->ok = kdf_verify(job->record, job->password);
+        // 新注册、改密码，以及明文记录登录成功后都生成新的哈希记录
+        const char *hash_pass = job->op == KDF_REG ? job->new_pass
+                                : job->op == KDF_CHGPWD && job->ok ? job->new_pass
+                                : job->op == KDF_LOGIN && job->ok && !kdf_is_hashed(job->record) ? job->password
+                                : NULL;
+        if (hash_pass && kdf_hash(hash_pass, job->new_record, sizeof(job->new_record)) != 0) {
+            job->new_record[0] = '\0';
+        }
+
+        uint64_t one = 1;
+        pthread_mutex_lock(&g_kdf_mutex);
+        job->next = g_kdf_done;
+        g_kdf_done = job;
+        pthread_mutex_unlock(&g_kdf_mutex);
+        if (write(g_kdf_efd, &one, sizeof(one)) != sizeof(one)) perror("eventfd write");
+    }
+    return NULL;
+}
+
+int kdf_start(void) {
+    g_kdf_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &g_kdf_efd};
+    if (g_kdf_efd == -1 || epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_kdf_efd, &ev) == -1) return -1;
+    for (int i = 0; i < KDF_WORKERS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, kdf_worker, NULL) != 0) return -1;
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+// 提交任务，队列满时返回 -1（调用者回复服务器忙）
+int kdf_submit(kdf_job_t *job) {
+    if (g_kdf_inflight >= KDF_QUEUE_MAX) return -1;
+    g_kdf_inflight++;
+    job->cl->pending_job++;
+    job->next = NULL;
+    pthread_mutex_lock(&g_kdf_mutex);
+    if (g_kdf_tail) {
+        g_kdf_tail->next = job;
+    } else {
+        g_kdf_head = job;
+    }
+    g_kdf_tail = job;
+    pthread_cond_signal(&g_kdf_cond);
+    pthread_mutex_unlock(&g_kdf_mutex);
+    return 0;
+}
+
+kdf_job_t *kdf_job_new(kdf_op_t op, client_info_t *cl, const char *username) {
+    kdf_job_t *job = calloc(1, sizeof(kdf_job_t));
+    if (!job) return NULL;
+    job->op = op;
+    job->cl = cl;
+    snprintf(job->username, sizeof(job->username), "%s", username);
+    return job;
+}
+
+static void kdf_job_free(kdf_job_t *job) {
+    memset(job, 0, sizeof(*job));  // 不在内存里留口令
+    free(job);
+}
+
+static unsigned int cred_slot(const char *username) {
+    return hash_name(username) & (CRED_CACHE_SLOTS - 1);
+}
+
+static void cred_mac(const char *username, const char *password, unsigned char mac[32]) {
+    hmac_sha256_t h;
+    hmac_sha256_init(&h, g_cred_key, sizeof(g_cred_key));
+    sha256_update(&h.inner, username, strlen(username) + 1);
+    sha256_update(&h.inner, password, strlen(password));
+    hmac_sha256_final(&h, mac);
+}
+
+int cred_cache_hit(const char *username, const char *password, const char *record) {
+    const cred_cache_t *c = &g_cred_cache[cred_slot(username)];
+    unsigned char mac[32], diff = 0;
+    if (strcmp(c->username, username) != 0 || strcmp(c->record, record) != 0) return 0;
+    cred_mac(username, password, mac);
+    for (int i = 0; i < 32; i++) diff |= mac[i] ^ c->mac[i];
+    return diff == 0;
+}
 
-// 全局客户端列表和互斥锁
-client_info_t *g_clients[MAX_CLIENTS];
-pthread_mutex_t g_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+void cred_cache_put(const char *username, const char *password, const char *record) {
+    cred_cache_t *c = &g_cred_cache[cred_slot(username)];
+    snprintf(c->username, sizeof(c->username), "%s", username);
+    snprintf(c->record, sizeof(c->record), "%s", record);
+    cred_mac(username, password, c->mac);
+}
 
-void add_client(client_info_t *cl) {
-    pthread_mutex_lock(&g_clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!g_clients[i]) {
-            g_clients[i] = cl;
-            break;
+void cred_cache_drop(const char *username) {
+    cred_cache_t *c = &g_cred_cache[cred_slot(username)];
+    if (strcmp(c->username, username) == 0) memset(c, 0, sizeof(*c));
+}
+
+// 登录成功：会话加入在线表，回复 "OK$Login successful$恢复令牌"，再重发还没读的消息
+static void login_ok(client_info_t *client, const char *username) {
+    if (session_attach(client, username) == 0) {
+        unsigned char token[RESUME_TOKEN_LEN];
+        char frame[64 + 2 * RESUME_TOKEN_LEN];
+        if (client->resume) resume_free(client->resume);  // 同一连接重新登录，旧令牌作废
+        int len = snprintf(frame, sizeof(frame), "OK$Login successful");
+        if (getrandom(token, sizeof(token), 0) == sizeof(token) && resume_insert(token, username, client, 0)) {
+            frame[len++] = '$';
+            to_hex(token, RESUME_TOKEN_LEN, frame + len);
         }
+        reply(client, frame);
+        printf("User '%s' logged in from %s:%d\n", username, inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+        conv_replay(client);
+    } else {
+        reply(client, "FAIL$Invalid username or password");
     }
-    pthread_mutex_unlock(&g_clients_mutex);
 }
 
-void remove_client(client_info_t *cl) {
-    pthread_mutex_lock(&g_clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (g_clients[i] == cl) {
-            g_clients[i] = NULL;
-            break;
+// 主线程处理一个算完的任务。连接已经断开时照常写用户文件，只是不再回复
+static void kdf_finish(kdf_job_t *job) {
+    client_info_t *client = job->cl;
+    if (job->op == KDF_REG) {
+        if (!job->new_record[0]) {
+            reply(client, "FAIL$Registration failed");
+        } else if (user_exists(job->username)) {  // 算哈希期间被别人注册了
+            reply(client, "FAIL$User already exists");
+        } else {
+            register_user(job->username, job->new_record);
+            reply(client, "OK$Registration successful");
+        }
+    } else if (job->op == KDF_LOGIN) {
+        if (!job->ok) {
+            reply(client, "FAIL$Invalid username or password");
+            return;
+        }
+        const char *record = job->record;
+        if (job->new_record[0] && change_password(job->username, job->record, job->new_record) == 1) {
+            record = job->new_record;  // 明文记录换成了哈希
+        }
+        cred_cache_put(job->username, job->password, record);
+        if (!client->closing) login_ok(client, job->username);
+    } else {
+        if (!job->ok) {
+            reply(client, "FAIL$Incorrect old password");
+        } else if (job->new_record[0] && change_password(job->username, job->record, job->new_record) == 1) {
+            cred_cache_drop(job->username);
+            reply(client, "OK$Password changed successfully");
+        } else {
+            reply(client, "FAIL$Failed to change password");
         }
     }
-    pthread_mutex_unlock(&g_clients_mutex);
 }
 
-int find_client_socket(const char *username) {
-    int sockfd = -1;
-    pthread_mutex_lock(&g_clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (g_clients[i] && g_clients[i]->logged_in && strcmp(g_clients[i]->username, username) == 0) {
-            sockfd = g_clients[i]->sockfd;
-            break;
+// eventfd 可读：处理全部算完的任务，再恢复这些连接的命令处理
+void kdf_complete(void) {
+    uint64_t count;
+    if (read(g_kdf_efd, &count, sizeof(count)) != sizeof(count)) return;
+    pthread_mutex_lock(&g_kdf_mutex);
+    kdf_job_t *done = g_kdf_done;
+    g_kdf_done = NULL;
+    pthread_mutex_unlock(&g_kdf_mutex);
+    while (done) {
+        kdf_job_t *job = done;
+        done = job->next;
+        client_info_t *cl = job->cl;
+        g_kdf_inflight--;
+        cl->pending_job--;
+        kdf_finish(job);
+        kdf_job_free(job);
+        if (cl->closing || cl->pending_job || cl->queue) continue;
+        if (memchr(cl->in, '\n', cl->in_len)) {
+            queue_push(&g_ready, cl);
+        } else if (cl->eof) {
+            conn_close(cl, "disconnected");
         }
     }
-    pthread_mutex_unlock(&g_clients_mutex);
-    return sockfd;
 }
 
-// 计算文件MD5值
-int get_md5_by_cmd(const char *filename, char *result, size_t result_size) {
-    char cmd[256];
-    FILE *fp;
+// 各命令消耗的令牌：要写用户文件或好友文件的命令更贵，其余命令1个
+static const struct {
+    const char *name;
+    int cost;
+} g_command_costs[] = {
+    {"REG", 10}, {"CHGPWD", 10}, {"ADDFRIEND", 5}, {"DELFRIEND", 5}, {"LOGIN", 2}, {"RESUME", 2}, {"SEARCH", 2},
+};
 
-    // 构建命令字符串
-    snprintf(cmd, sizeof(cmd), "md5sum %s | awk '{print $1}'", filename);
+int command_cost(const char *frame, int len) {
+    int n = 0;
+    while (n < len && frame[n] != '$') n++;
+    for (size_t i = 0; i < sizeof(g_command_costs) / sizeof(g_command_costs[0]); i++) {
+        if ((int)strlen(g_command_costs[i].name) == n && memcmp(frame, g_command_costs[i].name, n) == 0) {
+            return g_command_costs[i].cost;
+        }
+    }
+    return 1;
+}
 
-    // 执行命令并获取输出
-    if ((fp = popen(cmd, "r")) == NULL) {
-        perror("popen failed");
-        return -1;
+// 处理一条命令（帧已去掉结尾的 '\n'）
+void handle_command(client_info_t *client, char *buffer, int recv_len) {
+    // Replace '$' with '\0'
+    for (int i = 0; i < recv_len; i++) {
+        if (buffer[i] == '$') {
+            buffer[i] = '\0';
+        }
     }
 
-    // 读取命令输出
-    if (fgets(result, result_size, fp) == NULL) {
-        pclose(fp);
-        return -1;
+    // 解析命令和参数, 以\0分隔
+    char *args[10];
+    int arg_count = 0;
+    args[0] = buffer;
+    arg_count++;
+    for (int i = 0; i < recv_len; i++) {
+        if (buffer[i] == '\0') {
+            if (arg_count < 10) {
+                args[arg_count++] = &buffer[i + 1];
+            }
+        }
     }
+    char *command = args[0];
+    printf("Received command: %s, arg_count: %d\n", command, arg_count);
 
-    // 移除末尾的换行符
-    result[strcspn(result, "\n")] = '\0';
 
-    pclose(fp);
-    return 0;
+    // 注册
+    if (strcmp(command, "REG") == 0 && arg_count >= 3) {
+        char *username = args[1];
+        char *password = args[2];
+        kdf_job_t *job;
+        if (user_exists(username)) {
+            reply(client, "FAIL$User already exists");
+        } else if (!(job = kdf_job_new(KDF_REG, client, username))) {
+            reply(client, "FAIL$Registration failed");
+        } else {
+            snprintf(job->new_pass, sizeof(job->new_pass), "%s", password);
+            if (kdf_submit(job) != 0) {
+                kdf_job_free(job);
+                reply(client, "FAIL$Server busy, try again later");
+            }
+        }
+    }
+    // 登录
+    else if (strcmp(command, "LOGIN") == 0 && arg_count >= 3) {
+        char *username = args[1];
+        char *password = args[2];
+        char record[KDF_RECORD_MAX];
+        kdf_job_t *job;
+        if (!user_record(username, record, sizeof(record))) {
+            reply(client, "FAIL$Invalid username or password");
+        } else if (kdf_is_hashed(record) && cred_cache_hit(username, password, record)) {
+            login_ok(client, username);  // 最近验证过的口令不再算 KDF
+        } else if (!(job = kdf_job_new(KDF_LOGIN, client, username))) {
+            reply(client, "FAIL$Invalid username or password");
+        } else {
+            snprintf(job->password, sizeof(job->password), "%s", password);
+            snprintf(job->record, sizeof(job->record), "%s", record);
+            if (kdf_submit(job) != 0) {
+                kdf_job_free(job);
+                reply(client, "FAIL$Server busy, try again later");
+            }
+        }
+    }
+    // 断线重连："RESUME$恢复令牌"，令牌有效就回到原来的账号并重发还没读的消息
+    else if (strcmp(command, "RESUME") == 0 && arg_count >= 2) {
+        unsigned char token[RESUME_TOKEN_LEN];
+        resume_t *r = NULL;
+        if (strlen(args[1]) == 2 * RESUME_TOKEN_LEN && from_hex(args[1], token, RESUME_TOKEN_LEN) == 0) {
+            r = resume_find(token);
+        }
+        if (!r || (!r->cl && r->expires <= now_ms())) {
+            reply(client, "FAIL$Session expired, please log in again");
+        } else if (r->cl == client) {
+            reply(client, "OK$Session resumed");
+        } else if (session_attach(client, r->username) != 0) {
+            reply(client, "FAIL$Session expired, please log in again");
+        } else {
+            if (client->resume) resume_free(client->resume);
+            resume_claim(r, client);
+            reply(client, "OK$Session resumed");
+            printf("User '%s' resumed from %s:%d\n", r->username, inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+            conv_replay(client);
+        }
+    }
+    // 退出登录，恢复令牌作废
+    else if (strcmp(command, "LOGOUT") == 0) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        if (client->resume) resume_free(client->resume);
+        session_detach(client);
+        reply(client, "OK$Logged out");
+    }
+    // 修改密码
+    else if (strcmp(command, "CHGPWD") == 0 && arg_count >= 3) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        char *old_pass = args[1];
+        char *new_pass = args[2];
+        kdf_job_t *job = kdf_job_new(KDF_CHGPWD, client, client->username);
+        if (!job || !user_record(client->username, job->record, sizeof(job->record))) {
+            if (job) kdf_job_free(job);
+            reply(client, "FAIL$Failed to change password");
+            return;
+        }
+        snprintf(job->password, sizeof(job->password), "%s", old_pass);
+        snprintf(job->new_pass, sizeof(job->new_pass), "%s", new_pass);
+        if (kdf_submit(job) != 0) {
+            kdf_job_free(job);
+            reply(client, "FAIL$Server busy, try again later");
+        }
+    }
+    // 添加好友
+    else if (strcmp(command, "ADDFRIEND") == 0 && arg_count >= 2) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        char *friend_name = args[1];
+        if (!user_exists(friend_name)) {
+            reply(client, "FAIL$Friend does not exist");
+        } else if (strcmp(client->username, friend_name) == 0) {
+            reply(client, "FAIL$Cannot add yourself");
+        } else {
+            add_friend(client->username, friend_name);
+            reply(client, "OK$Friend added successfully");
+        }
+    }
+    // 删除好友
+    else if (strcmp(command, "DELFRIEND") == 0 && arg_count >= 2) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        char *friend_name = args[1];
+        remove_friend(client->username, friend_name);
+        reply(client, "OK$Friend removed successfully");
+    }
+    // 好友列表（网关据此确定设备告警的订阅者）
+    else if (strcmp(command, "FRIENDS") == 0) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        char list[BUFFER_SIZE];
+        int len = list_friends(client->username, list, sizeof(list));
+        conn_send(client, list, len);
+    }
+    // 按前缀搜索用户名："SEARCH$前缀[$上一页最后一个用户名]"
+    else if (strcmp(command, "SEARCH") == 0 && arg_count >= 2) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        char list[BUFFER_SIZE];
+        int len = names_search(args[1], arg_count >= 3 && args[2][0] ? args[2] : NULL, list, sizeof(list));
+        conn_send(client, list, len);
+    }
+    // 已读回执 "READ$发送者$已显示的最大id"，客户端每次显示一批消息后按对话发一条
+    else if (strcmp(command, "READ") == 0 && arg_count >= 3) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        conversation_t *cv = conv_lookup(args[1], client->username, 0);
+        if (cv) conv_advance(cv, 0, strtoul(args[2], NULL, 10));
+    }
+    // 发送消息
+    else if (strcmp(command, "MSG") == 0 && arg_count >= 3) {
+        if (!client->logged_in) {
+            reply(client, "FAIL$Not logged in");
+            return;
+        }
+        char *recipient = args[1];
+        char *message = args[2];
+        if (!are_friends(client->username, recipient)) {
+            reply(client, "FAIL$You are not friends with this user");
+            return;
+        }
+        // 消息在对话中按 id 编号，帧 "MSG$发送者$id$正文" 只组一次，发给接收者的每个在线会话，
+        // 并记进对话日志等接收者读到。接收者刚断线、还能恢复时消息只记日志，恢复后重发。
+        // 发送者的其他设备收到 "SENT$接收者$id$正文" 副本以同步会话记录，发出命令的会话只收到 id
+        user_entry_t *to = online_lookup(recipient, 0);
+        friend_node_t *node = graph_node(recipient, 0);
+        int resumable = node && node->n_resumable > 0;
+        conversation_t *cv = to || resumable ? conv_lookup(client->username, recipient, 1) : NULL;
+        if (!cv) {
+            reply(client, "FAIL$User is not online");
+            return;
+        }
+        unsigned int id = cv->next_id++;
+        char msg_packet[BUFFER_SIZE];
+        int len = snprintf(msg_packet, sizeof(msg_packet), "MSG$%s$%u$%s", client->username, id, message);
+        if (len >= (int)sizeof(msg_packet)) len = sizeof(msg_packet) - 1;
+        int sent = 0;
+        for (int i = 0; to && i < to->n_sessions; i++) {
+            if (conn_send_msg(to->sessions[i], msg_packet, len, cv, id) == 0) sent++;
+        }
+        if (sent == 0 && !resumable) {
+            cv->next_id--;
+            reply(client, "FAIL$User is not online");
+            return;
+        }
+        conv_log(cv, id, msg_packet, len);
+        len = snprintf(msg_packet, sizeof(msg_packet), "SENT$%s$%u$%s", recipient, id, message);
+        if (len >= (int)sizeof(msg_packet)) len = sizeof(msg_packet) - 1;
+        deliver_to_user(client->username, msg_packet, len, client);
+        len = snprintf(msg_packet, sizeof(msg_packet), "SENT$%s$%u", recipient, id);
+        conn_send(client, msg_packet, len);
+    } else {
+        reply(client, "FAIL$Unknown command or wrong parameters");
+    }
 }
 
-// 检查用户是否存在
-int user_exists(const char *username) {
-    FILE *fp = fopen(USERS_FILE, "r");
-    if (!fp) return 0;
-    char line[512];
-    int found = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        char existing_user[256];
-        sscanf(line, "%s", existing_user);
-        if (strcmp(existing_user, username) == 0) {
-            found = 1;
+// 读套接字直到 EAGAIN 或接收缓冲区满，收到完整命令的连接排入就绪队列
+void conn_read(client_info_t *cl) {
+    while (!cl->eof && cl->in_len < INBUF_SIZE) {
+        ssize_t n = recv(cl->sockfd, cl->in + cl->in_len, INBUF_SIZE - cl->in_len, 0);
+        if (n > 0) {
+            cl->in_len += n;
+        } else if (n == 0) {
+            cl->eof = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
             break;
+        } else {
+            conn_close(cl, "recv error");
+            return;
         }
     }
-    fclose(fp);
-    return found;
+    if (!memchr(cl->in, '\n', cl->in_len)) {
+        if (cl->eof) {
+            conn_close(cl, "disconnected");
+        } else if (cl->in_len == INBUF_SIZE) {
+            conn_close(cl, "sent an oversized command");
+        }
+        return;
+    }
+    if (!cl->queue && !cl->pending_job) queue_push(&g_ready, cl);
+    conn_update_events(cl);
 }
 
-// 添加用户
-void register_user(const char *username, const char *password) {
-    FILE *fp = fopen(USERS_FILE, "a");
-    if (fp) {
-        fprintf(fp, "%s %s\n", username, password);
-        fclose(fp);
+// 一个连接的一轮：最多处理 TURN_BUDGET 条命令，令牌不够就转入限速队列
+void serve_turn(client_info_t *cl, long long now) {
+    int off = 0;
+    char *nl;
+    cl->need = 0;
+    for (int served = 0; served < TURN_BUDGET && !cl->closing && !cl->pending_job &&
+                         (nl = memchr(cl->in + off, '\n', cl->in_len - off)) != NULL;) {
+        char *frame = cl->in + off;
+        int len = nl - frame;
+        if (len > 0 && frame[len - 1] == '\r') len--;
+        if (len > 0) {
+            int cost = command_cost(frame, len);
+            if (!bucket_check(cl, cost, 1, now)) {
+                cl->need = cost;
+                break;
+            }
+            frame[len] = '\0';
+            handle_command(cl, frame, len);
+            served++;
+        }
+        off = nl - cl->in + 1;
+    }
+    if (cl->closing) return;
+    if (off > 0) {
+        memmove(cl->in, cl->in + off, cl->in_len - off);
+        cl->in_len -= off;
     }
+    if (cl->pending_job) {
+        // 等 KDF 任务完成后由 kdf_complete 恢复
+    } else if (memchr(cl->in, '\n', cl->in_len)) {
+        queue_push(cl->need ? &g_throttled : &g_ready, cl);
+    } else if (cl->eof) {
+        conn_close(cl, "disconnected");
+        return;
+    }
+    conn_update_events(cl);
 }
 
-// 登录验证
-int check_login(const char *username, const char *password) {
-    FILE *fp = fopen(USERS_FILE, "r");
-    if (!fp) return 0;
-    char line[512];
-    int success = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        char existing_user[256], existing_pass[256];
-        sscanf(line, "%s %s", existing_user, existing_pass);
-        if (strcmp(existing_user, username) == 0 && strcmp(existing_pass, password) == 0) {
-            success = 1;
-            break;
+// 令牌已经补够的被限速连接回到就绪队列
+void unthrottle(long long now) {
+    client_info_t *next;
+    for (client_info_t *cl = g_throttled.head; cl; cl = next) {
+        next = cl->q_next;
+        if (bucket_check(cl, cl->need, 0, now)) {
+            queue_remove(cl);
+            queue_push(&g_ready, cl);
         }
     }
-    fclose(fp);
-    return success;
 }
 
-// 修改密码
-int change_password(const char *username, const char *old_pass, const char *new_pass) {
-    FILE *fp = fopen(USERS_FILE, "r");
-    if (!fp) return -1;  // 文件无法打开
-
-    FILE *temp_fp = fopen("users.tmp", "w");
-    if (!temp_fp) {
-        fclose(fp);
-        return -1;
+// 就绪队列轮转一圈：本轮开始时排队的连接各服务一次，重新排队的留到下一轮
+void serve_round(long long now) {
+    for (int n = g_ready.n; n > 0 && g_ready.head; n--) {
+        client_info_t *cl = g_ready.head;
+        queue_remove(cl);
+        serve_turn(cl, now);
     }
+}
 
-    char line[512];
-    int found = 0;
-    int success = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        char u[256], p[256];
-        sscanf(line, "%s %s", u, p);
-        if (strcmp(u, username) == 0) {
-            found = 1;
-            if (strcmp(p, old_pass) == 0) {
-                fprintf(temp_fp, "%s %s\n", username, new_pass);
-                success = 1;
-            } else {
-                fprintf(temp_fp, "%s", line);  // 旧密码错误，写回原行
-            }
-        } else {
-            fprintf(temp_fp, "%s", line);
+// 释放本轮标记关闭的连接
+void conn_reap(void) {
+    client_info_t *keep = NULL;
+    while (g_closing) {
+        client_info_t *cl = g_closing;
+        g_closing = cl->next_closing;
+        if (cl->pending_job) {  // KDF 任务完成时还要用到它，之后再释放
+            cl->next_closing = keep;
+            keep = cl;
+            continue;
         }
+        remove_client(cl);
+        close(cl->sockfd);
+        ip_limit_put(cl->ip);
+        free(cl->out);
+        free(cl->dlv);
+        free(cl);
     }
+    g_closing = keep;
+}
 
-    fclose(fp);
-    fclose(temp_fp);
+int set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    if (found && success) {
-        remove(USERS_FILE);
-        rename("users.tmp", USERS_FILE);
-        return 1;  // 成功
-    } else {
-        remove("users.tmp");
-        if (!found) return 0;  // 用户不存在
-        return -2;             // 密码错误
+// 为已连接的套接字建立连接状态并加入 epoll，失败返回 NULL（套接字由调用者关闭）
+client_info_t *conn_new(int fd, const struct sockaddr_in *addr, long long now) {
+    client_info_t *client = calloc(1, sizeof(client_info_t));
+    if (!client || set_nonblock(fd) == -1 || !(client->ip = ip_limit_get(addr->sin_addr.s_addr, now))) {
+        perror("new client");
+        free(client);
+        return NULL;
     }
+    client->sockfd = fd;
+    client->addr = *addr;
+    client->bucket.tokens = SESSION_BURST;
+    client->bucket.last_ms = now;
+    client->events = EPOLLIN;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+    if (add_client(client) != 0 || epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        printf("Rejecting %s:%d: server full\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        remove_client(client);
+        ip_limit_put(client->ip);
+        free(client);
+        return NULL;
+    }
+    return client;
 }
 
-// 检查是否是好友
-int are_friends(const char *user1, const char *user2) {
-    FILE *fp = fopen(FRIENDS_FILE, "r");
-    if (!fp) return 0;
-    char line[512];
-    int found = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        char u1[256], u2[256];
-        sscanf(line, "%s %s", u1, u2);
-        if ((strcmp(u1, user1) == 0 && strcmp(u2, user2) == 0) ||
-            (strcmp(u1, user2) == 0 && strcmp(u2, user1) == 0)) {
-            found = 1;
-            break;
+// 接受监听队列中的全部新连接
+void accept_clients(int server_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        client_info_t *client = conn_new(client_fd, &client_addr, now_ms());
+        if (!client) {
+            close(client_fd);
+            continue;
         }
+        printf("New client connected: %s:%d\n", inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
     }
-    fclose(fp);
-    return found;
 }
 
-// 添加好友
-void add_friend(const char *user1, const char *user2) {
-    if (are_friends(user1, user2)) return;
-    FILE *fp = fopen(FRIENDS_FILE, "a");
-    if (fp) {
-        fprintf(fp, "%s %s\n", user1, user2);
-        fclose(fp);
+// 发送一条升级消息，fd >= 0 时附带这个文件描述符
+static int upgrade_sendmsg(int sock, const void *buf, size_t len, int fd) {
+    struct iovec iov = {(void *)buf, len};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (fd >= 0) {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
     }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
 }
 
-// 删除好友
-void remove_friend(const char *user1, const char *user2) {
-    FILE *fp = fopen(FRIENDS_FILE, "r");
-    if (!fp) return;
-    FILE *temp_fp = fopen("friends.tmp", "w");
-    if (!temp_fp) {
-        fclose(fp);
-        return;
-    }
-    char line[512];
-    while (fgets(line, sizeof(line), fp)) {
-        char u1[256], u2[256];
-        sscanf(line, "%s %s", u1, u2);
-        if (!((strcmp(u1, user1) == 0 && strcmp(u2, user2) == 0) ||
-              (strcmp(u1, user2) == 0 && strcmp(u2, user1) == 0))) {
-            fprintf(temp_fp, "%s", line);
+// 接收一条升级消息，长度必须正好是 len；fd 不为 NULL 时取出附带的文件描述符
+static int upgrade_recvmsg(int sock, void *buf, size_t len, int *fd) {
+    struct iovec iov = {buf, len};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf)};
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (fd) *fd = -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); n >= 0 && cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int received;
+        memcpy(&received, CMSG_DATA(cm), sizeof(int));
+        if (fd && *fd < 0) {
+            *fd = received;
+        } else {
+            close(received);
         }
     }
-    fclose(fp);
-    fclose(temp_fp);
-    remove(FRIENDS_FILE);
-    rename("friends.tmp", FRIENDS_FILE);
+    return n == (ssize_t)len && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ? 0 : -1;
 }
 
-void *handle_client(void *arg) {
-    client_info_t *client = (client_info_t *)arg;
-    char buffer[BUFFER_SIZE];
-    int recv_len;
-
-    printf("New client connected: %s:%d\n", inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+static void upgrade_timeouts(int sock) {
+    struct timeval tv = {UPGRADE_TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
 
-    while ((recv_len = recv(client->sockfd, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[recv_len] = '\0';
+// 监听 UPGRADE_PATH，等待新版本的服务器进程来接管
+int upgrade_listen(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", UPGRADE_PATH);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    unlink(UPGRADE_PATH);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &g_upgrade_fd};
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(UPGRADE_PATH, 0600) == -1 ||
+        listen(fd, 1) == -1 || epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        // Replace '$' with '\0'
-        for (int i = 0; i < recv_len; i++) {
-            if (buffer[i] == '$') {
-                buffer[i] = '\0';
-            }
-        }
+// 旧进程：把监听套接字和每个连接的套接字、登录状态、未处理和未发出的数据交给新进程，
+// 新进程确认后退出；任何一步失败都继续服务，连接不受影响
+void upgrade_handoff(int server_fd) {
+    int sock = accept(g_upgrade_fd, NULL, NULL);
+    if (sock == -1) return;
+    upgrade_timeouts(sock);
+    // 等正在算的口令哈希完成，应答进发送队列后随连接一起交接
+    for (long long deadline = now_ms() + UPGRADE_TIMEOUT_S * 1000; g_kdf_inflight > 0 && now_ms() < deadline;) {
+        struct pollfd pfd = {g_kdf_efd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) > 0) kdf_complete();
+    }
+    if (g_kdf_inflight > 0) {
+        printf("Hot upgrade postponed: password hashing still running\n");
+        close(sock);
+        return;
+    }
+    presence_flush();  // 本窗口的上下线通知和回执先进发送队列，随连接一起交接
+    acks_flush();
 
-        // 解析命令和参数, 以\0分隔
-        char *args[10];
-        int arg_count = 0;
-        args[0] = buffer;
-        arg_count++;
-        for (int i = 0; i < recv_len; i++) {
-            if (buffer[i] == '\0') {
-                if (arg_count < 10) {
-                    args[arg_count++] = &buffer[i + 1];
-                }
-            }
-        }
-        char *command = args[0];
-        printf("Received command: %s, arg_count: %d\n", command, arg_count);
-
-
-        // 注册
-        if (strcmp(command, "REG") == 0 && arg_count >= 3) {
-            char *username = args[1];
-            char *password = args[2];
-            if (user_exists(username)) {
-                const char *msg = "FAIL$User already exists";
-                send(client->sockfd, msg, strlen(msg), 0);
-            } else {
-                register_user(username, password);
-                const char *msg = "OK$Registration successful";
-                send(client->sockfd, msg, strlen(msg), 0);
-            }
+    upgrade_hdr_t hdr = {UPGRADE_MAGIC, 0, g_n_convs, 0};
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (g_clients[i] && !g_clients[i]->closing) hdr.n_clients++;
+    }
+    for (int b = 0; b < RESUME_BUCKETS; b++) {
+        for (resume_t *r = g_resume[b]; r; r = r->next) {
+            if (!r->cl) hdr.n_resume++;
         }
-        // 登录
-        else if (strcmp(command, "LOGIN") == 0 && arg_count >= 3) {
-            char *username = args[1];
-            char *password = args[2];
-            if (check_login(username, password)) {
-                client->logged_in = 1;
-                strcpy(client->username, username);
-                const char *msg = "OK$Login successful";
-                send(client->sockfd, msg, strlen(msg), 0);
-                printf("User '%s' logged in from %s:%d\n", username, inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
-            } else {
-                const char *msg = "FAIL$Invalid username or password";
-                send(client->sockfd, msg, strlen(msg), 0);
-            }
+    }
+    int ok = upgrade_sendmsg(sock, &hdr, sizeof(hdr), server_fd) == 0;
+    for (int i = 0; ok && i < MAX_CLIENTS; i++) {
+        client_info_t *cl = g_clients[i];
+        if (!cl || cl->closing) continue;
+        upgrade_conn_t st = {.addr = cl->addr, .logged_in = cl->logged_in, .want_presence = cl->want_presence,
+                             .eof = cl->eof, .in_len = cl->in_len, .out_len = cl->out_len - cl->out_off};
+        memcpy(st.username, cl->username, sizeof(st.username));
+        if (cl->resume) {
+            st.has_token = 1;
+            memcpy(st.token, cl->resume->token, RESUME_TOKEN_LEN);
         }
-        // 修改密码
-        else if (strcmp(command, "CHGPWD") == 0 && arg_count >= 3) {
-            if (!client->logged_in) {
-                const char *msg = "FAIL$Not logged in";
-                send(client->sockfd, msg, strlen(msg), 0);
-                continue;
-            }
-            char *old_pass = args[1];
-            char *new_pass = args[2];
-            int result = change_password(client->username, old_pass, new_pass);
-            if (result == 1) {
-                const char *msg = "OK$Password changed successfully";
-                send(client->sockfd, msg, strlen(msg), 0);
-            } else if (result == -2) {
-                const char *msg = "FAIL$Incorrect old password";
-                send(client->sockfd, msg, strlen(msg), 0);
-            } else {
-                const char *msg = "FAIL$Failed to change password";
-                send(client->sockfd, msg, strlen(msg), 0);
-            }
+        bucket_refill(&cl->bucket, SESSION_RATE, SESSION_BURST, now_ms());
+        st.tokens = cl->bucket.tokens;
+        ok = upgrade_sendmsg(sock, &st, sizeof(st), cl->sockfd) == 0 &&
+             (st.in_len == 0 || upgrade_sendmsg(sock, cl->in, st.in_len, -1) == 0);
+        for (int off = 0; ok && off < st.out_len; off += UPGRADE_CHUNK) {
+            int n = st.out_len - off < UPGRADE_CHUNK ? st.out_len - off : UPGRADE_CHUNK;
+            ok = upgrade_sendmsg(sock, cl->out + cl->out_off + off, n, -1) == 0;
         }
-        // 添加好友
-        else if (strcmp(command, "ADDFRIEND") == 0 && arg_count >= 2) {
-             if (!client->logged_in) {
-                const char *msg = "FAIL$Not logged in";
-                send(client->sockfd, msg, strlen(msg), 0);
-                continue;
-            }
-            char *friend_name = args[1];
-            if (!user_exists(friend_name)) {
-                const char *msg = "FAIL$Friend does not exist";
-                send(client->sockfd, msg, strlen(msg), 0);
-            } else if (strcmp(client->username, friend_name) == 0) {
-                 const char *msg = "FAIL$Cannot add yourself";
-                send(client->sockfd, msg, strlen(msg), 0);
-            }
-            else {
-                add_friend(client->username, friend_name);
-                const char *msg = "OK$Friend added successfully";
-                send(client->sockfd, msg, strlen(msg), 0);
+    }
+    for (int b = 0; ok && b < CONV_BUCKETS; b++) {
+        for (conversation_t *cv = g_convs[b]; ok && cv; cv = cv->next) {
+            upgrade_conv_t st = {.next_id = cv->next_id, .delivered = cv->delivered, .read = cv->read,
+                                 .acked_delivered = cv->acked_delivered, .acked_read = cv->acked_read,
+                                 .n_log = cv->log_n};
+            memcpy(st.from, cv->from, sizeof(st.from));
+            memcpy(st.to, cv->to, sizeof(st.to));
+            ok = upgrade_sendmsg(sock, &st, sizeof(st), -1) == 0;
+            for (int i = 0; ok && i < cv->log_n; i++) {
+                conv_msg_t *m = conv_log_at(cv, i);
+                upgrade_msg_t um = {.id = m->id, .len = m->len};
+                memcpy(um.frame, m->frame, m->len);
+                ok = upgrade_sendmsg(sock, &um, sizeof(um), -1) == 0;
             }
         }
-        // 删除好友
-        else if (strcmp(command, "DELFRIEND") == 0 && arg_count >= 2) {
-             if (!client->logged_in) {
-                const char *msg = "FAIL$Not logged in";
-                send(client->sockfd, msg, strlen(msg), 0);
-                continue;
-            }
-            char *friend_name = args[1];
-            remove_friend(client->username, friend_name);
-            const char *msg = "OK$Friend removed successfully";
-            send(client->sockfd, msg, strlen(msg), 0);
-        }
-        // 发送消息
-        else if (strcmp(command, "MSG") == 0 && arg_count >= 3) {
-            if (!client->logged_in) {
-                const char *msg = "FAIL$Not logged in";
-                send(client->sockfd, msg, strlen(msg), 0);
-                continue;
-            }
-            char *recipient = args[1];
-            char *message = args[2];
-            if (!are_friends(client->username, recipient)) {
-                 const char *msg = "FAIL$You are not friends with this user";
-                send(client->sockfd, msg, strlen(msg), 0);
-                 continue;
-            }
-            int recipient_sock = find_client_socket(recipient);
-            if (recipient_sock != -1) {
-                char msg_packet[BUFFER_SIZE];
-                int len = snprintf(msg_packet, sizeof(msg_packet), "MSG$%s$%s", client->username, message);
-                send(recipient_sock, msg_packet, len, 0);
-            } else {
-                const char *msg = "FAIL$User is not online";
-                send(client->sockfd, msg, strlen(msg), 0);
-            }
-        } else {
-             const char *msg = "FAIL$Unknown command or wrong parameters";
-            send(client->sockfd, msg, strlen(msg), 0);
+    }
+    for (int b = 0; ok && b < RESUME_BUCKETS; b++) {
+        for (resume_t *r = g_resume[b]; ok && r; r = r->next) {
+            if (r->cl) continue;
+            upgrade_resume_t st = {.expires = r->expires};
+            memcpy(st.token, r->token, RESUME_TOKEN_LEN);
+            memcpy(st.username, r->username, sizeof(st.username));
+            ok = upgrade_sendmsg(sock, &st, sizeof(st), -1) == 0;
         }
     }
+    char ack = 0;
+    if (ok && recv(sock, &ack, 1, 0) == 1 && ack == 'K') {
+        printf("Handed %d connections to the new server process, exiting\n", hdr.n_clients);
+        exit(EXIT_SUCCESS);
+    }
+    printf("Hot upgrade failed, still serving\n");
+    close(sock);
+}
 
-    if (recv_len == 0) {
-        printf("Client %s:%d disconnected\n", inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
-    } else if (recv_len == -1) {
-        perror("recv error");
+// 新进程：从旧进程接收监听套接字和全部连接，恢复成和旧进程相同的状态；返回监听套接字
+int upgrade_takeover(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", UPGRADE_PATH);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect to running server");
+        return -1;
     }
+    upgrade_timeouts(sock);
 
-    remove_client(client);
-    close(client->sockfd);
-    free(client);
-    return NULL;
+    upgrade_hdr_t hdr;
+    int server_fd;
+    if (upgrade_recvmsg(sock, &hdr, sizeof(hdr), &server_fd) != 0 || hdr.magic != UPGRADE_MAGIC || server_fd < 0) {
+        printf("Bad handoff from the running server\n");
+        return -1;
+    }
+    long long now = now_ms();
+    for (int i = 0; i < hdr.n_clients; i++) {
+        upgrade_conn_t st;
+        int fd;
+        if (upgrade_recvmsg(sock, &st, sizeof(st), &fd) != 0 || fd < 0) return -1;
+        client_info_t *cl = conn_new(fd, &st.addr, now);
+        if (!cl || st.in_len < 0 || st.in_len > INBUF_SIZE || st.out_len < 0 ||
+            (st.in_len > 0 && upgrade_recvmsg(sock, cl->in, st.in_len, NULL) != 0)) {
+            return -1;
+        }
+        cl->in_len = st.in_len;
+        if (st.out_len > 0 && !(cl->out = malloc(st.out_len))) return -1;
+        // 交接时还在发送队列中的 MSG 不再跟踪送达，接收者的 READ 回执会一并推进 delivered
+        cl->out_cap = cl->out_len = st.out_len;
+        cl->out_queued = st.out_len;
+        for (int off = 0; off < st.out_len; off += UPGRADE_CHUNK) {
+            int n = st.out_len - off < UPGRADE_CHUNK ? st.out_len - off : UPGRADE_CHUNK;
+            if (upgrade_recvmsg(sock, cl->out + off, n, NULL) != 0) return -1;
+        }
+        st.username[sizeof(st.username) - 1] = '\0';
+        if (st.logged_in && session_attach(cl, st.username) != 0) return -1;
+        if (st.logged_in && st.has_token && !resume_insert(st.token, st.username, cl, 0)) return -1;
+        cl->want_presence = st.want_presence;
+        cl->eof = st.eof;
+        cl->bucket.tokens = st.tokens;
+        if (memchr(cl->in, '\n', cl->in_len)) queue_push(&g_ready, cl);
+        conn_update_events(cl);
+    }
+    for (int i = 0; i < hdr.n_convs; i++) {
+        upgrade_conv_t st;
+        if (upgrade_recvmsg(sock, &st, sizeof(st), NULL) != 0) return -1;
+        st.from[sizeof(st.from) - 1] = st.to[sizeof(st.to) - 1] = '\0';
+        conversation_t *cv = conv_lookup(st.from, st.to, 1);
+        if (!cv) return -1;
+        cv->next_id = st.next_id;
+        cv->delivered = st.delivered;
+        cv->read = st.read;
+        cv->acked_delivered = st.acked_delivered;
+        cv->acked_read = st.acked_read;
+        for (int j = 0; j < st.n_log; j++) {
+            upgrade_msg_t um;
+            if (upgrade_recvmsg(sock, &um, sizeof(um), NULL) != 0 || um.len < 0 || um.len > BUFFER_SIZE) return -1;
+            conv_log(cv, um.id, um.frame, um.len);
+        }
+    }
+    for (int i = 0; i < hdr.n_resume; i++) {
+        upgrade_resume_t st;
+        if (upgrade_recvmsg(sock, &st, sizeof(st), NULL) != 0) return -1;
+        st.username[sizeof(st.username) - 1] = '\0';
+        if (!resume_insert(st.token, st.username, NULL, st.expires)) return -1;
+    }
+    // 恢复的会话对好友来说一直在线，不发上下线通知
+    for (friend_node_t *n = g_presence_dirty; n; n = n->next_dirty) {
+        n->dirty = 0;
+        n->announced = online_lookup(n->username, 0) != NULL;
+    }
+    g_presence_dirty = NULL;
+    if (send(sock, "K", 1, MSG_NOSIGNAL) != 1) return -1;
+    close(sock);
+    printf("Took over %d connections from the previous server process\n", hdr.n_clients);
+    return server_fd;
 }
 
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    pthread_t thread_id;
-
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+// 创建 TCP 监听套接字
+int listen_tcp(unsigned short port) {
+    struct sockaddr_in server_addr;
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
         perror("socket");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // 设置SO_REUSEADDR避免端口占用
@@ -403,57 +2909,128 @@ int main() {
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
         perror("setsockopt");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(2333);
+    server_addr.sin_port = htons(port);
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("bind");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    if (listen(server_fd, MAX_CLIENTS) == -1) {
+    if (listen(server_fd, SOMAXCONN) == -1) {
         perror("listen");
         close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// 用法：task3s       正常启动
+//       task3s -u    热升级：从同一目录下正在运行的服务器接管监听套接字和全部连接，旧进程随后退出
+//       -c <MB>      用户表页缓存的大小，默认 STORE_CACHE_MB
+int main(int argc, char *argv[]) {
+    int server_fd;
+    struct epoll_event events[MAX_EVENTS];
+    int upgrade = 0, cache_mb = STORE_CACHE_MB;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-u") == 0) {
+            upgrade = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            cache_mb = atoi(argv[++i]);
+        }
+    }
+
+    g_epfd = epoll_create1(0);
+    if (g_epfd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    if (getrandom(g_cred_key, sizeof(g_cred_key), 0) != sizeof(g_cred_key) || kdf_start() != 0) {
+        perror("password hashing workers");
         exit(EXIT_FAILURE);
     }
 
+    if (upgrade) {
+        server_fd = upgrade_takeover();
+    } else {
+        server_fd = listen_tcp(2333);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (server_fd == -1 || set_nonblock(server_fd) == -1 || epoll_ctl(g_epfd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        perror("listen socket");
+        exit(EXIT_FAILURE);
+    }
+    // 热升级时旧进程到这里已经退出，再打开用户表、加载好友，不会漏掉它最后写入的用户和好友关系
+    if (store_open(cache_mb) != 0) {
+        fprintf(stderr, "Cannot open the user store\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Loaded %d friendships from %s\n", friends_load(), FRIENDS_FILE);
+    printf("User store: %d tables, %d in memory, page cache %d MB\n", g_n_runs, g_mem_n, cache_mb);
+    printf("Indexed %d users\n", names_load());
+    if ((g_upgrade_fd = upgrade_listen()) == -1) {
+        perror("upgrade socket (hot upgrade disabled)");
+    }
     printf("Server started, waiting for connections...\n");
 
+    long long next_presence = now_ms() + PRESENCE_WINDOW_MS, next_ack = now_ms() + ACK_WINDOW_MS;
     while (1) {
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd == -1) {
-            perror("accept");
-            continue;
+        // 有就绪连接时不阻塞；只有被限速的连接时每 THROTTLE_TICK_MS 检查一次令牌
+        long long now = now_ms();
+        long long deadline = next_presence < next_ack ? next_presence : next_ack;
+        int timeout = deadline > now ? (int)(deadline - now) : 0;
+        if (g_ready.head) {
+            timeout = 0;
+        } else if (g_throttled.head && timeout > THROTTLE_TICK_MS) {
+            timeout = THROTTLE_TICK_MS;
         }
-
-        client_info_t *client = malloc(sizeof(client_info_t));
-        if (!client) {
-            perror("malloc");
-            close(client_fd);
-            continue;
+        int n = epoll_wait(g_epfd, events, MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
         }
-        client->sockfd = client_fd;
-        client->addr = client_addr;
-        client->logged_in = 0;
-        memset(client->username, 0, sizeof(client->username));
-
-        add_client(client);
-
-        if (pthread_create(&thread_id, NULL, handle_client, (void *)client) != 0) {
-            perror("pthread_create");
-            remove_client(client);
-            close(client_fd);
-            free(client);
-            continue;
+        for (int i = 0; i < n; i++) {
+            client_info_t *cl = events[i].data.ptr;
+            if (!cl) {
+                accept_clients(server_fd);
+                continue;
+            }
+            if (events[i].data.ptr == &g_upgrade_fd) {
+                upgrade_handoff(server_fd);
+                continue;
+            }
+            if (events[i].data.ptr == &g_kdf_efd) {
+                kdf_complete();
+                continue;
+            }
+            if (cl->closing) continue;
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                conn_close(cl, "hung up");
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) conn_flush(cl);
+            if (!cl->closing && (events[i].events & EPOLLIN)) conn_read(cl);
         }
 
-        pthread_detach(thread_id);
+        now = now_ms();
+        unthrottle(now);
+        serve_round(now);
+        if (now >= next_presence) {
+            presence_flush();
+            resume_sweep(now);
+            next_presence = now + PRESENCE_WINDOW_MS;
+        }
+        if (now >= next_ack) {
+            acks_flush();
+            next_ack = now + ACK_WINDOW_MS;
+        }
+        conn_reap();
     }
 
     close(server_fd);